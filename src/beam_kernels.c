@@ -0,0 +1,490 @@
+#include "tldevel.h"
+
+#include <math.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BEAM_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+#define BEAM_KERNELS_IMPORT
+#include "beam_kernels.h"
+
+static double mul_sum_scalar(double* row, const double* e, int K);
+static void scale_scalar(double* row, double s, int K);
+static float mul_sum_f_scalar(float* row, const double* e, int K);
+static void scale_f_scalar(float* row, float s, int K);
+
+#ifdef BEAM_KERNELS_X86
+static int cpu_supports(int type);
+
+static double mul_sum_sse4(double* row, const double* e, int K);
+static void scale_sse4(double* row, double s, int K);
+static float mul_sum_f_sse4(float* row, const double* e, int K);
+static void scale_f_sse4(float* row, float s, int K);
+
+static double mul_sum_avx2(double* row, const double* e, int K);
+static void scale_avx2(double* row, double s, int K);
+static float mul_sum_f_avx2(float* row, const double* e, int K);
+static void scale_f_avx2(float* row, float s, int K);
+
+static double mul_sum_avx512(double* row, const double* e, int K);
+static void scale_avx512(double* row, double s, int K);
+static float mul_sum_f_avx512(float* row, const double* e, int K);
+static void scale_f_avx512(float* row, float s, int K);
+#endif
+
+int beam_kernels_set(struct beam_kernels* k, int type)
+{
+        k->mul_sum = mul_sum_scalar;
+        k->scale = scale_scalar;
+        k->mul_sum_f = mul_sum_f_scalar;
+        k->scale_f = scale_f_scalar;
+        k->type = BEAM_KERNEL_SCALAR;
+        if(type == BEAM_KERNEL_SCALAR){
+                return OK;
+        }
+#ifdef BEAM_KERNELS_X86
+        if(!cpu_supports(type)){
+                return FAIL;
+        }
+        switch (type) {
+        case BEAM_KERNEL_SSE4:
+                k->mul_sum = mul_sum_sse4;
+                k->scale = scale_sse4;
+                k->mul_sum_f = mul_sum_f_sse4;
+                k->scale_f = scale_f_sse4;
+                break;
+        case BEAM_KERNEL_AVX2:
+                k->mul_sum = mul_sum_avx2;
+                k->scale = scale_avx2;
+                k->mul_sum_f = mul_sum_f_avx2;
+                k->scale_f = scale_f_avx2;
+                break;
+        case BEAM_KERNEL_AVX512:
+                k->mul_sum = mul_sum_avx512;
+                k->scale = scale_avx512;
+                k->mul_sum_f = mul_sum_f_avx512;
+                k->scale_f = scale_f_avx512;
+                break;
+        default:
+                return FAIL;
+        }
+        k->type = type;
+        return OK;
+#else
+        return FAIL;
+#endif
+}
+
+/* Picks the widest kernels the CPU supports that agree with the scalar
+ * code. */
+int beam_kernels_select(struct beam_kernels* k)
+{
+        int type;
+
+        for(type = BEAM_KERNEL_AVX512; type > BEAM_KERNEL_SCALAR;type--){
+                if(beam_kernels_set(k, type) == OK){
+                        if(beam_kernels_check(k) == OK){
+                                return OK;
+                        }
+                        WARNING_MSG("%s kernels differ from the scalar kernels.", beam_kernels_name(type));
+                }
+        }
+        RUN(beam_kernels_set(k, BEAM_KERNEL_SCALAR));
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Compares k against the scalar kernels for a range of row lengths,
+ * including the ones that do not fill a vector. */
+int beam_kernels_check(struct beam_kernels* k)
+{
+        double a[67];
+        double b[67];
+        double e[67];
+        float af[67];
+        float bf[67];
+        double sa,sb;
+        float sfa,sfb;
+        unsigned int x;
+        int K,i;
+
+        x = 42;
+        for(K = 1; K <= 67;K++){
+                for(i = 0; i < K;i++){
+                        x = x * 1103515245U + 12345U;
+                        a[i] = (double) (x >> 8) / 16777216.0;
+                        b[i] = a[i];
+                        af[i] = (float) a[i];
+                        bf[i] = af[i];
+                        x = x * 1103515245U + 12345U;
+                        e[i] = (double) (x >> 8) / 16777216.0;
+                }
+                sa = mul_sum_scalar(a, e, K);
+                sb = k->mul_sum(b, e, K);
+                ASSERT(fabs(sa - sb) <= 1e-12 * sa, "mul_sum differs for K = %d: %e %e", K, sa, sb);
+                scale_scalar(a, 1.0 / sa, K);
+                k->scale(b, 1.0 / sb, K);
+                sfa = mul_sum_f_scalar(af, e, K);
+                sfb = k->mul_sum_f(bf, e, K);
+                ASSERT(fabsf(sfa - sfb) <= 1e-5f * sfa, "mul_sum_f differs for K = %d: %e %e", K, sfa, sfb);
+                scale_f_scalar(af, 1.0f / sfa, K);
+                k->scale_f(bf, 1.0f / sfb, K);
+                for(i = 0; i < K;i++){
+                        ASSERT(fabs(a[i] - b[i]) <= 1e-12, "Row differs at %d (K = %d): %e %e", i, K, a[i], b[i]);
+                        ASSERT(fabsf(af[i] - bf[i]) <= 1e-5f, "Float row differs at %d (K = %d): %e %e", i, K, af[i], bf[i]);
+                }
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+const char* beam_kernels_name(int type)
+{
+        switch (type) {
+        case BEAM_KERNEL_SSE4:
+                return "SSE4";
+        case BEAM_KERNEL_AVX2:
+                return "AVX2";
+        case BEAM_KERNEL_AVX512:
+                return "AVX-512";
+        default:
+                break;
+        }
+        return "scalar";
+}
+
+double mul_sum_scalar(double* row, const double* e, int K)
+{
+        double sum = 0.0;
+        int b;
+        for(b = 0; b < K;b++){
+                row[b] *= e[b];
+                sum += row[b];
+        }
+        return sum;
+}
+
+void scale_scalar(double* row, double s, int K)
+{
+        int b;
+        for(b = 0; b < K;b++){
+                row[b] *= s;
+        }
+}
+
+float mul_sum_f_scalar(float* row, const double* e, int K)
+{
+        float sum = 0.0f;
+        int b;
+        for(b = 0; b < K;b++){
+                row[b] *= (float) e[b];
+                sum += row[b];
+        }
+        return sum;
+}
+
+void scale_f_scalar(float* row, float s, int K)
+{
+        int b;
+        for(b = 0; b < K;b++){
+                row[b] *= s;
+        }
+}
+
+#ifdef BEAM_KERNELS_X86
+
+int cpu_supports(int type)
+{
+        __builtin_cpu_init();
+        switch (type) {
+        case BEAM_KERNEL_SSE4:
+                return __builtin_cpu_supports("sse4.1");
+        case BEAM_KERNEL_AVX2:
+                return __builtin_cpu_supports("avx2");
+        case BEAM_KERNEL_AVX512:
+                return __builtin_cpu_supports("avx512f");
+        default:
+                break;
+        }
+        return 0;
+}
+
+/* SSE4 */
+__attribute__((target("sse4.1")))
+double mul_sum_sse4(double* row, const double* e, int K)
+{
+        __m128d acc0 = _mm_setzero_pd();
+        __m128d acc1 = _mm_setzero_pd();
+        __m128d r0,r1;
+        double tmp[2];
+        double sum;
+        int b;
+
+        for(b = 0; b + 4 <= K;b += 4){
+                r0 = _mm_mul_pd(_mm_loadu_pd(row + b), _mm_loadu_pd(e + b));
+                r1 = _mm_mul_pd(_mm_loadu_pd(row + b + 2), _mm_loadu_pd(e + b + 2));
+                _mm_storeu_pd(row + b, r0);
+                _mm_storeu_pd(row + b + 2, r1);
+                acc0 = _mm_add_pd(acc0, r0);
+                acc1 = _mm_add_pd(acc1, r1);
+        }
+        _mm_storeu_pd(tmp, _mm_add_pd(acc0, acc1));
+        sum = tmp[0] + tmp[1];
+        for(; b < K;b++){
+                row[b] *= e[b];
+                sum += row[b];
+        }
+        return sum;
+}
+
+__attribute__((target("sse4.1")))
+void scale_sse4(double* row, double s, int K)
+{
+        __m128d v = _mm_set1_pd(s);
+        int b;
+        for(b = 0; b + 2 <= K;b += 2){
+                _mm_storeu_pd(row + b, _mm_mul_pd(_mm_loadu_pd(row + b), v));
+        }
+        for(; b < K;b++){
+                row[b] *= s;
+        }
+}
+
+__attribute__((target("sse4.1")))
+float mul_sum_f_sse4(float* row, const double* e, int K)
+{
+        __m128 acc = _mm_setzero_ps();
+        __m128 ef,r;
+        float tmp[4];
+        float sum;
+        int b;
+
+        for(b = 0; b + 4 <= K;b += 4){
+                ef = _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(e + b)), _mm_cvtpd_ps(_mm_loadu_pd(e + b + 2)));
+                r = _mm_mul_ps(_mm_loadu_ps(row + b), ef);
+                _mm_storeu_ps(row + b, r);
+                acc = _mm_add_ps(acc, r);
+        }
+        _mm_storeu_ps(tmp, acc);
+        sum = (tmp[0] + tmp[1]) + (tmp[2] + tmp[3]);
+        for(; b < K;b++){
+                row[b] *= (float) e[b];
+                sum += row[b];
+        }
+        return sum;
+}
+
+__attribute__((target("sse4.1")))
+void scale_f_sse4(float* row, float s, int K)
+{
+        __m128 v = _mm_set1_ps(s);
+        int b;
+        for(b = 0; b + 4 <= K;b += 4){
+                _mm_storeu_ps(row + b, _mm_mul_ps(_mm_loadu_ps(row + b), v));
+        }
+        for(; b < K;b++){
+                row[b] *= s;
+        }
+}
+
+/* AVX2 */
+__attribute__((target("avx2")))
+double mul_sum_avx2(double* row, const double* e, int K)
+{
+        __m256d acc0 = _mm256_setzero_pd();
+        __m256d acc1 = _mm256_setzero_pd();
+        __m256d r0,r1;
+        __m128d h;
+        double sum;
+        int b;
+
+        for(b = 0; b + 8 <= K;b += 8){
+                r0 = _mm256_mul_pd(_mm256_loadu_pd(row + b), _mm256_loadu_pd(e + b));
+                r1 = _mm256_mul_pd(_mm256_loadu_pd(row + b + 4), _mm256_loadu_pd(e + b + 4));
+                _mm256_storeu_pd(row + b, r0);
+                _mm256_storeu_pd(row + b + 4, r1);
+                acc0 = _mm256_add_pd(acc0, r0);
+                acc1 = _mm256_add_pd(acc1, r1);
+        }
+        if(b + 4 <= K){
+                r0 = _mm256_mul_pd(_mm256_loadu_pd(row + b), _mm256_loadu_pd(e + b));
+                _mm256_storeu_pd(row + b, r0);
+                acc0 = _mm256_add_pd(acc0, r0);
+                b += 4;
+        }
+        acc0 = _mm256_add_pd(acc0, acc1);
+        h = _mm_add_pd(_mm256_castpd256_pd128(acc0), _mm256_extractf128_pd(acc0, 1));
+        sum = _mm_cvtsd_f64(_mm_add_sd(h, _mm_unpackhi_pd(h, h)));
+        for(; b < K;b++){
+                row[b] *= e[b];
+                sum += row[b];
+        }
+        return sum;
+}
+
+__attribute__((target("avx2")))
+void scale_avx2(double* row, double s, int K)
+{
+        __m256d v = _mm256_set1_pd(s);
+        int b;
+        for(b = 0; b + 4 <= K;b += 4){
+                _mm256_storeu_pd(row + b, _mm256_mul_pd(_mm256_loadu_pd(row + b), v));
+        }
+        for(; b < K;b++){
+                row[b] *= s;
+        }
+}
+
+__attribute__((target("avx2")))
+float mul_sum_f_avx2(float* row, const double* e, int K)
+{
+        __m256 acc = _mm256_setzero_ps();
+        __m256 ef,r;
+        __m128 h;
+        float sum;
+        int b;
+
+        for(b = 0; b + 8 <= K;b += 8){
+                ef = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm256_cvtpd_ps(_mm256_loadu_pd(e + b))), _mm256_cvtpd_ps(_mm256_loadu_pd(e + b + 4)), 1);
+                r = _mm256_mul_ps(_mm256_loadu_ps(row + b), ef);
+                _mm256_storeu_ps(row + b, r);
+                acc = _mm256_add_ps(acc, r);
+        }
+        h = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+        h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+        h = _mm_add_ss(h, _mm_shuffle_ps(h, h, 1));
+        sum = _mm_cvtss_f32(h);
+        for(; b < K;b++){
+                row[b] *= (float) e[b];
+                sum += row[b];
+        }
+        return sum;
+}
+
+__attribute__((target("avx2")))
+void scale_f_avx2(float* row, float s, int K)
+{
+        __m256 v = _mm256_set1_ps(s);
+        int b;
+        for(b = 0; b + 8 <= K;b += 8){
+                _mm256_storeu_ps(row + b, _mm256_mul_ps(_mm256_loadu_ps(row + b), v));
+        }
+        for(; b < K;b++){
+                row[b] *= s;
+        }
+}
+
+/* AVX-512; the tail is handled with masked loads and stores */
+__attribute__((target("avx512f")))
+static inline __m512 combine_ps256(__m256 lo, __m256 hi)
+{
+        /* _mm512_insertf32x8 would need AVX512DQ */
+        return _mm512_castpd_ps(_mm512_insertf64x4(_mm512_castps_pd(_mm512_castps256_ps512(lo)), _mm256_castps_pd(hi), 1));
+}
+
+__attribute__((target("avx512f")))
+double mul_sum_avx512(double* row, const double* e, int K)
+{
+        __m512d acc = _mm512_setzero_pd();
+        __m512d r;
+        __mmask8 m;
+        int b;
+
+        for(b = 0; b + 8 <= K;b += 8){
+                r = _mm512_mul_pd(_mm512_loadu_pd(row + b), _mm512_loadu_pd(e + b));
+                _mm512_storeu_pd(row + b, r);
+                acc = _mm512_add_pd(acc, r);
+        }
+        if(b < K){
+                m = (__mmask8) ((1U << (K - b)) - 1U);
+                r = _mm512_mul_pd(_mm512_maskz_loadu_pd(m, row + b), _mm512_maskz_loadu_pd(m, e + b));
+                _mm512_mask_storeu_pd(row + b, m, r);
+                acc = _mm512_add_pd(acc, r);
+        }
+        return _mm512_reduce_add_pd(acc);
+}
+
+__attribute__((target("avx512f")))
+void scale_avx512(double* row, double s, int K)
+{
+        __m512d v = _mm512_set1_pd(s);
+        __mmask8 m;
+        int b;
+        for(b = 0; b + 8 <= K;b += 8){
+                _mm512_storeu_pd(row + b, _mm512_mul_pd(_mm512_loadu_pd(row + b), v));
+        }
+        if(b < K){
+                m = (__mmask8) ((1U << (K - b)) - 1U);
+                _mm512_mask_storeu_pd(row + b, m, _mm512_mul_pd(_mm512_maskz_loadu_pd(m, row + b), v));
+        }
+}
+
+__attribute__((target("avx512f")))
+float mul_sum_f_avx512(float* row, const double* e, int K)
+{
+        __m512 acc = _mm512_setzero_ps();
+        __m512 ef,r;
+        __mmask16 m;
+        __mmask8 m0,m1;
+        int b;
+
+        for(b = 0; b + 16 <= K;b += 16){
+                ef = combine_ps256(_mm512_cvtpd_ps(_mm512_loadu_pd(e + b)), _mm512_cvtpd_ps(_mm512_loadu_pd(e + b + 8)));
+                r = _mm512_mul_ps(_mm512_loadu_ps(row + b), ef);
+                _mm512_storeu_ps(row + b, r);
+                acc = _mm512_add_ps(acc, r);
+        }
+        if(b < K){
+                m = (__mmask16) ((1U << (K - b)) - 1U);
+                m0 = (__mmask8) (m & 0xFF);
+                m1 = (__mmask8) (m >> 8);
+                ef = combine_ps256(_mm512_cvtpd_ps(_mm512_maskz_loadu_pd(m0, e + b)), _mm512_cvtpd_ps(_mm512_maskz_loadu_pd(m1, e + b + 8)));
+                r = _mm512_mul_ps(_mm512_maskz_loadu_ps(m, row + b), ef);
+                _mm512_mask_storeu_ps(row + b, m, r);
+                acc = _mm512_add_ps(acc, r);
+        }
+        return _mm512_reduce_add_ps(acc);
+}
+
+__attribute__((target("avx512f")))
+void scale_f_avx512(float* row, float s, int K)
+{
+        __m512 v = _mm512_set1_ps(s);
+        __mmask16 m;
+        int b;
+        for(b = 0; b + 16 <= K;b += 16){
+                _mm512_storeu_ps(row + b, _mm512_mul_ps(_mm512_loadu_ps(row + b), v));
+        }
+        if(b < K){
+                m = (__mmask16) ((1U << (K - b)) - 1U);
+                _mm512_mask_storeu_ps(row + b, m, _mm512_mul_ps(_mm512_maskz_loadu_ps(m, row + b), v));
+        }
+}
+#endif
+
+#ifdef ITESTBEAMKERNELS
+
+int main(void)
+{
+        struct beam_kernels k;
+        int type;
+
+        for(type = BEAM_KERNEL_SCALAR; type <= BEAM_KERNEL_AVX512;type++){
+                if(beam_kernels_set(&k, type) == OK){
+                        RUN(beam_kernels_check(&k));
+                        LOG_MSG("%s kernels agree with the scalar kernels.", beam_kernels_name(type));
+                }else{
+                        LOG_MSG("%s kernels not supported.", beam_kernels_name(type));
+                }
+        }
+        RUN(beam_kernels_select(&k));
+        LOG_MSG("Selected %s kernels.", beam_kernels_name(k.type));
+        return EXIT_SUCCESS;
+ERROR:
+        return EXIT_FAILURE;
+}
+#endif
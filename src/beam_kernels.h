@@ -0,0 +1,40 @@
+#ifndef BEAM_KERNELS_H
+#define BEAM_KERNELS_H
+
+#ifdef BEAM_KERNELS_IMPORT
+#define EXTERN
+#else
+#define EXTERN extern
+#endif
+
+/* Row kernels for the forward filter of the beam sampler. mul_sum
+ * multiplies a row by the emission probabilities in place and returns
+ * the row sum; scale multiplies a row by a constant. The _f variants
+ * work on single precision rows (emissions stay in double). */
+
+#define BEAM_KERNEL_SCALAR 0
+#define BEAM_KERNEL_SSE4 1
+#define BEAM_KERNEL_AVX2 2
+#define BEAM_KERNEL_AVX512 3
+
+/* Rows handed to the kernels should be padded and aligned to this
+ * many bytes */
+#define BEAM_ROW_ALIGN 64
+
+struct beam_kernels{
+        double (*mul_sum)(double* row, const double* e, int K);
+        void (*scale)(double* row, double s, int K);
+        float (*mul_sum_f)(float* row, const double* e, int K);
+        void (*scale_f)(float* row, float s, int K);
+        int type;
+};
+
+EXTERN int beam_kernels_set(struct beam_kernels* k, int type);
+EXTERN int beam_kernels_select(struct beam_kernels* k);
+EXTERN int beam_kernels_check(struct beam_kernels* k);
+EXTERN const char* beam_kernels_name(int type);
+
+#undef BEAM_KERNELS_IMPORT
+#undef EXTERN
+
+#endif
@@ -24,6 +24,10 @@
 #include "finite_hmm.h"
 
 #include "thread_data.h"
+#include "beam_scheduler.h"
+#include "beam_kernels.h"
+#include "wall_clock.h"
+#include "shard.h"
 
 #include "fast_hmm_param_test_functions.h"
 
@@ -31,6 +35,9 @@
 #define BEAM_SAMPLE_IMPORT
 #include "beam_sample.h"
 
+/* targeted no path retries before all slice variables are resampled */
+#define MAX_TARGETED_RETRIES 10
+
 //void* do_sample_path_and_posterior(void* threadarg);
 void* do_dynamic_programming(void *threadarg);
 void* do_forward_backward(void *threadarg);
@@ -46,18 +53,27 @@ int transfer_counts(struct ihmm_model* ihmm, double** t, double** e);
 //static int assign_posterior_probabilities_to_sampled_path(double** F,double** B,double** E, struct ihmm_sequence* ihmm_seq );
 
 //static int set_u(struct seq_buffer* sb, struct ihmm_model* model, double* min_u);
-int set_u_multi(struct model_bag* model_bag, struct fast_param_bag*  ft_bag, struct tl_seq_buffer* sb);
+int set_u_multi(struct model_bag* model_bag, struct fast_param_bag*  ft_bag, struct tl_seq_buffer* sb, int only_failed, int num_threads);
 
 
-static int set_u(struct tl_seq_buffer* sb, struct ihmm_model* model, struct fast_hmm_param* ft, double* min_u, int model_index);
+static double set_u(struct fast_hmm_param* ft, uint16_t* label, double* u, int len, int seq_index);
+static double store_u_float(double* u, float* u_f, int len);
+static double* get_u(struct fast_hmm_param* ft, struct seq_ihmm_data* d, int model_index, int len, int seq_index, double* buf);
 
 int reset_u_if_no_path(struct fast_hmm_param* ft, double* u,int * label, int len, rk_state* rndstate);
 
 
 
 
-static int detect_valid_path(struct tl_seq_buffer* sb,int num_models, int* no_path);
-static int reset_valid_path(struct tl_seq_buffer* sb,int num_models);
+static int detect_valid_path(struct tl_seq_buffer* sb,int num_models, uint8_t* failed, int* no_path);
+static int reset_valid_path(struct tl_seq_buffer* sb,int num_models, uint8_t* batch);
+static int run_block_sweep(struct seqer_thread_data** td, struct tl_seq_buffer* sb, uint8_t* blocked, uint8_t* include, int block_len, int iteration, int num_threads);
+static int sample_block(struct seqer_thread_data* data, int seq_index, int lo, int hi);
+static double* get_u_range(struct fast_hmm_param* ft, struct seq_ihmm_data* d, int model_index, int len, int seq_index, int lo, int hi, double* buf);
+static int pick_batch(struct model_bag* model_bag, struct beam_sampling_param* bp, int* order, uint8_t* batch, int num_seq, int* batch_size);
+static int run_sweep(struct seqer_thread_data** td, struct beam_scheduler* sched, uint8_t* include, int num_threads);
+static void record_label_diff(struct seq_ihmm_data* d, int model_index, int len);
+static int update_shared_model(struct ihmm_model* ihmm, struct count_cache* cc, struct tl_seq_buffer* sb, struct shard* shard, int model_index, int num_threads);
        
 
 static int expand_ihmms(struct model_bag* model_bag, struct fast_param_bag* ft_bag);
@@ -68,33 +84,118 @@ static int get_max_to_last_state_transition(struct fast_hmm_param*ft,double* max
 //static int check_if_ft_is_indexable(struct fast_hmm_param* ft, int num_states);
 
 int dynamic_programming(struct seqer_thread_data* data, int target);
-static int dynamic_programming_clean(struct fast_hmm_param* ft,  double** matrix,uint8_t* seq,uint16_t* label,double* u,int len,uint8_t* has_path ,rk_state* random);
+static int dynamic_programming_clean(struct fast_hmm_param* ft,  double** matrix,uint8_t* seq,uint16_t* label,double* u,int len,uint8_t* has_path ,rk_state* random, const struct beam_kernels* kern, int left, int right);
+static int sample_path(struct fast_hmm_param* ft, void** matrix, int single, uint16_t* label, double* u, int len, uint8_t* has_path, rk_state* random, int right);
+static inline double row_get(const void* row, int single, int a);
+static int dynamic_programming_lockstep(struct fast_param_bag* ft_bag, double*** matrix, uint8_t* seq, struct seq_ihmm_data* d, double** u, int len, rk_state* random, const struct beam_kernels* kern);
+static int dynamic_programming_clean_f(struct fast_hmm_param* ft,  float** matrix,uint8_t* seq,uint16_t* label,double* u,int len,uint8_t* has_path ,rk_state* random, const struct beam_kernels* kern, int left, int right);
 //int forward_slice(double** matrix,struct fast_hmm_param* ft, struct ihmm_sequence* ihmm_seq, double* score);
 //int backward_slice(double** matrix,struct fast_hmm_param* ft, struct ihmm_sequence* ihmm_seq, double* score);
 //int collect_slice(struct seqer_thread_data* data,struct ihmm_sequence* ihmm_seq, double total);
 
-int run_beam_sampling(struct model_bag* model_bag, struct fast_param_bag* ft_bag, struct tl_seq_buffer* sb,struct seqer_thread_data** td, int iterations, int num_threads)
+void init_beam_sampling_param(struct beam_sampling_param* bp, int iterations, int num_threads)
+{
+        bp->iterations = iterations;
+        bp->num_threads = num_threads;
+        bp->batch_size = 0;
+        bp->batch_growth = 1.0;
+        bp->block_len = 0;
+        bp->shard = NULL;
+}
+
+int run_beam_sampling(struct model_bag* model_bag, struct fast_param_bag* ft_bag, struct tl_seq_buffer* sb,struct seqer_thread_data** td, struct beam_sampling_param* bp)
 {
         struct seq_ihmm_data* d;
+        struct beam_scheduler* sched = NULL;
+        struct beam_kernels kern;
+        struct count_cache* cc = NULL;
         uint16_t** tmp = NULL;
+        uint8_t* failed = NULL;
+        uint8_t* batch = NULL;
+        uint8_t* inc = NULL;
+        uint8_t* blocked = NULL;
+        uint8_t* whole = NULL;
+        int* order = NULL;
+        int* cost = NULL;
         int i;
         int iter;
+        int iterations;
+        int num_threads;
+        int batch_size;
+        int c;
         int no_path;
+        int relabelled;
+        int attempt;
+        int recover_rounds = 0;
+        int recover_pairs = 0;
+        int full_restarts = 0;
         //struct fast_hmm_param* ft = NULL;
         ASSERT(model_bag != NULL, "no model.");
         ASSERT(sb,"no sequence buffer");
         ASSERT(sb->num_seq > 0, "No sequences");
         ASSERT(ft_bag != NULL, "No transition struct");
+        ASSERT(bp != NULL, "No sampling parameters");
+        iterations = bp->iterations;
+        num_threads = bp->num_threads;
         ASSERT(iterations >= 1, "No iterations");
         ASSERT(num_threads > 0, "No threads");
 
         init_logsum();
+
+        /* sequences are handed out longest first  */
+        RUN(alloc_beam_scheduler(&sched, num_threads, sb->num_seq));
+        MMALLOC(cost, sizeof(int) * sb->num_seq);
+        for(i = 0; i < sb->num_seq;i++){
+                cost[i] = sb->sequences[i]->len;
+        }
+        RUN(beam_scheduler_set_cost(sched, cost, sb->num_seq));
+        MFREE(cost);
+        MMALLOC(failed, sizeof(uint8_t) * sb->num_seq);
+        if(bp->batch_size > 0){
+                MMALLOC(batch, sizeof(uint8_t) * sb->num_seq);
+                MMALLOC(order, sizeof(int) * sb->num_seq);
+                for(i = 0; i < sb->num_seq;i++){
+                        order[i] = i;
+                }
+        }
+        if(bp->block_len > 0 && sb->max_len > bp->block_len){
+                MMALLOC(blocked, sizeof(uint8_t) * sb->num_seq);
+                MMALLOC(whole, sizeof(uint8_t) * sb->num_seq);
+                c = 0;
+                for(i = 0; i < sb->num_seq;i++){
+                        blocked[i] = sb->sequences[i]->len > bp->block_len;
+                        c += blocked[i];
+                }
+                LOG_MSG("%d sequences are sampled in blocks of %d.", c, bp->block_len);
+        }
+        /* counts are rebuilt in the first iteration  */
+        MMALLOC(cc, sizeof(struct count_cache) * model_bag->num_models);
+        for(i = 0; i < model_bag->num_models;i++){
+                cc[i].m = NULL;
+                cc[i].e = NULL;
+                cc[i].alloc_K = 0;
+                cc[i].L = 0;
+                cc[i].valid = 0;
+        }
+        RUN(beam_kernels_select(&kern));
+        LOG_MSG("Using %s row kernels (%s precision).", beam_kernels_name(kern.type), td[0]->dyn_f ? "single" : "double");
+        for(i = 0; i < num_threads;i++){
+                td[i]->ft_bag = ft_bag;
+                td[i]->sb = sb;
+                td[i]->kern = &kern;
+        }
+
         //RUN(check_labels(sb,model_bag->num_models ));
         //exit(0);
         no_path = 0;                            /* Assume that we don't have a path in the first iteration */
         for(iter = 0;iter < iterations;iter++){//}iterations;iter++){
                 /* shuffle and sub-sample sequences (or not...) */
                 //RUN(shuffle_sequences_in_buffer(sb));
+                batch_size = sb->num_seq;
+                if(order){
+                        RUN(pick_batch(model_bag, bp, order, batch, sb->num_seq, &batch_size));
+                }
+                inc = (batch_size < sb->num_seq) ? batch : NULL;
                 /* sample transitions / emission */
                 ft_bag->max_last_state = -1;
                 //model_bag->max_num_states = -1;
@@ -104,11 +205,16 @@ int run_beam_sampling(struct model_bag* model_bag, struct fast_param_bag* ft_bag
                 //LOG_MSG("Done");
                 if(!no_path){
                         for(i = 0; i < model_bag->num_models;i++){
+                                if(bp->shard){
+                                        RUN(update_shared_model(model_bag->models[i], &cc[i], sb, bp->shard, i, num_threads));
+                                        LOG_MSG("Iteration %d Model %d (%d states)  alpha = %f, gamma = %f", iter,i, model_bag->models[i]->num_states, model_bag->models[i]->alpha ,model_bag->models[i]->gamma);
+                                        continue;
+                                }
                                 //LOG_MSG("removing unused states");
-                                RUN(remove_unused_states_labels(model_bag->models[i], sb,i ));
+                                RUN(remove_unused_states_labels(model_bag->models[i], sb,i, &relabelled, num_threads));
                                 //LOG_MSG("fill counts");
 
-                                RUN(fill_counts(model_bag->models[i], sb,i));
+                                RUN(refresh_counts(model_bag->models[i], &cc[i], sb, i, relabelled, num_threads));
                                 //print_counts(model_bag->models[i]);
                                 //exit(0);
                                 RUN(add_pseudocounts_emission(model_bag->models[i], 0.01 ));
@@ -119,66 +225,77 @@ int run_beam_sampling(struct model_bag* model_bag, struct fast_param_bag* ft_bag
                         }
                 }
 
+                attempt = 0;
                 no_path = 1;
+                RUN(beam_scheduler_clear(sched));
                 while(no_path){
-                        no_path = 0;
-                        ft_bag->max_last_state = -1;
-                        for(i = 0; i < model_bag->num_models;i++){
-                                RUN(fill_fast_transitions(model_bag->models[i], ft_bag->fast_params[i]));
-                                ft_bag->max_last_state = MACRO_MAX(ft_bag->max_last_state,ft_bag->fast_params[i]->last_state);
-                                //LOG_MSG("DEBUGGING: %d %d", model_bag->models[i]->num_states,ft_bag->fast_params[i]->last_state);
-                                //print_fast_hmm_params(ft_bag->fast_params[i]);
-                        }
-                        //LOG_MSG("DEBUGGING OUT");
-                        /* Set U */ //for(i = 0; i < model_bag->num_models;i++){
-                        //       RUN(fill_fast_transitions(model_bag->models[i], ft_bag->fast_params[i]));
-
-                        //      ft_bag->max_last_state = MACRO_MAX(ft_bag->max_last_state,ft_bag->fast_params[i]->last_state);
-                        //}
-                        RUN(reset_valid_path(sb,model_bag->num_models));
-                        RUN(set_u_multi(model_bag, ft_bag, sb));
-//RUN(set_u(sb,model,ft, &min_u));
-                        //exit(0);
-                        RUN(expand_ihmms(model_bag, ft_bag));
-
-                        RUN(sort_fast_parameters(ft_bag));
-
-                        //RUN(resize_seqer_thread_data(td, &num_threads,(sb->max_len+2)  , ft_bag->max_last_state));
-                        /*for(i = 0; i < model_bag->num_models;i++){
-                          LOG_MSG("Iteration %d Model %d (%d states)  alpha = %f, gamma = %f", iter,i, model_bag->models[i]->num_states, model_bag->models[i]->alpha ,model_bag->models[i]->gamma);
-                          }*/
-                        //LOG_MSG("Iteration %d (%d states) sampling %d ", iter, model->num_states,sb->num_seq);
-                        //exit(0);
-                        //dyn prog + labelling
-                        for(i = 0; i < num_threads;i++){
-                                td[i]->ft_bag = ft_bag;
-                                //td[i]->ft = ft;
-                                td[i]->sb = sb;
-                                td[i]->thread_ID = i;
-                        }
-#ifdef HAVE_OPENMP
-                        omp_set_num_threads(num_threads);
-#pragma omp parallel shared(td) private(i)
-                        {
-#pragma omp for schedule(dynamic) nowait
-#endif
-                                for(i = 0; i < num_threads;i++){
-                                        do_dynamic_programming(td[i]);
+                        if(attempt == 0 || attempt > MAX_TARGETED_RETRIES){
+                                /* full sweep: refill all transitions and
+                                   resample u for every sequence */
+                                if(attempt){
+                                        full_restarts++;
                                 }
-#ifdef HAVE_OPENMP
+                                ft_bag->max_last_state = -1;
+                                for(i = 0; i < model_bag->num_models;i++){
+                                        RUN(fill_fast_transitions(model_bag->models[i], ft_bag->fast_params[i], num_threads));
+                                        ft_bag->max_last_state = MACRO_MAX(ft_bag->max_last_state,ft_bag->fast_params[i]->last_state);
+                                }
+                                /* sequences outside the batch are
+                                   marked as done and keep their labels */
+                                RUN(reset_valid_path(sb,model_bag->num_models, inc));
+                                RUN(set_u_multi(model_bag, ft_bag, sb, inc != NULL, num_threads));
+                                if(bp->shard){
+                                        RUN(shard_allreduce_min(bp->shard, model_bag->min_u, model_bag->num_models));
+                                }
+                                RUN(expand_ihmms(model_bag, ft_bag));
+                                RUN(sort_fast_parameters(ft_bag));
+                                attempt = 0;
+                                if(blocked){
+                                        /* long sequences never end up
+                                           without a path: a failing
+                                           block keeps its labels */
+                                        /* training_iterations carries on
+                                           across calls; iter restarts */
+                                        RUN(run_block_sweep(td, sb, blocked, inc, bp->block_len, model_bag->models[0]->training_iterations, num_threads));
+                                        for(i = 0; i < sb->num_seq;i++){
+                                                whole[i] = !blocked[i] && (inc == NULL || inc[i]);
+                                        }
+                                        RUN(run_sweep(td, sched, whole, num_threads));
+                                }else{
+                                        RUN(run_sweep(td, sched, inc, num_threads));
+                                }
+                        }else{
+                                /* targeted recovery: keep the parameters
+                                   and the paths already sampled; only
+                                   sequence / model pairs without a path
+                                   get new slice variables and are rerun */
+                                recover_rounds++;
+                                recover_pairs += no_path;
+                                RUN(set_u_multi(model_bag, ft_bag, sb, 1, num_threads));
+                                if(bp->shard){
+                                        RUN(shard_allreduce_min(bp->shard, model_bag->min_u, model_bag->num_models));
+                                }
+                                RUN(expand_ihmms(model_bag, ft_bag));
+                                RUN(sort_fast_parameters(ft_bag));
+                                RUN(run_sweep(td, sched, failed, num_threads));
+                        }
+                        attempt++;
+                        RUN(detect_valid_path(sb,model_bag->num_models, failed, &no_path));
+                        if(bp->shard){
+                                /* all processes retry together */
+                                RUN(shard_allreduce_sum_int(bp->shard, &no_path, 1));
                         }
-#endif
-
-                        no_path = 0;
-                        RUN(detect_valid_path(sb,model_bag->num_models, &no_path));
                         if(no_path){
-                                LOG_MSG("weird split must have happened. %d",iter);
-                                iterations++;
+                                LOG_MSG("Iteration %d: no path for %d sequence / model pairs.", iter, no_path);
                         }
                 }
+                RUN(beam_scheduler_report(sched, iter));
                 /* swap tmp label with label */
                 tmp = NULL;
                 for(i = 0; i < sb->num_seq;i++){
+                        if(inc && !inc[i]){
+                                continue;
+                        }
                         d = sb->sequences[i]->data;
                         tmp = d->label_arr;
                         d->label_arr = d->tmp_label_arr;
@@ -189,45 +306,334 @@ int run_beam_sampling(struct model_bag* model_bag, struct fast_param_bag* ft_bag
                         model_bag->models[i]->training_iterations++;
                 }
         }
+        if(recover_rounds || full_restarts){
+                LOG_MSG("No path recovery: %d targeted rounds (%d sequence / model pairs resampled), %d full restarts.", recover_rounds, recover_pairs, full_restarts);
+        }
+        for(i = 0; i < num_threads;i++){
+                td[i]->sched = NULL;
+                td[i]->kern = NULL;
+        }
+        MFREE(failed);
+        if(blocked){
+                MFREE(blocked);
+        }
+        if(whole){
+                MFREE(whole);
+        }
+        if(batch){
+                MFREE(batch);
+        }
+        if(order){
+                MFREE(order);
+        }
+        for(i = 0; i < model_bag->num_models;i++){
+                free_count_cache(&cc[i]);
+        }
+        MFREE(cc);
+        free_beam_scheduler(sched);
+        return OK;
+ERROR:
+        if(cost){
+                MFREE(cost);
+        }
+        if(failed){
+                MFREE(failed);
+        }
+        if(blocked){
+                MFREE(blocked);
+        }
+        if(whole){
+                MFREE(whole);
+        }
+        if(batch){
+                MFREE(batch);
+        }
+        if(order){
+                MFREE(order);
+        }
+        if(cc){
+                for(i = 0; i < model_bag->num_models;i++){
+                        free_count_cache(&cc[i]);
+                }
+                MFREE(cc);
+        }
+        free_beam_scheduler(sched);
+        return FAIL;
+}
+
+/* Sharded version of the parameter update: state usage and counts are
+ * summed over all processes, the coordinator samples the hyper
+ * parameters and every process continues from its result. */
+int update_shared_model(struct ihmm_model* ihmm, struct count_cache* cc, struct tl_seq_buffer* sb, struct shard* shard, int model_index, int num_threads)
+{
+        int* used = NULL;
+        int relabelled;
+
+        MMALLOC(used, sizeof(int) * ihmm->num_states);
+        RUN(count_used_states(ihmm, sb, model_index, used, num_threads));
+        RUN(shard_allreduce_sum_int(shard, used, ihmm->num_states));
+        RUN(relabel_used_states(ihmm, sb, model_index, used, &relabelled, num_threads));
+        MFREE(used);
+        used = NULL;
+
+        /* the local cache stays local; the model holds the sum */
+        RUN(refresh_counts(ihmm, cc, sb, model_index, relabelled, num_threads));
+        RUN(shard_reduce_counts(shard, ihmm));
+        RUN(add_pseudocounts_emission(ihmm, 0.01));
+        if(shard->rank == 0){
+                RUN(iHmmHyperSample(ihmm, 20));
+        }
+        RUN(shard_broadcast_hyper(shard, ihmm));
         return OK;
 ERROR:
+        if(used){
+                MFREE(used);
+        }
         return FAIL;
 }
 
+/* Runs the dynamic programming over all sequences (include == NULL) or
+ * over the sequences marked in include. */
+int run_sweep(struct seqer_thread_data** td, struct beam_scheduler* sched, uint8_t* include, int num_threads)
+{
+        double wall;
+        int i;
 
-int detect_valid_path(struct tl_seq_buffer* sb,int num_models, int* no_path)
+        for(i = 0; i < num_threads;i++){
+                td[i]->sched = sched;
+                td[i]->thread_ID = i;
+        }
+        RUN(beam_scheduler_reset_subset(sched, include));
+        wall = wall_clock();
+#ifdef HAVE_OPENMP
+        omp_set_num_threads(num_threads);
+#pragma omp parallel shared(td) private(i)
+        {
+#pragma omp for schedule(dynamic) nowait
+#endif
+                for(i = 0; i < num_threads;i++){
+                        do_dynamic_programming(td[i]);
+                }
+#ifdef HAVE_OPENMP
+        }
+#endif
+        wall = wall_clock() - wall;
+        RUN(beam_scheduler_add_sweep(sched, wall));
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+
+/* Counts sequence / model pairs without a path and marks the sequences
+ * they belong to in failed. */
+int detect_valid_path(struct tl_seq_buffer* sb,int num_models, uint8_t* failed, int* no_path)
 {
         struct seq_ihmm_data* d = NULL;
         int i,j;
 
         *no_path = 0;
         for(i = 0; i < sb->num_seq;i++){
+                d = sb->sequences[i]->data;
+                failed[i] = 0;
                 for(j = 0; j < num_models;j++){
-                        d = sb->sequences[i]->data;
                         if(d->has_path[j] == 0){
-                                //LOG_MSG("weird split must have happened in seq %d m%d",i,j);
-                                *no_path = 1;
-                                return OK;
+                                failed[i] = 1;
+                                *no_path = *no_path + 1;
+                        }
+                }
+        }
+        return OK;
+
+}
+
+/* Samples the sequences marked in blocked (and include, if given) in
+ * blocks. Every (block_len+1)-th position keeps its label; given these
+ * the stretches in between are independent and are sampled in
+ * parallel. The fixed positions move by half a block in odd
+ * iterations (iteration is the model's training_iterations). */
+int run_block_sweep(struct seqer_thread_data** td, struct tl_seq_buffer* sb, uint8_t* blocked, uint8_t* include, int block_len, int iteration, int num_threads)
+{
+        struct tl_seq* s = NULL;
+        struct seq_ihmm_data* d = NULL;
+        int* block = NULL;      /* sequence, start, end (exclusive) */
+        int num_blocks;
+        int alloc_blocks;
+        int num_models;
+        int offset;
+        int status;
+        int i,j,c;
+        int lo;
+
+        num_models = td[0]->ft_bag->num_models;
+        offset = (iteration & 1) ? (block_len + 1) / 2 : 0;
+
+        alloc_blocks = 0;
+        for(i = 0; i < sb->num_seq;i++){
+                if(blocked[i] && (include == NULL || include[i])){
+                        alloc_blocks += sb->sequences[i]->len / (block_len + 1) + 2;
+                }
+        }
+        if(!alloc_blocks){
+                return OK;
+        }
+        MMALLOC(block, sizeof(int) * 3 * alloc_blocks);
+        num_blocks = 0;
+        for(i = 0; i < sb->num_seq;i++){
+                if(!blocked[i] || (include && !include[i])){
+                        continue;
+                }
+                s = sb->sequences[i];
+                d = s->data;
+                lo = 0;
+                for(c = offset; c < s->len; c += block_len + 1){
+                        for(j = 0; j < num_models;j++){
+                                d->tmp_label_arr[j][c] = d->label_arr[j][c];
                         }
+                        if(c > lo){
+                                block[num_blocks*3] = i;
+                                block[num_blocks*3+1] = lo;
+                                block[num_blocks*3+2] = c;
+                                num_blocks++;
+                        }
+                        lo = c + 1;
+                }
+                if(lo < s->len){
+                        block[num_blocks*3] = i;
+                        block[num_blocks*3+1] = lo;
+                        block[num_blocks*3+2] = s->len;
+                        num_blocks++;
                 }
         }
+
+        status = OK;
+#ifdef HAVE_OPENMP
+        omp_set_num_threads(num_threads);
+#pragma omp parallel for schedule(dynamic) private(c)
+#else
+        (void) num_threads;
+#endif
+        for(c = 0; c < num_blocks;c++){
+#ifdef HAVE_OPENMP
+                if(sample_block(td[omp_get_thread_num()], block[c*3], block[c*3+1], block[c*3+2]) != OK){
+#pragma omp atomic write
+                        status = FAIL;
+                }
+#else
+                if(sample_block(td[0], block[c*3], block[c*3+1], block[c*3+2]) != OK){
+                        status = FAIL;
+                }
+#endif
+        }
+        ASSERT(status == OK, "Block sampling failed.");
+
+        for(i = 0; i < sb->num_seq;i++){
+                if(!blocked[i] || (include && !include[i])){
+                        continue;
+                }
+                d = sb->sequences[i]->data;
+                for(j = 0; j < num_models;j++){
+                        d->has_path[j] = 1;
+                        record_label_diff(d, j, sb->sequences[i]->len);
+                }
+        }
+        MFREE(block);
         return OK;
+ERROR:
+        if(block){
+                MFREE(block);
+        }
+        return FAIL;
+}
+
+/* Samples positions lo .. hi-1 of a sequence for all models keeping the
+ * labels at lo-1 and hi fixed. */
+int sample_block(struct seqer_thread_data* data, int seq_index, int lo, int hi)
+{
+        struct fast_hmm_param* ft = NULL;
+        struct tl_seq* s = NULL;
+        struct seq_ihmm_data* d = NULL;
+        uint16_t* label = NULL;
+        double* u = NULL;
+        uint8_t ok;
+        int left,right;
+        int i,j;
 
+        s = data->sb->sequences[seq_index];
+        d = s->data;
+        for(j = 0; j < data->ft_bag->num_models;j++){
+                ft = data->ft_bag->fast_params[j];
+                label = d->label_arr[j];
+                u = get_u_range(ft, d, j, s->len, seq_index, lo, hi, data->u_buf);
+                left = (lo == 0) ? START_STATE : label[lo-1];
+                right = (hi == s->len) ? END_STATE : label[hi];
+                ok = 0;
+                if(data->dyn_f){
+                        RUN(dynamic_programming_clean_f(ft, data->dyn_f, s->seq + lo, d->tmp_label_arr[j] + lo, u, hi - lo, &ok, &data->rndstate, data->kern, left, right));
+                }else{
+                        RUN(dynamic_programming_clean(ft, data->dyn, s->seq + lo, d->tmp_label_arr[j] + lo, u, hi - lo, &ok, &data->rndstate, data->kern, left, right));
+                }
+                if(!ok){
+                        /* the current labels are a valid path through
+                           the block; keep them */
+                        for(i = lo; i < hi;i++){
+                                d->tmp_label_arr[j][i] = label[i];
+                        }
+                }
+        }
+        return OK;
+ERROR:
+        return FAIL;
 }
 
-int reset_valid_path(struct tl_seq_buffer* sb,int num_models)
+/* If batch is given sequences outside the batch are flagged as having
+ * a path so that they are skipped by set_u_multi and the sweep. */
+int reset_valid_path(struct tl_seq_buffer* sb,int num_models, uint8_t* batch)
 {
         struct seq_ihmm_data* d = NULL;
         int i,j;
+        uint8_t v;
         for(i = 0; i < sb->num_seq;i++){
                 d = sb->sequences[i]->data;
+                v = 0;
+                if(batch && !batch[i]){
+                        v = 1;
+                }
                 for(j = 0; j < num_models;j++){
-                        d->has_path[j] = 0;
+                        d->has_path[j] = v;
                 }
         }
         return OK;
 }
 
+/* Draws the sequences to relabel in this iteration (partial Fisher-Yates
+ * shuffle of order). The batch grows with the number of training
+ * iterations of the first model. */
+int pick_batch(struct model_bag* model_bag, struct beam_sampling_param* bp, int* order, uint8_t* batch, int num_seq, int* batch_size)
+{
+        double n;
+        int i,r,tmp;
+
+        n = (double) bp->batch_size * pow(bp->batch_growth, (double) model_bag->models[0]->training_iterations);
+        if(n >= (double) num_seq){
+                *batch_size = num_seq;
+                return OK;
+        }
+        *batch_size = MACRO_MAX(1, (int) n);
+        for(i = 0; i < num_seq;i++){
+                batch[i] = 0;
+        }
+        for(i = 0; i < *batch_size;i++){
+                r = i + (int) rk_interval(num_seq - 1 - i, &model_bag->rndstate);
+                tmp = order[i];
+                order[i] = order[r];
+                order[r] = tmp;
+                batch[order[i]] = 1;
+        }
+        LOG_MSG("Relabelling %d of %d sequences.", *batch_size, num_seq);
+        return OK;
+}
+
 /*void* do_forward_backward(void *threadarg)
 {
         struct seqer_thread_data *data;
@@ -317,63 +723,112 @@ ERROR:
         return NULL;
         }*/
 
+/* Range of positions where the freshly sampled labels (tmp_label_arr)
+ * differ from the current ones; used by refresh_counts  */
+void record_label_diff(struct seq_ihmm_data* d, int model_index, int len)
+{
+        uint16_t* old = d->label_arr[model_index];
+        uint16_t* cur = d->tmp_label_arr[model_index];
+        int lo,hi;
+
+        lo = 0;
+        while(lo < len && old[lo] == cur[lo]){
+                lo++;
+        }
+        hi = len-1;
+        while(hi >= lo && old[hi] == cur[hi]){
+                hi--;
+        }
+        d->diff_lo[model_index] = lo;
+        d->diff_hi[model_index] = hi;
+}
+
 void* do_dynamic_programming(void *threadarg)
 {
         struct seqer_thread_data *data;
+        struct beam_scheduler* sched = NULL;
         struct tl_seq* s = NULL;
         struct seq_ihmm_data* d = NULL;
+        double* u = NULL;
+        double start;
         int i;
         int j;
-        int num_threads;
         int thread_id;
-        //int safety = 10;
+
         data = (struct seqer_thread_data *) threadarg;
 
-        num_threads = data->num_threads;
         thread_id = data->thread_ID;
-        //thread_id = omp_get_thread_num();
-        //num_threads = omp_get_num_threads();
+        sched = data->sched;
 
-
-
-//LOG_MSG("Thread %d (g)", f,g);
-        for(i =0; i < data->sb->num_seq;i++){
-
-                if( i% num_threads == thread_id){
-
-                        s = data->sb->sequences[i];
-                        d = data->sb->sequences[i]->data;
+        start = wall_clock();
+        while(1){
+                RUN(beam_scheduler_next(sched, thread_id, &i));
+                if(i == -1){
+                        break;
+                }
+                s = data->sb->sequences[i];
+                d = data->sb->sequences[i]->data;
+                if(data->dyn_multi){
                         for(j = 0; j < data->ft_bag->num_models; j++){
-                                //LOG_MSG("Run seq: %d M:%d (thread%d)",i,j, data->thread_ID);
-                                //s->has_path[j] = 0;
-                                //safety = 10;
-                                //while(!s->has_path[j]){
-
-
-                                //if(!s->has_path[j]){
+                                data->u_lock[j] = NULL;
+                                if(!d->has_path[j]){
+                                        data->u_lock[j] = get_u(data->ft_bag->fast_params[j], d, j, s->len, i, data->u_multi[j]);
+                                }
+                        }
+                        RUN(dynamic_programming_lockstep(data->ft_bag,
+                                                         data->dyn_multi,
+                                                         s->seq,
+                                                         d,
+                                                         data->u_lock,
+                                                         s->len,
+                                                         &data->rndstate,
+                                                         data->kern));
+                        for(j = 0; j < data->ft_bag->num_models; j++){
+                                if(data->u_lock[j] && d->has_path[j]){
+                                        record_label_diff(d, j, s->len);
+                                }
+                        }
+                        sched->work[thread_id] += (uint64_t) s->len * (uint64_t) data->ft_bag->num_models;
+                        continue;
+                }
+                for(j = 0; j < data->ft_bag->num_models; j++){
+                        /* only set during a targeted retry  */
+                        if(d->has_path[j]){
+                                continue;
+                        }
+                        u = get_u(data->ft_bag->fast_params[j], d, j, s->len, i, data->u_buf);
+                        if(data->dyn_f){
+                                RUN(dynamic_programming_clean_f(data->ft_bag->fast_params[j],
+                                                                data->dyn_f,
+                                                                s->seq,
+                                                                d->tmp_label_arr[j],
+                                                                u,
+                                                                s->len,
+                                                                &d->has_path[j],
+                                                                &data->rndstate,
+                                                                data->kern,
+                                                                START_STATE,
+                                                                END_STATE));
+                        }else{
                                 RUN(dynamic_programming_clean(data->ft_bag->fast_params[j],
                                                               data->dyn,
                                                               s->seq,
                                                               d->tmp_label_arr[j],
-                                                              d->u_arr[j],
+                                                              u,
                                                               s->len,
                                                               &d->has_path[j],
-                                                              &data->rndstate));
-
-                                //}
-                                /* This is how the score of the sampled path can be stored */
-                                //s->score_arr[j] = data->dyn[0][0];
+                                                              &data->rndstate,
+                                                              data->kern,
+                                                              START_STATE,
+                                                              END_STATE));
+                        }
+                        if(d->has_path[j]){
+                                record_label_diff(d, j, s->len);
                         }
-
-                        //LOG_MSG("Thread %d running sequence %d   %f %d",thread_id, i,data->sb->sequences[i]->score,data->seed);
-                        //RUN(dynamic_programming(data,i));
-                        //
-
-                        /*while(data->sb->sequences[i]->score == -INFINITY){
-                          RUN(dynamic_programming(data->dyn,data->ft, data->sb->sequences[i]));
-                          }*/
                 }
+                sched->work[thread_id] += (uint64_t) s->len * (uint64_t) data->ft_bag->num_models;
         }
+        sched->busy[thread_id] += wall_clock() - start;
         return NULL;
 ERROR:
         return NULL;
@@ -450,8 +905,6 @@ ERROR:
    p   g * element */
 int add_state_from_fast_hmm_param(struct ihmm_model* model,struct fast_hmm_param* ft)
 {
-        struct fast_t_item** infinity = NULL;
-        struct fast_t_item* tmp = NULL;
         double* tmp_prob = NULL;
 
         double* beta;
@@ -494,7 +947,6 @@ int add_state_from_fast_hmm_param(struct ihmm_model* model,struct fast_hmm_param
         gamma = model->gamma;
 
         new_k = ft->last_state;
-        infinity = ft->infinity;
         //fprintf(stdout,"LAST: %d\n",new_k);
         /* fill out transition FROM new state  */
         sum = 0.0;
@@ -506,25 +958,13 @@ int add_state_from_fast_hmm_param(struct ihmm_model* model,struct fast_hmm_param
                 sum += tmp_prob[i];
         }
         for(i = 0;i < new_k;i++){
-                //tmp = NULL;
-                //MMALLOC(tmp, sizeof(struct fast_t_item));
-                tmp = ft->list[ft->num_trans];
-                tmp->from = new_k;
-                tmp->to = i;
-                tmp->t = tmp_prob[i] / sum;
-
-
-                //ft->root->tree_insert(ft->root,tmp);
-                ft->num_trans++;
-                if(ft->num_trans == ft->alloc_num_trans){
-                        RUN(expand_num_trans(ft));
-                }
-                ft->transition[new_k][i] = tmp->t;
+                ft->transition[new_k][i] = tmp_prob[i] / sum;
+                RUN(add_fast_transition(ft, new_k, i, ft->transition[new_k][i]));
         }
-        infinity[new_k]->from = new_k;
-        infinity[new_k]->to = new_k;
-        infinity[new_k]->t = tmp_prob[new_k] / sum;
-        ft->transition[new_k][new_k] = infinity[new_k]->t;
+        ft->inf_from[new_k] = new_k;
+        ft->inf_to[new_k] = new_k;
+        ft->inf_t[new_k] = tmp_prob[new_k] / sum;
+        ft->transition[new_k][new_k] = ft->inf_t[new_k];
 
         /*list = ft->list;
           list_index = ft->num_items;
@@ -602,27 +1042,17 @@ int add_state_from_fast_hmm_param(struct ihmm_model* model,struct fast_hmm_param
                 }else{
                         pg = rk_beta(&model->rndstate, a, b);
                 }
-                pe = infinity[i]->t;
-
-                //transition to state just instantiated will go into the RB tree.
-                tmp = ft->list[ft->num_trans];
-                //MMALLOC(tmp, sizeof(struct fast_t_item));
-                tmp->from = i;
-                tmp->to = new_k;
-                tmp->t = pg * pe;
+                pe = ft->inf_t[i];
 
-                ft->num_trans++;
-                if(ft->num_trans == ft->alloc_num_trans){
-                        RUN(expand_num_trans(ft));
-                }
-                //ft->root->tree_insert(ft->root,tmp);
-                ft->transition[i][new_k] = tmp->t;
+                //transition to state just instantiated goes into the list.
+                ft->transition[i][new_k] = pg * pe;
+                RUN(add_fast_transition(ft, i, new_k, ft->transition[i][new_k]));
 
                 //transition into infinity will remain in the infinity array...
-                infinity[i]->from = i;
-                infinity[i]->to = new_k+1;
-                infinity[i]->t = (1.0-pg) * pe;
-                ft->transition[i][new_k+1] = infinity[i]->t;
+                ft->inf_from[i] = i;
+                ft->inf_to[i] = new_k+1;
+                ft->inf_t[i] = (1.0-pg) * pe;
+                ft->transition[i][new_k+1] = ft->inf_t[i];
         }
 
         /*qsort(ft->list, ft->num_items, sizeof(struct fast_t_item*),fast_hmm_param_cmp_by_to_asc);
@@ -860,165 +1290,130 @@ int approximatelyEqual(double a, double b, double epsilon)
 
 
 
-int dynamic_programming_clean(struct fast_hmm_param* ft,  double** matrix,uint8_t* seq,uint16_t* label,double* u,int len,uint8_t* has_path,rk_state* random)
+/* Samples labels for len positions given the state before (left) and
+ * after (right) them: START_STATE / END_STATE for a whole sequence or
+ * the fixed labels around a block. */
+int dynamic_programming_clean(struct fast_hmm_param* ft,  double** matrix,uint8_t* seq,uint16_t* label,double* u,int len,uint8_t* has_path,rk_state* random, const struct beam_kernels* kern, int left, int right)
 {
-        struct fast_t_item** list = NULL;
-        int i,j,boundary;
-        int state;
-        int a,b;
+        double* in_t = NULL;
+        uint16_t* in_from = NULL;
+        int* in_offset = NULL;
+        double* prev;
+        double* cur;
+        int i,j;
+        int b;
         double sum;
+        double s;
+        double x;
         double* emission;
-        double* tmp_row;
-        double r;
         int K;
 
         K = ft->last_state;
 
-        list = ft->list;
-        tmp_row = matrix[len];
+        in_t = ft->in_t;
+        in_from = ft->in_from;
+        in_offset = ft->in_offset;
 
-        boundary = fast_hmm_param_binarySearch_t(ft, u[0]);
-        for(i = 0; i < K;i++){
-                matrix[0][i] = 0.0;
-                //fprintf(stdout,"%f ", matrix[0][i]);
-        }
-        //fprintf(stdout,"\n");
-        //LOG_MSG("Boundary: %d (thres: %f)", boundary, u[0]);
-        //fill first row.
-        for(j = 0; j < boundary;j++){
-                if(list[j]->from == START_STATE){
-                        matrix[0][list[j]->to] = list[j]->t;
-                        //fprintf(stdout," Start-> %d : %f\n", list[j]->to,list[j]->t);
-                }
-        }
-        sum = 0;
+        /* fill first row - only transitions out of start (or out of
+         * the fixed state left of a block) */
+        x = u[0];
+        cur = matrix[0];
         emission = ft->emission[seq[0]];
-        for(i = 0; i < K;i++){
-                //fprintf(stdout,"%f,%f %d\n",matrix[0][i], emission[i],seq[0]);
-                matrix[0][i] *= emission[i];
-                sum += matrix[0][i];
-        }
-        //fprintf(stdout,"\n");
-        for(i = 0; i < K;i++){
-                matrix[0][i] /= sum;
-                //fprintf(stdout,"%f ", matrix[0][i]);
+        for(b = 0; b < K;b++){
+                s = ft->transition[left][b];
+                cur[b] = (s > x) ? ((left == START_STATE) ? s : 1.0) : 0.0;
         }
-        //fprintf(stdout,"\n");
+        sum = kern->mul_sum(cur, emission, K);
+        kern->scale(cur, 1.0 / sum, K);
 
-        //exit(0);
+        /* Each state gathers from its predecessors; these are sorted by
+         * t so we stop as soon as we drop below the slice variable. */
         for(i = 1; i < len;i++){
+                prev = matrix[i-1];
+                cur = matrix[i];
                 emission = ft->emission[seq[i]];
-                for(j = 0; j < K;j++){
-                        matrix[i][j] = 0.0;
+                x = u[i];
+                for(b = 0; b < K;b++){
+                        s = 0.0;
+                        for(j = in_offset[b]; j < in_offset[b+1];j++){
+                                if(in_t[j] <= x){
+                                        break;
+                                }
+                                s += prev[in_from[j]];
+                        }
+                        cur[b] = s;
                 }
+                sum = kern->mul_sum(cur, emission, K);
+                kern->scale(cur, 1.0 / sum, K);
+        }
+        RUN(sample_path(ft, (void**) matrix, 0, label, u, len, has_path, random, right));
+        return OK;
+ERROR:
+        return FAIL;
+}
 
-                boundary = fast_hmm_param_binarySearch_t(ft, u[i]);
-
-                for(j = 0; j < boundary;j++){
-                        a = list[j]->from;
-                        b = list[j]->to;
-                        matrix[i][b] += matrix[i-1][a];
-                }
-                sum = 0.0;
+/* Checks that right is reachable from the last filled row and if so
+ * samples labels backwards from it. Rows are double, or float if
+ * single is set (dynamic_programming_clean_f); sums are in double. */
+int sample_path(struct fast_hmm_param* ft, void** matrix, int single, uint16_t* label, double* u, int len, uint8_t* has_path, rk_state* random, int right)
+{
+        double* in_t = NULL;
+        uint16_t* in_from = NULL;
+        int* in_offset = NULL;
+        void* prev;
+        int i,j,boundary;
+        int state;
+        int a;
+        double sum;
+        double x;
+        double r;
 
-                for(j = 0; j < K;j++){
-                        matrix[i][j] *=  emission[j];
-                        sum += matrix[i][j];
-                }
-                for(j = 0; j < K;j++){
-                        matrix[i][j] /= sum;
+        in_t = ft->in_t;
+        in_from = ft->in_from;
+        in_offset = ft->in_offset;
 
-                        //fprintf(stdout,"%f ", matrix[i][j]);
-                }
-                //fprintf(stdout,"\n");
-        }
         sum = 0.0;
-        //float tmp_r;
-        boundary = fast_hmm_param_binarySearch_t(ft, u[len]);
-        for(j = 0; j < boundary;j++){
-                a = list[j]->from;
-                b = list[j]->to;
-                if(b == END_STATE){
-                        sum += matrix[len-1][a];
+        x = u[len];
+        prev = matrix[len-1];
+        for(j = in_offset[right]; j < in_offset[right+1];j++){
+                if(in_t[j] <= x){
+                        break;
                 }
+                sum += row_get(prev, single, in_from[j]);
         }
         //LOG_MSG("SUM:%f",sum);
 
         if(sum != 0.0 && !isnan(sum)){
-                state = END_STATE;
-                //double score = prob2scaledprob(1.0);//    1.0;
+                state = right;
+                /* sample predecessors; candidates of state are the
+                 * transitions into it with t > u[i+1] */
                 for(i = len-1; i >= 0; i--){
-                        //fprintf(stdout,"pick: %d %d\n", i,state);
-                        for(j = 0; j < K;j++){
-                                tmp_row[j] = 0.0;
-                        }
+                        prev = matrix[i];
+                        x = u[i+1];
                         sum = 0.0;
-                        boundary = fast_hmm_param_binarySearch_t(ft, u[i+1]);
-                        for(j = 0; j < boundary;j++){
-                                a = list[j]->from;
-                                b = list[j]->to;
-                                if(b == state && a != START_STATE){
-                                        tmp_row[a] = matrix[i][a];
-                                        sum += matrix[i][a];
+                        for(j = in_offset[state]; j < in_offset[state+1];j++){
+                                if(in_t[j] <= x){
+                                        break;
+                                }
+                                a = in_from[j];
+                                if(a != START_STATE){
+                                        sum += row_get(prev, single, a);
                                 }
                         }
-                        /*tmp_row[0] /= sum;
-                          for(j = 1; j < K;j++){
-                          tmp_row[j] /= sum;
-                          tmp_row[j] += tmp_row[j-1];
-                          }
-
-                          tmp_row[K-1] = 1.0;*/
-                        //r =  random_float_zero_to_x(sum);
-                        //r = rand_r(&seed) / (float) RAND_MAX *sum;
-                        //tmp_r = rk_double(random);
-                        //while(label[i] == -1){ /* Hack if random number generator spits out a 1.0 weird things happen due to precision */
-                        /*r = rk_double(random);*sum;
-                          for(j = 0; j < K;j++){
-                          if(tmp_row[j] > r){
-                          state = j;
-                          label[i] = j;
-                          break;
-                          }
-                          }*/
-                        // tmp_r = r;
-                        //r = random_float_zero_to_x_thread(sum, &data->seed);
+                        boundary = j;
                         r = rk_double(random)*sum;
-                        for(j = 0; j < boundary;j++){
-                                //if(j == 0 && i == len-1){
-                                //        fprintf(stdout,"%f thread: %f  %f \n",random_float_zero_to_x(sum), random_float_zero_to_x_thread(sum, &seed) , rand_r(&seed) / (float) RAND_MAX);
-                                //}
-                                a = list[j]->from;
-                                b = list[j]->to;
-                                if(b == state && a != START_STATE){
-                                        r -= tmp_row[a];
+                        for(j = in_offset[state]; j < boundary;j++){
+                                a = in_from[j];
+                                if(a != START_STATE){
+                                        r -= row_get(prev, single, a);
                                         if(r <= DBL_EPSILON){
                                                 state = a;
                                                 label[i] = a;
-                                                //score = score + prob2scaledprob(list[j]->t);
                                                 break;
                                         }
                                 }
                         }
-                        //score = score + prob2scaledprob( ft->emission[seq[i]][state]);
-                        //}
-                        /*if(label[i] == -1){
-                          WARNING_MSG("path is negative!!!!, %e %e u:%e sum: %f",r,tmp_r,u[i+1],sum);
-                          r = tmp_r;
-                          for(j = 0; j < boundary;j++){
-                          a = list[j]->from;
-                          b = list[j]->to;
-
-                          if(list[j]->to == state && a != IHMM_START_STATE){
-                          r -= tmp_row[a];
-                          WARNING_MSG("pos: %d (len: %d) cur: %d %d -> %d : %f \n", i,len, state,a,b, tmp_row[a]);
-                          }
-                          }
-                          ERROR_MSG("path is negative!!!!, %e %e",r,tmp_r);
-                          }*/
-                }
-                //score = score + prob2scaledprob(  ft->transition[IHMM_START_STATE][state]);
-                //matrix[0][0] = score;
+                }
                 /* sanitycheck!  */
                 *has_path = 1;
         }else{
@@ -1028,6 +1423,155 @@ int dynamic_programming_clean(struct fast_hmm_param* ft,  double** matrix,uint8_
         return OK;
 }
 
+double row_get(const void* row, int single, int a)
+{
+        if(single){
+                return (double) ((const float*) row)[a];
+        }
+        return ((const double*) row)[a];
+}
+
+/* All models without a path are filtered over the sequence together:
+ * the residue at each position is read once and every model advances
+ * its row before the next position. Labels are sampled afterwards
+ * model by model, which uses the random numbers in the same order as
+ * running the models one after another. */
+int dynamic_programming_lockstep(struct fast_param_bag* ft_bag, double*** matrix, uint8_t* seq, struct seq_ihmm_data* d, double** u, int len, rk_state* random, const struct beam_kernels* kern)
+{
+        struct fast_hmm_param* ft = NULL;
+        double* in_t = NULL;
+        uint16_t* in_from = NULL;
+        int* in_offset = NULL;
+        double* prev;
+        double* cur;
+        double* emission;
+        int i,j,m;
+        int b;
+        int K;
+        int c;
+        double sum;
+        double s;
+        double x;
+
+        c = seq[0];
+        for(m = 0; m < ft_bag->num_models;m++){
+                if(d->has_path[m]){
+                        continue;
+                }
+                ft = ft_bag->fast_params[m];
+                K = ft->last_state;
+                x = u[m][0];
+                cur = matrix[m][0];
+                emission = ft->emission[c];
+                for(b = 0; b < K;b++){
+                        s = ft->transition[START_STATE][b];
+                        cur[b] = (s > x) ? s : 0.0;
+                }
+                sum = kern->mul_sum(cur, emission, K);
+                kern->scale(cur, 1.0 / sum, K);
+        }
+
+        for(i = 1; i < len;i++){
+                c = seq[i];
+                for(m = 0; m < ft_bag->num_models;m++){
+                        if(d->has_path[m]){
+                                continue;
+                        }
+                        ft = ft_bag->fast_params[m];
+                        K = ft->last_state;
+                        in_t = ft->in_t;
+                        in_from = ft->in_from;
+                        in_offset = ft->in_offset;
+                        prev = matrix[m][i-1];
+                        cur = matrix[m][i];
+                        emission = ft->emission[c];
+                        x = u[m][i];
+                        for(b = 0; b < K;b++){
+                                s = 0.0;
+                                for(j = in_offset[b]; j < in_offset[b+1];j++){
+                                        if(in_t[j] <= x){
+                                                break;
+                                        }
+                                        s += prev[in_from[j]];
+                                }
+                                cur[b] = s;
+                        }
+                        sum = kern->mul_sum(cur, emission, K);
+                        kern->scale(cur, 1.0 / sum, K);
+                }
+        }
+
+        for(m = 0; m < ft_bag->num_models;m++){
+                if(d->has_path[m]){
+                        continue;
+                }
+                RUN(sample_path(ft_bag->fast_params[m], (void**) matrix[m], 0, d->tmp_label_arr[m], u[m], len, &d->has_path[m], random, END_STATE));
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* As above with single precision rows; sums used for sampling are kept
+ * in double. */
+int dynamic_programming_clean_f(struct fast_hmm_param* ft,  float** matrix,uint8_t* seq,uint16_t* label,double* u,int len,uint8_t* has_path,rk_state* random, const struct beam_kernels* kern, int left, int right)
+{
+        double* in_t = NULL;
+        uint16_t* in_from = NULL;
+        int* in_offset = NULL;
+        float* prev;
+        float* cur;
+        int i,j;
+        int b;
+        float fsum;
+        double s;
+        double x;
+        double* emission;
+        int K;
+
+        K = ft->last_state;
+
+        in_t = ft->in_t;
+        in_from = ft->in_from;
+        in_offset = ft->in_offset;
+
+        /* fill first row - see above */
+        x = u[0];
+        cur = matrix[0];
+        emission = ft->emission[seq[0]];
+        for(b = 0; b < K;b++){
+                s = ft->transition[left][b];
+                cur[b] = (s > x) ? ((left == START_STATE) ? (float) s : 1.0f) : 0.0f;
+        }
+        fsum = kern->mul_sum_f(cur, emission, K);
+        kern->scale_f(cur, 1.0f / fsum, K);
+
+        /* Each state gathers from its predecessors; these are sorted by
+         * t so we stop as soon as we drop below the slice variable. */
+        for(i = 1; i < len;i++){
+                prev = matrix[i-1];
+                cur = matrix[i];
+                emission = ft->emission[seq[i]];
+                x = u[i];
+                for(b = 0; b < K;b++){
+                        s = 0.0;
+                        for(j = in_offset[b]; j < in_offset[b+1];j++){
+                                if(in_t[j] <= x){
+                                        break;
+                                }
+                                s += prev[in_from[j]];
+                        }
+                        cur[b] = (float) s;
+                }
+                fsum = kern->mul_sum_f(cur, emission, K);
+                kern->scale_f(cur, 1.0f / fsum, K);
+        }
+        RUN(sample_path(ft, (void**) matrix, 1, label, u, len, has_path, random, right));
+        return OK;
+ERROR:
+        return FAIL;
+}
+
 /*int dynamic_programming(struct seqer_thread_data* data, int target)
 {
         double** matrix = NULL;
@@ -1178,93 +1722,182 @@ ERROR:
         }*/
 
 
-int set_u_multi(struct model_bag* model_bag, struct fast_param_bag*  ft_bag, struct tl_seq_buffer* sb)
+/* The slice variables of model m, sequence i, position j are drawn from
+ * a counter based stream keyed by (model seed, m) and identified by the
+ * training iteration plus one draw from the model RNG (so that retries
+ * within an iteration differ). Sequence i reads substream i; the result
+ * does not depend on the number of threads or the schedule. */
+/* With only_failed set, new slice variables are drawn only for sequence
+ * / model pairs without a path and min_u is the minimum over these. */
+int set_u_multi(struct model_bag* model_bag, struct fast_param_bag*  ft_bag, struct tl_seq_buffer* sb, int only_failed, int num_threads)
 {
-        int i;
+        struct ihmm_model* model = NULL;
+        struct seq_ihmm_data* d = NULL;
+        double* thread_min_u = NULL;
+        double* thread_u = NULL;
+        double* u;
+        double local_min_u;
+        int num_models;
+        int i,j,c,t;
 
-        for(i = 0; i < model_bag->num_models;i++){
-                RUN(set_u(sb, model_bag->models[i], ft_bag->fast_params[i], &model_bag->min_u[i],i));
+        ASSERT(sb != NULL, "No sequences.");
+        ASSERT(num_threads > 0, "No threads");
+
+        num_models = model_bag->num_models;
+
+        for(i = 0; i < num_models;i++){
+                model = model_bag->models[i];
+                crng_init_stream(&ft_bag->fast_params[i]->u_stream,
+                                 model->seed,
+                                 i + num_models * ft_bag->stream_id,
+                                 model->training_iterations,
+                                 (uint32_t) rk_random(&model->rndstate));
+        }
+
+        /* each thread keeps its own minimum per model and a scratch
+           row for sequences that do not store u in double precision */
+        MMALLOC(thread_min_u, sizeof(double) * num_threads * num_models);
+        MMALLOC(thread_u, sizeof(double) * num_threads * (sb->max_len+1));
+        for(i = 0; i < num_threads * num_models;i++){
+                thread_min_u[i] = 1.0;
         }
+#ifdef HAVE_OPENMP
+        omp_set_num_threads(num_threads);
+#pragma omp parallel shared(thread_min_u,thread_u) private(i,j,c,t,d,u,local_min_u)
+        {
+                t = omp_get_thread_num();
+                c = t * num_models;
+#pragma omp for schedule(dynamic,64)
+#else
+        t = 0;
+        c = 0;
+#endif
+                for(i = 0; i < sb->num_seq;i++){
+                        d = sb->sequences[i]->data;
+                        for(j = 0; j < num_models;j++){
+                                if(only_failed && d->has_path[j]){
+                                        continue;
+                                }
+                                if(d->u_arr){
+                                        u = d->u_arr[j];
+                                }else{
+                                        u = thread_u + (size_t) t * (sb->max_len+1);
+                                }
+                                local_min_u = set_u(ft_bag->fast_params[j], d->label_arr[j], u, sb->sequences[i]->len, i);
+                                if(d->u_arr_f){
+                                        local_min_u = store_u_float(u, d->u_arr_f[j], sb->sequences[i]->len);
+                                }
+                                thread_min_u[c+j] = MACRO_MIN(thread_min_u[c+j], local_min_u);
+                        }
+                }
+#ifdef HAVE_OPENMP
+        }
+#endif
+        for(j = 0; j < num_models;j++){
+                model_bag->min_u[j] = 1.0;
+                for(i = 0; i < num_threads;i++){
+                        model_bag->min_u[j] = MACRO_MIN(model_bag->min_u[j], thread_min_u[i*num_models + j]);
+                }
+        }
+        MFREE(thread_min_u);
+        MFREE(thread_u);
         return OK;
 ERROR:
+        if(thread_min_u){
+                MFREE(thread_min_u);
+        }
+        if(thread_u){
+                MFREE(thread_u);
+        }
         return FAIL;
 }
 
-int set_u(struct tl_seq_buffer* sb, struct ihmm_model* model, struct fast_hmm_param* ft, double* min_u, int model_index)
+/* Rounds towards zero so that a stored u never exceeds the transition
+ * of the current path; returns the smallest stored value. */
+double store_u_float(double* u, float* u_f, int len)
 {
-        struct seq_ihmm_data* d = NULL;
-        int i,j;
-        double* u = 0;
-        uint16_t* label =0;
-        double x;
-        //double r;
-        int len;
+        double min_u;
+        float x;
+        int j;
 
-        double local_min_u = 1.0;
-        ASSERT(sb != NULL, "No sequences.");
-        ASSERT(model != NULL, "No model.");
-        //qsort(ft->list, ft->num_items, sizeof(struct fast_t_item*),fast_hmm_param_cmp_by_to_from_asc);
-        //last_state = ft->last_state;
+        min_u = 1.0;
+        for(j = 0; j <= len;j++){
+                x = (float) u[j];
+                if((double) x > u[j]){
+                        x = nextafterf(x, 0.0f);
+                }
+                u_f[j] = x;
+                min_u = MACRO_MIN(min_u, (double) x);
+        }
+        return min_u;
+}
 
-        for(i = 0; i < sb->num_seq;i++){
-                d = sb->sequences[i]->data;
-                label = d->label_arr[model_index];
-                u = d->u_arr[model_index];
-                len = sb->sequences[i]->len;
-
-                x = ft->transition[START_STATE][label[0]];
-                //c = IHMM_START_STATE * last_state + label[0];
-                //c = a* (num_states-1) + b;
-                //u[0] = rk_beta(&model->rndstate, 1.0, 11) * x;
-                //r = rk_beta(&model->rndstate, 1.0, 1.0) * x;
-                //while(fabs(r-0.0) < FLT_EPSILON ){
-                //        r = rk_beta(&model->rndstate, 1.0, 1.1) * x;
-                //}
-                //u[0] = r;
-
-
-                u[0] = rk_double(&model->rndstate) *x;
-                //ASSERT(ft->list[c]->t != 0.0f,"BAD %d -> %d %f",ft->list[c]->from,ft->list[c]->to,ft->list[c]->t);
-
-                local_min_u = MACRO_MIN(local_min_u, u[0]);
-                for (j = 1; j < len;j++){
-                        //c = label[j-1] * last_state + label[j];
-                        x = ft->transition[label[j-1]][label[j]];
-                        //r = rk_beta(&model->rndstate, 1.0, 1.0) * x;
-                        //while(fabs(r-0.0) < FLT_EPSILON ){
-                        //        r = rk_beta(&model->rndstate, 1.0, 1.1) * x;
-                        //}
-                        //u[j] = r;
-                        //u[j] = rk_beta(&model->rndstate, 1.0, 11) * x;
-                        u[j] =  rk_double(&model->rndstate) * x;//rk_double(&model->rndstate) *
-                        //if(!i && j < 5){
-                        //       fprintf(stdout,"%d->%d %f\n",label[j-1],label[j],ft->list[c]->t );
-                        //}
-                        //fprintf(stdout,"%d %d  ;; %d %d\n",label[j-1],label[j],ft->list[c]->from ,ft->list[c]->to);
-                        local_min_u = MACRO_MIN(local_min_u, u[j]);
-                        //ASSERT(ft->list[c]->t != 0.0f,"BAD %d -> %d %f",ft->list[c]->from,ft->list[c]->to,ft->list[c]->t);
-
-
-                }
-                x = ft->transition[label[len-1]][END_STATE];
-
-                //r = rk_beta(&model->rndstate, 1.0, 1.0) * x;
-                //while(fabs(r-0.0) < FLT_EPSILON ){
-                //        r = rk_beta(&model->rndstate, 1.0, 1.1) * x;
-                // }
-                //u[len] = r;
-                //u[len] = rk_beta(&model->rndstate, 1.0, 11) * x;
-                u[len] = rk_double(&model->rndstate) * x;//(ft->list[c]->t);
-                //ASSERT(ft->list[c]->t != 0.0f,"BAD %d -> %d %f",ft->list[c]->from,ft->list[c]->to,ft->list[c]->t);
-                //fprintf(stdout,"%d %d -> %d: %f  \n",label[len-1],ft->list[c]->from ,ft->list[c]->to, ft->list[c]->t );
-                local_min_u = MACRO_MIN(local_min_u, u[len]);
-
-        }
-
-        *min_u = local_min_u;
-        return OK;
-ERROR:
-        return FAIL;
+/* Returns the slice variables of sequence seq_index for the DP. If these
+ * are not stored in double precision they are widened or regenerated
+ * into buf; regeneration gives the same numbers as set_u_multi because
+ * u_stream, the labels and the transitions on the labelled path do not
+ * change before the sweep. */
+double* get_u(struct fast_hmm_param* ft, struct seq_ihmm_data* d, int model_index, int len, int seq_index, double* buf)
+{
+        int j;
+
+        if(d->u_arr){
+                return d->u_arr[model_index];
+        }
+        if(d->u_arr_f){
+                for(j = 0; j <= len;j++){
+                        buf[j] = (double) d->u_arr_f[model_index][j];
+                }
+                return buf;
+        }
+        set_u(ft, d->label_arr[model_index], buf, len, seq_index);
+        return buf;
+}
+
+/* As get_u for positions lo .. hi only; the returned u[0] belongs to
+ * position lo. */
+double* get_u_range(struct fast_hmm_param* ft, struct seq_ihmm_data* d, int model_index, int len, int seq_index, int lo, int hi, double* buf)
+{
+        uint16_t* label = NULL;
+        int a,b;
+        int j;
+
+        if(d->u_arr){
+                return d->u_arr[model_index] + lo;
+        }
+        if(d->u_arr_f){
+                for(j = lo; j <= hi;j++){
+                        buf[j-lo] = (double) d->u_arr_f[model_index][j];
+                }
+                return buf;
+        }
+        crng_fill_uniform_at(&ft->u_stream, (uint32_t) seq_index, lo, buf, hi - lo + 1);
+        label = d->label_arr[model_index];
+        for(j = lo; j <= hi;j++){
+                a = (j == 0) ? START_STATE : label[j-1];
+                b = (j == len) ? END_STATE : label[j];
+                buf[j-lo] *= ft->transition[a][b];
+        }
+        return buf;
+}
+
+/* returns the smallest slice variable in the sequence  */
+double set_u(struct fast_hmm_param* ft, uint16_t* label, double* u, int len, int seq_index)
+{
+        double min_u;
+        int j;
+
+        crng_fill_uniform(&ft->u_stream, (uint32_t) seq_index, u, len+1);
+
+        u[0] *= ft->transition[START_STATE][label[0]];
+        min_u = u[0];
+        for (j = 1; j < len;j++){
+                u[j] *= ft->transition[label[j-1]][label[j]];
+                min_u = MACRO_MIN(min_u, u[j]);
+        }
+        u[len] *= ft->transition[label[len-1]][END_STATE];
+        min_u = MACRO_MIN(min_u, u[len]);
+        return min_u;
 }
 
 int reset_u_if_no_path(struct fast_hmm_param* ft, double* u,int * label, int len, rk_state* rndstate)
@@ -1296,10 +1929,9 @@ int get_max_to_last_state_transition(struct fast_hmm_param*ft,double* max)
 
 
         for(i = 0; i< ft->last_state;i++){
-                if(ft->infinity[i]->t > local_max){
-                        local_max = ft->infinity[i]->t;
+                if(ft->inf_t[i] > local_max){
+                        local_max = ft->inf_t[i];
                 }
-                //fprintf(stdout,"%d->%d %f\n", ft->infinity[i]->from, ft->infinity[i]->to, ft->infinity[i]->t);
         }
         *max = local_max;
         return OK;
@@ -11,9 +11,26 @@ struct model_bag;
 struct seqer_thread_data;
 struct fast_param_bag;
 struct tl_seq_buffer;
+struct shard;
+
+struct beam_sampling_param{
+        int iterations;
+        int num_threads;
+        /* Mini batch sweeps: only batch_size randomly chosen sequences
+           are relabelled per iteration (0: all). The batch size is
+           multiplied by batch_growth after every training iteration.  */
+        int batch_size;
+        double batch_growth;
+        /* sequences longer than block_len are sampled in blocks (0: off) */
+        int block_len;
+        /* sequences are split over processes (NULL: all local)  */
+        struct shard* shard;
+};
+
+EXTERN void init_beam_sampling_param(struct beam_sampling_param* bp, int iterations, int num_threads);
 
 //EXTERN int run_beam_sampling(struct model_bag* model_bag, struct fast_param_bag*ft_bag, struct seq_buffer* sb,struct seqer_thread_data** td, int iterations, int num_threads);
-EXTERN int run_beam_sampling(struct model_bag* model_bag, struct fast_param_bag* ft_bag, struct tl_seq_buffer* sb,struct seqer_thread_data** td, int iterations, int num_threads);
+EXTERN int run_beam_sampling(struct model_bag* model_bag, struct fast_param_bag* ft_bag, struct tl_seq_buffer* sb,struct seqer_thread_data** td, struct beam_sampling_param* bp);
 
 #undef BEAM_SAMPLE_IMPORT
 #undef EXTERN
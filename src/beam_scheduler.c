@@ -0,0 +1,321 @@
+#include "tldevel.h"
+
+#define BEAM_SCHEDULER_IMPORT
+#include "beam_scheduler.h"
+
+static int sort_task_by_cost(const void *a, const void *b, void* cost);
+static void merge_sort_tasks(int* task, int* tmp, int n, int* cost);
+static int pop_front(struct beam_deque* dq, int* task);
+static int pop_back(struct beam_deque* dq, int* task);
+
+int alloc_beam_scheduler(struct beam_scheduler** sched, int num_threads, int num_tasks)
+{
+        struct beam_scheduler* s = NULL;
+        int i;
+
+        ASSERT(num_threads > 0, "No threads");
+        ASSERT(num_tasks > 0, "No tasks");
+
+        MMALLOC(s, sizeof(struct beam_scheduler));
+        s->dq = NULL;
+        s->order = NULL;
+        s->cost = NULL;
+        s->busy = NULL;
+        s->work = NULL;
+        s->steals = NULL;
+        s->wall = 0.0;
+        s->sweeps = 0;
+        s->num_threads = num_threads;
+        s->num_tasks = 0;
+        s->alloc_tasks = num_tasks;
+
+        MMALLOC(s->order, sizeof(int) * s->alloc_tasks);
+        MMALLOC(s->cost, sizeof(int) * s->alloc_tasks);
+        MMALLOC(s->busy, sizeof(double) * num_threads);
+        MMALLOC(s->work, sizeof(uint64_t) * num_threads);
+        MMALLOC(s->steals, sizeof(int) * num_threads);
+        MMALLOC(s->dq, sizeof(struct beam_deque*) * num_threads);
+        for(i = 0; i < num_threads;i++){
+                s->dq[i] = NULL;
+        }
+        for(i = 0; i < num_threads;i++){
+                MMALLOC(s->dq[i], sizeof(struct beam_deque));
+                s->dq[i]->task = NULL;
+                s->dq[i]->head = 0;
+                s->dq[i]->tail = 0;
+                /* round robin dealing gives at most ceil(n / threads) tasks per deque */
+                MMALLOC(s->dq[i]->task, sizeof(int) * (num_tasks / num_threads + 1));
+#ifdef HAVE_OPENMP
+                omp_init_lock(&s->dq[i]->lock);
+#endif
+                s->busy[i] = 0.0;
+                s->work[i] = 0;
+                s->steals[i] = 0;
+        }
+        *sched = s;
+        return OK;
+ERROR:
+        free_beam_scheduler(s);
+        return FAIL;
+}
+
+/* Stores the cost of each task and sorts the tasks longest first. Ties
+ * are kept in input order so that the schedule is reproducible. */
+int beam_scheduler_set_cost(struct beam_scheduler* s, int* cost, int num_tasks)
+{
+        int* tmp = NULL;
+        int i;
+
+        ASSERT(s != NULL, "No scheduler");
+        ASSERT(num_tasks <= s->alloc_tasks, "Too many tasks: %d (%d allocated)", num_tasks, s->alloc_tasks);
+
+        s->num_tasks = num_tasks;
+        for(i = 0; i < num_tasks;i++){
+                s->cost[i] = cost[i];
+                s->order[i] = i;
+        }
+        MMALLOC(tmp, sizeof(int) * num_tasks);
+        merge_sort_tasks(s->order, tmp, num_tasks, s->cost);
+        MFREE(tmp);
+        return OK;
+ERROR:
+        if(tmp){
+                MFREE(tmp);
+        }
+        return FAIL;
+}
+
+/* Clears the statistics; busy time, work and steals add up over the
+ * sweeps until the next clear (e.g. all sweeps of one iteration). */
+int beam_scheduler_clear(struct beam_scheduler* s)
+{
+        int i;
+
+        ASSERT(s != NULL, "No scheduler");
+        for(i = 0; i < s->num_threads;i++){
+                s->busy[i] = 0.0;
+                s->work[i] = 0;
+                s->steals[i] = 0;
+        }
+        s->wall = 0.0;
+        s->sweeps = 0;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Deal tasks to threads; has to be called before every sweep */
+int beam_scheduler_reset(struct beam_scheduler* s)
+{
+        return beam_scheduler_reset_subset(s, NULL);
+}
+
+/* As above but only tasks with include[task] != 0 are dealt */
+int beam_scheduler_reset_subset(struct beam_scheduler* s, uint8_t* include)
+{
+        struct beam_deque* dq = NULL;
+        int i,c;
+
+        ASSERT(s != NULL, "No scheduler");
+        for(i = 0; i < s->num_threads;i++){
+                s->dq[i]->head = 0;
+                s->dq[i]->tail = 0;
+        }
+        c = 0;
+        for(i = 0; i < s->num_tasks;i++){
+                if(include && !include[s->order[i]]){
+                        continue;
+                }
+                dq = s->dq[c % s->num_threads];
+                dq->task[dq->tail] = s->order[i];
+                dq->tail++;
+                c++;
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Returns the next task for thread_id in task or -1 if all work is done */
+int beam_scheduler_next(struct beam_scheduler* s, int thread_id, int* task)
+{
+        int i,victim;
+
+        *task = -1;
+        if(pop_front(s->dq[thread_id], task)){
+                return OK;
+        }
+        for(i = 1; i < s->num_threads;i++){
+                victim = (thread_id + i) % s->num_threads;
+                if(pop_back(s->dq[victim], task)){
+                        s->steals[thread_id]++;
+                        return OK;
+                }
+        }
+        return OK;
+}
+
+int beam_scheduler_add_sweep(struct beam_scheduler* s, double wall)
+{
+        ASSERT(s != NULL, "No scheduler");
+        s->wall += wall;
+        s->sweeps++;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Utilisation is the fraction of thread time spent on tasks during the
+ * sweeps since the last clear; imbalance is max / mean busy time - 1 (0
+ * is perfect balance). */
+int beam_scheduler_report(struct beam_scheduler* s, int iteration)
+{
+        double wall;
+        double sum;
+        double max;
+        double util;
+        double imbalance;
+        uint64_t work;
+        int steals;
+        int i;
+
+        ASSERT(s != NULL, "No scheduler");
+
+        wall = s->wall;
+        sum = 0.0;
+        max = 0.0;
+        work = 0;
+        steals = 0;
+        for(i = 0; i < s->num_threads;i++){
+                sum += s->busy[i];
+                max = MACRO_MAX(max, s->busy[i]);
+                work += s->work[i];
+                steals += s->steals[i];
+        }
+        util = 0.0;
+        if(wall > 0.0){
+                util = sum / (wall * (double) s->num_threads);
+        }
+        imbalance = 0.0;
+        if(sum > 0.0){
+                imbalance = max / (sum / (double) s->num_threads) - 1.0;
+        }
+        LOG_MSG("Iteration %d: %d sweep(s), %0.3fs, %lu residues, utilisation %0.1f%%, imbalance %0.3f, %d steals", iteration, s->sweeps, wall, (unsigned long) work, util * 100.0, imbalance, steals);
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+void free_beam_scheduler(struct beam_scheduler* s)
+{
+        int i;
+        if(s){
+                if(s->dq){
+                        for(i = 0; i < s->num_threads;i++){
+                                if(s->dq[i]){
+#ifdef HAVE_OPENMP
+                                        omp_destroy_lock(&s->dq[i]->lock);
+#endif
+                                        MFREE(s->dq[i]->task);
+                                        MFREE(s->dq[i]);
+                                }
+                        }
+                        MFREE(s->dq);
+                }
+                if(s->order){
+                        MFREE(s->order);
+                }
+                if(s->cost){
+                        MFREE(s->cost);
+                }
+                if(s->busy){
+                        MFREE(s->busy);
+                }
+                if(s->work){
+                        MFREE(s->work);
+                }
+                if(s->steals){
+                        MFREE(s->steals);
+                }
+                MFREE(s);
+        }
+}
+
+int pop_front(struct beam_deque* dq, int* task)
+{
+        int found = 0;
+#ifdef HAVE_OPENMP
+        omp_set_lock(&dq->lock);
+#endif
+        if(dq->head < dq->tail){
+                *task = dq->task[dq->head];
+                dq->head++;
+                found = 1;
+        }
+#ifdef HAVE_OPENMP
+        omp_unset_lock(&dq->lock);
+#endif
+        return found;
+}
+
+int pop_back(struct beam_deque* dq, int* task)
+{
+        int found = 0;
+#ifdef HAVE_OPENMP
+        omp_set_lock(&dq->lock);
+#endif
+        if(dq->head < dq->tail){
+                dq->tail--;
+                *task = dq->task[dq->tail];
+                found = 1;
+        }
+#ifdef HAVE_OPENMP
+        omp_unset_lock(&dq->lock);
+#endif
+        return found;
+}
+
+int sort_task_by_cost(const void *a, const void *b, void* cost)
+{
+        const int* c = cost;
+        int one = *(const int*) a;
+        int two = *(const int*) b;
+
+        if(c[one] > c[two]){
+                return -1;
+        }else if(c[one] < c[two]){
+                return 1;
+        }
+        return 0;
+}
+
+/* stable merge sort; qsort_r is not portable */
+void merge_sort_tasks(int* task, int* tmp, int n, int* cost)
+{
+        int i,j,k,m;
+        if(n < 2){
+                return;
+        }
+        m = n / 2;
+        merge_sort_tasks(task, tmp, m, cost);
+        merge_sort_tasks(task + m, tmp, n - m, cost);
+        i = 0;
+        j = m;
+        k = 0;
+        while(i < m && j < n){
+                if(sort_task_by_cost(&task[j], &task[i], cost) < 0){
+                        tmp[k++] = task[j++];
+                }else{
+                        tmp[k++] = task[i++];
+                }
+        }
+        while(i < m){
+                tmp[k++] = task[i++];
+        }
+        while(j < n){
+                tmp[k++] = task[j++];
+        }
+        for(i = 0; i < n;i++){
+                task[i] = tmp[i];
+        }
+}
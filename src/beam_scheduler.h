@@ -0,0 +1,58 @@
+#ifndef BEAM_SCHEDULER_H
+#define BEAM_SCHEDULER_H
+
+#include <stdint.h>
+
+#ifdef HAVE_OPENMP
+#include <omp.h>
+#endif
+
+#ifdef BEAM_SCHEDULER_IMPORT
+#define EXTERN
+#else
+#define EXTERN extern
+#endif
+
+/* Work stealing scheduler for the sampling sweep. Tasks (sequences) are
+ * ordered longest first and dealt round robin to per-thread deques. A
+ * thread pops from the front of its own deque (i.e. its longest
+ * remaining task) and, once empty, steals from the back of the deque of
+ * another thread. */
+
+struct beam_deque{
+        int* task;
+        int head;
+        int tail;
+#ifdef HAVE_OPENMP
+        omp_lock_t lock;
+#endif
+};
+
+struct beam_scheduler{
+        struct beam_deque** dq;
+        int* order;             /* task ids sorted by cost, descending */
+        int* cost;
+        double* busy;           /* seconds spent on tasks per thread */
+        uint64_t* work;         /* residues processed per thread */
+        int* steals;
+        double wall;            /* wall time of the sweeps since the last clear */
+        int sweeps;
+        int num_threads;
+        int num_tasks;
+        int alloc_tasks;
+};
+
+EXTERN int alloc_beam_scheduler(struct beam_scheduler** sched, int num_threads, int num_tasks);
+EXTERN int beam_scheduler_set_cost(struct beam_scheduler* s, int* cost, int num_tasks);
+EXTERN int beam_scheduler_clear(struct beam_scheduler* s);
+EXTERN int beam_scheduler_reset(struct beam_scheduler* s);
+EXTERN int beam_scheduler_reset_subset(struct beam_scheduler* s, uint8_t* include);
+EXTERN int beam_scheduler_next(struct beam_scheduler* s, int thread_id, int* task);
+EXTERN int beam_scheduler_add_sweep(struct beam_scheduler* s, double wall);
+EXTERN int beam_scheduler_report(struct beam_scheduler* s, int iteration);
+EXTERN void free_beam_scheduler(struct beam_scheduler* s);
+
+#undef BEAM_SCHEDULER_IMPORT
+#undef EXTERN
+
+#endif
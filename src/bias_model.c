@@ -5,6 +5,7 @@
 #include "tlhdf5wrap.h"
 
 #include "finite_hmm_alloc.h"
+#include "finite_hmm.h"
 
 #define BIASMODEL_IMPORT
 #include "bias_model.h"
@@ -171,7 +172,7 @@ int read_biasfhmm(char* filename,struct fhmm** ret)
         RUN(HDFWRAP_READ_DATA(hdf5_data, "/biasfhmm", "transition_index", &fhmm->tindex));
 
         RUN(HDFWRAP_READ_DATA(hdf5_data, "/biasfhmm", "background", &fhmm->background));
-
+        RUN(fhmm_set_pindex(fhmm));
 
         close_hdf5_file(&hdf5_data);
 
@@ -42,9 +42,28 @@
 #include "finite_hmm_alloc.h"
 #include "finite_hmm_stats.h"
 
+#include "train_control.h"
+#include "checkpoint.h"
+#include "score_pipeline.h"
+#include "shard.h"
+
 #define OPT_SEED 1
 #define OPT_NUM_MODELS 2
 #define OPT_COMPETITIVE 3
+#define OPT_COMPACT 4
+#define OPT_FLOAT_DP 5
+#define OPT_BATCH 6
+#define OPT_BATCH_GROWTH 7
+#define OPT_BLOCK_LEN 8
+#define OPT_TOL 9
+#define OPT_WINDOW 10
+#define OPT_TIME_LIMIT 11
+#define OPT_CHECKPOINT 12
+#define OPT_SCORE_THREADS 13
+#define OPT_DEDUP 14
+#define OPT_SHARDS 15
+#define OPT_LOCKSTEP 16
+#define OPT_SCORE_STALENESS 17
 
 
 struct parameters{
@@ -53,16 +72,30 @@ struct parameters{
         char* cmd_line;
         double alpha;
         double gamma;
+        double batch_growth;
+        double tol;
+        double time_limit;
+        double checkpoint;
         unsigned long seed;
         rk_state rndstate;
         struct rng_state* rng;
         int active_file;
+        int batch_size;
+        int block_len;
+        int window;
         int competitive;
+        int compact;
+        int dedup;
+        int float_dp;
+        int lockstep;
         int num_iter;
         int inner_iter;
         int local;
         int num_models;
         int num_threads;
+        int score_threads;
+        int score_staleness;
+        int shards;
         int num_start_states;
         int num_max_states;
         int rev;
@@ -75,7 +108,7 @@ static void* do_calibrate_per_model(void* threadarg);
 
 
 
-static int analyzescores(struct tl_seq_buffer* sb, struct model_bag* model_bag);
+static int analyzescores(struct tl_seq_buffer* sb, struct model_bag* model_bag, struct shard* shard, double* stat);
 static int reset_sequence_weights(struct tl_seq_buffer* sb, int num_models);
 
 static int set_sequence_weights(struct tl_seq_buffer* sb, int num_models, double temperature);
@@ -114,6 +147,20 @@ int main (int argc, char *argv[])
         param->seed = 0;
         param->num_models = 1;
         param->competitive = 0;
+        param->compact = IHMM_U_DOUBLE;
+        param->float_dp = 0;
+        param->lockstep = 0;
+        param->batch_size = 0;
+        param->batch_growth = 1.0;
+        param->block_len = 0;
+        param->tol = 0.0;
+        param->window = 10;
+        param->time_limit = 0.0;
+        param->checkpoint = 0.0;
+        param->score_threads = 0;
+        param->score_staleness = 1;
+        param->dedup = 0;
+        param->shards = 1;
         param->num_max_states = 1000;
         param->rng = NULL;
         while (1){
@@ -130,6 +177,20 @@ int main (int argc, char *argv[])
                         {"gamma",required_argument,0,'g'},
                         {"seed",required_argument,0,OPT_SEED},
                         {"competitive",no_argument,0,OPT_COMPETITIVE},
+                        {"compact",required_argument,0,OPT_COMPACT},
+                        {"float-dp",no_argument,0,OPT_FLOAT_DP},
+                        {"lockstep",no_argument,0,OPT_LOCKSTEP},
+                        {"batch",required_argument,0,OPT_BATCH},
+                        {"batch-growth",required_argument,0,OPT_BATCH_GROWTH},
+                        {"block-len",required_argument,0,OPT_BLOCK_LEN},
+                        {"tol",required_argument,0,OPT_TOL},
+                        {"window",required_argument,0,OPT_WINDOW},
+                        {"time-limit",required_argument,0,OPT_TIME_LIMIT},
+                        {"checkpoint",required_argument,0,OPT_CHECKPOINT},
+                        {"score-threads",required_argument,0,OPT_SCORE_THREADS},
+                        {"score-staleness",required_argument,0,OPT_SCORE_STALENESS},
+                        {"dedup",no_argument,0,OPT_DEDUP},
+                        {"shards",required_argument,0,OPT_SHARDS},
                         {"rev",0,0,'r'},
                         {"help",0,0,'h'},
                         {0, 0, 0, 0}
@@ -144,6 +205,48 @@ int main (int argc, char *argv[])
                 case OPT_COMPETITIVE:
                         param->competitive =1;
                         break;
+                case OPT_COMPACT:
+                        param->compact = atoi(optarg);
+                        break;
+                case OPT_FLOAT_DP:
+                        param->float_dp = 1;
+                        break;
+                case OPT_LOCKSTEP:
+                        param->lockstep = 1;
+                        break;
+                case OPT_BATCH:
+                        param->batch_size = atoi(optarg);
+                        break;
+                case OPT_BATCH_GROWTH:
+                        param->batch_growth = atof(optarg);
+                        break;
+                case OPT_BLOCK_LEN:
+                        param->block_len = atoi(optarg);
+                        break;
+                case OPT_TOL:
+                        param->tol = atof(optarg);
+                        break;
+                case OPT_WINDOW:
+                        param->window = atoi(optarg);
+                        break;
+                case OPT_TIME_LIMIT:
+                        param->time_limit = atof(optarg);
+                        break;
+                case OPT_CHECKPOINT:
+                        param->checkpoint = atof(optarg);
+                        break;
+                case OPT_SCORE_THREADS:
+                        param->score_threads = atoi(optarg);
+                        break;
+                case OPT_SCORE_STALENESS:
+                        param->score_staleness = atoi(optarg);
+                        break;
+                case OPT_DEDUP:
+                        param->dedup = 1;
+                        break;
+                case OPT_SHARDS:
+                        param->shards = atoi(optarg);
+                        break;
                 case OPT_SEED:
                         param->seed = atoi(optarg);
                         break;
@@ -225,6 +328,51 @@ int main (int argc, char *argv[])
                 ERROR_MSG("To few models! use -nmodels <1+>");
         }
 
+        if(param->compact < IHMM_U_DOUBLE || param->compact > IHMM_U_REGENERATE){
+                RUN(print_help(argv));
+                ERROR_MSG("Unknown compact mode: %d use -compact <0,1,2>", param->compact);
+        }
+
+        if(param->batch_size < 0 || param->batch_growth < 1.0){
+                RUN(print_help(argv));
+                ERROR_MSG("Batch size must be >= 0 and batch growth >= 1.0");
+        }
+
+        if(param->lockstep && param->float_dp){
+                RUN(print_help(argv));
+                ERROR_MSG("--lockstep works on double precision rows only");
+        }
+
+        if(param->block_len < 0){
+                RUN(print_help(argv));
+                ERROR_MSG("Block length must be >= 0");
+        }
+
+        if(param->tol < 0.0 || param->window < 2 || param->time_limit < 0.0){
+                RUN(print_help(argv));
+                ERROR_MSG("Need --tol >= 0, --window >= 2 and --time-limit >= 0");
+        }
+
+        if(param->checkpoint < 0.0){
+                RUN(print_help(argv));
+                ERROR_MSG("Checkpoint interval must be >= 0");
+        }
+
+        if(param->score_threads < 0 || (param->score_threads && param->score_threads >= param->num_threads)){
+                RUN(print_help(argv));
+                ERROR_MSG("Background scoring needs 0 < --score-threads < --nthreads (got %d of %d)", param->score_threads, param->num_threads);
+        }
+
+        if(param->score_staleness < 1){
+                RUN(print_help(argv));
+                ERROR_MSG("Need --score-staleness >= 1 (got %d)", param->score_staleness);
+        }
+
+        if(param->shards < 1 || (param->shards > 1 && param->score_threads)){
+                RUN(print_help(argv));
+                ERROR_MSG("Need --shards >= 1; sharding can not be combined with --score-threads");
+        }
+
         if(param->seed){
                 RUNP(param->rng = init_rng(param->seed));
                 rk_seed(param->seed, &param->rndstate);
@@ -253,21 +401,45 @@ int run_build_ihmm(struct parameters* param)
         struct model_bag* model_bag = NULL;
         struct tl_seq_buffer* sb = NULL;
         struct seqer_thread_data** td = NULL;
+        struct beam_sampling_param bp;
+        struct train_control* tc = NULL;
+        struct checkpoint_writer* cw = NULL;
+        struct score_pipeline* sp = NULL;
+        struct shard_transport* tr = NULL;
+        struct shard* shard = NULL;
+        double* stat = NULL;
+        int stop;
+        int have_scores;
 
         struct seq_ihmm_data** ihmm_data_slots = NULL;
 
         int i;
         int j;
+        int c;
 
         ASSERT(param!= NULL, "No parameters found.");
         init_logsum();
 
+        if(param->shards > 1){
+                /* fork before anything else (OpenMP in particular)
+                   runs; all processes need the same seed to build
+                   identical models */
+                if(!param->seed){
+                        param->seed = (unsigned long) (rk_random(&param->rndstate) | 1);
+                        free_rng(param->rng);
+                        RUNP(param->rng = init_rng(param->seed));
+                        rk_seed(param->seed, &param->rndstate);
+                }
+                RUN(shard_transport_socket(&tr, param->shards));
+        }
+
         /* If we have saved a model continue from there */
         if(my_file_exists(param->in_model)){
                 /* PROBABLY need to re-alloc num_state_array */
                 //MMALLOC(num_state_array, sizeof(int)* param->num_models);
                 RUNP(model_bag = read_model_bag_hdf5(param->in_model));
                 RUNP(sb = get_sequences_from_hdf5_model(param->in_model,IHMM_SEQ_READ_ALL));
+                RUN(set_ihmm_seq_u_mode(sb, model_bag->num_models, param->compact));
 
                 /*MMALLOC(sb->num_state_arr, sizeof(int) * model_bag->num_models);
                 for(i = 0; i < model_bag->num_models;i++){
@@ -287,7 +459,7 @@ int run_build_ihmm(struct parameters* param)
 
                 RUN(read_sequences_file(&sb, param->input));
 
-                RUN(prep_sequences(sb,param->rng, param->num_models,param->num_start_states,0.0));
+                RUN(prep_sequences(sb,param->rng, param->num_models,param->num_start_states,0.0, param->compact, param->dedup));
 
                 //RUNP(sb = load_sequences(param->input,&param->rndstate));
 
@@ -308,7 +480,7 @@ int run_build_ihmm(struct parameters* param)
                 //LOG_MSG("%d ",sb->num_seq);
                 for(i = 0; i < model_bag->num_models;i++){
 
-                        RUN(fill_counts(model_bag->models[i], sb,i));
+                        RUN(fill_counts(model_bag->models[i], sb,i, param->num_threads));
 
                         //model_bag->max_num_states = MACRO_MAX(model_bag->max_num_states,model_bag->models[i]->num_states);
                 }
@@ -325,10 +497,41 @@ int run_build_ihmm(struct parameters* param)
                 RUN(create_seqer_thread_data(&td,param->num_threads, (sb->max_len+2)  ,model_bag->max_num_states, &model_bag->rndstate));
         }
 
+        if(param->float_dp){
+                RUN(set_seqer_thread_data_float_dp(td, sb->max_len+2, model_bag->max_num_states));
+        }
+        if(param->block_len && param->block_len < sb->max_len){
+                /* beam sampling never needs more DP rows than a block  */
+                RUN(resize_seqer_thread_data_dp(td, param->block_len+2, model_bag->max_num_states));
+        }
+        if(param->lockstep && model_bag->num_models > 1){
+                /* whole sequences only; blocks still run model by model */
+                c = sb->max_len;
+                if(param->block_len && param->block_len < c){
+                        c = param->block_len;
+                }
+                LOG_MSG("Lockstep DP over %d models (%0.1f MB per thread).", model_bag->num_models, (double) model_bag->num_models * (double) (c+2) * (double) model_bag->max_num_states * sizeof(double) / 1048576.0);
+                RUN(set_seqer_thread_data_lockstep(td, model_bag->num_models, c+2, model_bag->max_num_states));
+        }
+
+        if(tr){
+                RUN(alloc_shard(&shard, tr, sb));
+                if(shard->rank){
+                        /* independent DP random numbers per process */
+                        for(i = 0; i < param->num_threads;i++){
+                                td[i]->seed ^= (unsigned int) shard->rank * 2654435761u;
+                                rk_seed(td[i]->seed, &td[i]->rndstate);
+                        }
+                }
+        }
+
         LOG_MSG("Will use %d threads.", param->num_threads);
         //if((pool = thr_pool_create(param->num_threads,param->num_threads, 0, 0)) == NULL) ERROR_MSG("Creating pool thread failed.");
 
         RUNP(ft_bag = alloc_fast_param_bag(model_bag->num_models, sb->L));
+        if(shard){
+                ft_bag->stream_id = shard->rank;
+        }
 
         /* The data slot is the sequence buffer holds all the data structures
            to perform the beam sampling steps. However, since we occasionally
@@ -340,6 +543,24 @@ int run_build_ihmm(struct parameters* param)
 
         MMALLOC(ihmm_data_slots, sizeof(struct seq_ihmm_data*) * sb->num_seq);
 
+        init_beam_sampling_param(&bp, param->inner_iter, param->num_threads);
+        bp.batch_size = param->batch_size;
+        bp.batch_growth = param->batch_growth;
+        bp.block_len = param->block_len;
+        bp.shard = shard;
+
+        RUN(alloc_train_control(&tc, model_bag->num_models, param->window, param->tol, param->time_limit));
+        MMALLOC(stat, sizeof(double) * model_bag->num_models * TC_NUM_STAT);
+        if(!shard || shard->rank == 0){
+                RUN(alloc_checkpoint_writer(&cw, param->in_model, param->checkpoint));
+        }
+        if(param->score_threads){
+                /* the sampler runs on the remaining threads  */
+                RUN(alloc_score_pipeline(&sp, sb, model_bag->num_models, param->score_threads, param->score_staleness, model_bag->max_num_states, model_bag->seed));
+                bp.num_threads = param->num_threads - param->score_threads;
+                LOG_MSG("Scoring on %d threads in the background, sampling on %d.", param->score_threads, bp.num_threads);
+        }
+
         /* Main function */
         int outer_iter = param->num_iter / param->inner_iter;
         LOG_MSG("outer: %d  %d %d ",outer_iter, param->num_iter, param->inner_iter);
@@ -351,66 +572,131 @@ int run_build_ihmm(struct parameters* param)
 /* run inner iter beam sampling iterations */
                 LOG_MSG("Start beam");
                 START_TIMER(n);
-                RUN(run_beam_sampling(model_bag,ft_bag, sb,td, param->inner_iter, param->num_threads));
+                RUN(run_beam_sampling(model_bag,ft_bag, sb,td, &bp));
                 STOP_TIMER(n);
                 GET_TIMING(n);
 
                 //LOG_MSG("Start scoring");
                 START_TIMER(n);
-                LOG_MSG("Convert");
-                /* convert to fhmm */
-                RUN(convert_ihmm_to_fhmm_models(model_bag));
+                if(sp){
+                        /* collect the scores of the models from
+                           --score-staleness rounds ago, then hand over
+                           this round's */
+                        RUN(score_pipeline_finish(sp, sb, &have_scores));
+                        LOG_MSG("Convert");
+                        RUN(convert_ihmm_to_fhmm_models(model_bag));
+                        RUN(score_pipeline_start(sp, model_bag));
+                }else{
+                        LOG_MSG("Convert");
+                        /* convert to fhmm */
+                        RUN(convert_ihmm_to_fhmm_models(model_bag));
 //LOG_MSG("Calibrate");
 
-                /* calibrate */
-                //RUN(calibrate_all(model_bag, td));
+                        /* calibrate */
+                        //RUN(calibrate_all(model_bag, td));
 
-                /* swap out slots.. */
+                        /* swap out slots.. */
 
-                for(j = 0; j < sb->num_seq;j++){
-                        ihmm_data_slots[j] = sb->sequences[j]->data;
-                        sb->sequences[j]->data = ihmm_data_slots[j]->score_arr;
-                }
-                LOG_MSG("Scoring");
-                /* score */
-                RUN(run_score_sequences(model_bag->finite_models, sb, td, model_bag->num_models, FHMM_SCORE_LODD));
-                for(j = 0; j < sb->num_seq;j++){
-                        sb->sequences[j]->data = ihmm_data_slots[j];
+                        for(j = 0; j < sb->num_seq;j++){
+                                ihmm_data_slots[j] = sb->sequences[j]->data;
+                                sb->sequences[j]->data = ihmm_data_slots[j]->score_arr;
+                        }
+                        LOG_MSG("Scoring");
+                        /* score */
+                        RUN(run_score_sequences(model_bag->finite_models, sb, td, model_bag->num_models, FHMM_SCORE_LODD));
+                        for(j = 0; j < sb->num_seq;j++){
+                                sb->sequences[j]->data = ihmm_data_slots[j];
+                        }
+                        have_scores = 1;
                 }
 
                 //RUN(score_all_vs_all(model_bag,sb,td));
-                LOG_MSG("Analyse");
-                /* analyzescores */
-                RUN(analyzescores(sb, model_bag));
-                //exit(0);
-                /* need to reset weights before writing models to disk!  */
-                if(param->competitive){ /* competitive training */
-                        set_sequence_weights(sb,  model_bag->num_models, 2.0 / log10f( (float) (i+1) + 1.0F));
-                }else{          /* reset sequence weights.  */
-                        reset_sequence_weights(sb, model_bag->num_models);
+                if(have_scores){
+                        LOG_MSG("Analyse");
+                        /* analyzescores */
+                        RUN(analyzescores(sb, model_bag, shard, stat));
+                        //exit(0);
+                        /* need to reset weights before writing models to disk!  */
+                        if(param->competitive){ /* competitive training */
+                                set_sequence_weights(sb,  model_bag->num_models, 2.0 / log10f( (float) (i+1) + 1.0F));
+                        }else{          /* reset sequence weights.  */
+                                reset_sequence_weights(sb, model_bag->num_models);
+                        }
                 }
                 STOP_TIMER(n);
                 GET_TIMING(n);
-                /* write temporary results */
+                /* write temporary results in the background */
                 LOG_MSG("Writing model");
                 START_TIMER(n);
-                write_program_state(param->in_model, model_bag, sb, td, param->num_threads);
+                if(shard){
+                        RUN(shard_gather_labels(shard, model_bag->num_models));
+                        RUN(shard_full_view(shard, sb));
+                }
+                if(cw){
+                        RUN(checkpoint_writer_submit(cw, model_bag, sb, td, param->num_threads));
+                }
+                if(shard){
+                        RUN(shard_local_view(shard, sb));
+                }
                 STOP_TIMER(n);
                 GET_TIMING(n);
 
+                if(!have_scores){
+                        continue;
+                }
+                RUN(train_control_update(tc, stat, &stop));
+                if(shard){
+                        /* the coordinator's clock decides */
+                        RUN(shard_broadcast(shard, &stop, sizeof(int)));
+                }
+                if(stop){
+                        break;
+                }
+        }
+        if(sp){
+                /* merge the scores still in flight, oldest first  */
+                RUN(score_pipeline_drain(sp, sb, &have_scores));
+                while(have_scores){
+                        RUN(analyzescores(sb, model_bag, shard, stat));
+                        if(param->competitive){
+                                set_sequence_weights(sb,  model_bag->num_models, 2.0 / log10f( (float) (i+1) + 1.0F));
+                        }else{
+                                reset_sequence_weights(sb, model_bag->num_models);
+                        }
+                        RUN(score_pipeline_drain(sp, sb, &have_scores));
+                }
+                free_score_pipeline(sp);
+                sp = NULL;
+        }
+        RUN(train_control_report(tc));
+        free_train_control(tc);
+        tc = NULL;
+        MFREE(stat);
+        stat = NULL;
+        /* the final state is written synchronously once the last
+           checkpoint is on disk */
+        if(cw){
+                if(checkpoint_writer_wait(cw) != OK){
+                        WARNING_MSG("Writing checkpoint %s failed.", param->in_model);
+                }
+                free_checkpoint_writer(cw);
+                cw = NULL;
         }
 
         DESTROY_TIMER(n);
         /* Write results */
         RUN(convert_ihmm_to_fhmm_models(model_bag));
 
+        if(shard){
+                /* only the coordinator writes; it needs every label */
+                RUN(shard_gather_labels(shard, model_bag->num_models));
+                free_shard(shard, sb);
+                shard = NULL;
+        }
         //RUN(score_all_vs_all(model_bag,sb,td));
-        RUN(write_model_bag_hdf5(model_bag,param->in_model));
-
-        //RUN(add_annotation(param->in_model, "seqwise_model_cmd", param->cmd_line));
-        RUN(add_sequences_to_hdf5_model(param->in_model, sb,  model_bag->num_models));
-
-        RUN(write_thread_data_to_hdf5(param->in_model, td, param->num_threads, sb->max_len+2, model_bag->max_num_states));
+        if(!tr || tr->rank == 0){
+                RUN(write_program_state(param->in_model, model_bag, sb, td, param->num_threads));
+        }
         //RUN(write_thread_data_to_)
         //RUN(write_model(model, param->output));
         /*for(i = 0; i < model_bag->num_models;i++){
@@ -440,10 +726,31 @@ int run_build_ihmm(struct parameters* param)
         free_model_bag(model_bag);
         free_fast_param_bag(ft_bag);
         free_seqer_thread_data(td);
+        if(tr){
+                tr->free(tr);
+        }
         //thr_pool_destroy(pool);
         //MFREE(num_state_array);
         return OK;
 ERROR:
+        if(shard){
+                free_shard(shard, sb);
+        }
+        if(tr){
+                tr->free(tr);
+        }
+        if(sp){
+                free_score_pipeline(sp);
+        }
+        if(cw){
+                free_checkpoint_writer(cw);
+        }
+        if(tc){
+                free_train_control(tc);
+        }
+        if(stat){
+                MFREE(stat);
+        }
         for(i = 0; i < sb->num_seq;i++){
                 d = sb->sequences[i]->data;
                 RUN(free_ihmm_seq_data(&d));
@@ -536,9 +843,12 @@ int reset_sequence_weights(struct tl_seq_buffer* sb, int num_models)
         return OK;
 }
 
-int analyzescores(struct tl_seq_buffer* sb, struct model_bag* model_bag)
+/* stat receives TC_NUM_STAT statistics per model for the train control */
+int analyzescores(struct tl_seq_buffer* sb, struct model_bag* model_bag, struct shard* shard, double* stat)
 {
+        double* sum = NULL;
         double s0,s1,s2;
+        double w;
         int i,j;
         struct seq_ihmm_data* d = NULL;
         //int max_print;
@@ -555,24 +865,47 @@ int analyzescores(struct tl_seq_buffer* sb, struct model_bag* model_bag)
 
                 }*/
 
+        MMALLOC(sum, sizeof(double) * num_models * 3);
         for(j = 0; j < num_models;j++){
                 s0 = 0.0;
                 s1 = 0.0;
                 s2 = 0.0;
                 for(i = 0; i < sb->num_seq;i++){
                         d = sb->sequences[i]->data;
-                        s0 += 1.0;
-                        s1 += d->score_arr[j];
-                        s2 += d->score_arr[j] * d->score_arr[j];
+                        w = (double) d->multiplicity;
+                        s0 += w;
+                        s1 += w * d->score_arr[j];
+                        s2 += w * d->score_arr[j] * d->score_arr[j];
 
                 }
+                sum[j*3] = s0;
+                sum[j*3+1] = s1;
+                sum[j*3+2] = s2;
+        }
+        if(shard){
+                RUN(shard_allreduce_sum(shard, sum, num_models * 3));
+        }
+        for(j = 0; j < num_models;j++){
+                s0 = sum[j*3];
+                s1 = sum[j*3+1];
+                s2 = sum[j*3+2];
                 //LOG_MSG(" %f sum logP",s1);
                 s2 = sqrt((s0 * s2 - s1 * s1)/ (s0 * (s0 -1.0)));
                 s1 = s1 / s0 ;
-                fprintf(stdout,"Model %d:\t%f\t%f\t(%d states)  alpha = %f, gamma = %f\n",j, s1,s2  ,model_bag->models[j]->num_states, model_bag->models[j]->alpha ,model_bag->models[j]->gamma);
+                if(!shard || shard->rank == 0){
+                        fprintf(stdout,"Model %d:\t%f\t%f\t(%d states)  alpha = %f, gamma = %f\n",j, s1,s2  ,model_bag->models[j]->num_states, model_bag->models[j]->alpha ,model_bag->models[j]->gamma);
+                }
+                stat[j * TC_NUM_STAT + TC_STAT_STATES] = (double) model_bag->models[j]->num_states;
+                stat[j * TC_NUM_STAT + TC_STAT_ALPHA] = model_bag->models[j]->alpha;
+                stat[j * TC_NUM_STAT + TC_STAT_GAMMA] = model_bag->models[j]->gamma;
+                stat[j * TC_NUM_STAT + TC_STAT_LL] = s1;
         }
+        MFREE(sum);
         return OK;
 ERROR:
+        if(sum){
+                MFREE(sum);
+        }
         return FAIL;
 }
 
@@ -769,6 +1102,20 @@ int print_help(char **argv)
         fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--niter","Number of iterations." ,"[1000]"  );
         fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--alpha","Alpha hyper parameter." ,"[NA]"  );
         fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--gamma","Gamma hyper oparameter." ,"[NA]"  );
+        fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--float-dp","Single precision beam sampling DP." ,"[off]"  );
+        fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--lockstep","Run all models over each sequence together (more memory)." ,"[off]"  );
+        fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--compact","Store u as 0: double, 1: float, 2: nothing (regenerate); 12, 8 or 4 bytes per residue and model." ,"[0]"  );
+        fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--batch","Relabel only this many sequences per iteration (0: all)." ,"[0]"  );
+        fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--batch-growth","Multiply batch size by this every iteration." ,"[1.0]"  );
+        fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--block-len","Sample longer sequences in blocks of this length (0: off)." ,"[0]"  );
+        fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--tol","Stop once statistics change less than this (0: off)." ,"[0]"  );
+        fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--window","Rounds compared for --tol." ,"[10]"  );
+        fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--time-limit","Stop before exceeding this many seconds (0: off)." ,"[0]"  );
+        fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--checkpoint","Seconds between background checkpoints (0: every round)." ,"[0]"  );
+        fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--score-threads","Score on this many threads while sampling continues (0: off)." ,"[0]"  );
+        fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--score-staleness","Rounds the weights lag the sampler with --score-threads." ,"[1]"  );
+        fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--dedup","Sample identical sequences once; copies after the first are not written to the output." ,"[off]"  );
+        fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--shards","Split sequences over this many processes (each uses --nthreads)." ,"[1]"  );
         MFREE(tmp);
         return OK;
 ERROR:
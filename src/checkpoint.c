@@ -0,0 +1,224 @@
+#include "tldevel.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "tlseqbuffer.h"
+
+#include "model_struct.h"
+#include "model_alloc.h"
+#include "model_io.h"
+#include "sequence_io.h"
+#include "thread_data.h"
+#include "thread_data_io.h"
+#include "wall_clock.h"
+
+#define CHECKPOINT_IMPORT
+#include "checkpoint.h"
+
+static int snapshot_state(struct checkpoint_slot* s, struct model_bag* mb, struct tl_seq_buffer* sb, struct seqer_thread_data** td, int num_threads);
+static int write_slot(struct checkpoint_slot* s, char* tmp_name, char* filename);
+static void* checkpoint_thread(void* arg);
+static void free_slot(struct checkpoint_slot* s);
+
+int alloc_checkpoint_writer(struct checkpoint_writer** cw, char* filename, double interval)
+{
+        struct checkpoint_writer* c = NULL;
+        int len;
+        int i;
+
+        ASSERT(filename != NULL, "No filename");
+        ASSERT(interval >= 0.0, "Negative checkpoint interval");
+
+        MMALLOC(c, sizeof(struct checkpoint_writer));
+        for(i = 0; i < 2;i++){
+                c->slot[i].mb = NULL;
+                c->slot[i].seq = NULL;
+                c->slot[i].td_mem = NULL;
+                c->slot[i].td = NULL;
+                c->slot[i].num_threads = 0;
+        }
+        c->filename = NULL;
+        c->tmp_name = NULL;
+        c->interval = interval;
+        c->last = wall_clock();
+        c->next = 0;
+        c->writing = -1;
+        c->status = OK;
+        c->num_written = 0;
+
+        len = strlen(filename);
+        MMALLOC(c->filename, sizeof(char) * (len + 1));
+        MMALLOC(c->tmp_name, sizeof(char) * (len + 5));
+        snprintf(c->filename, len + 1, "%s", filename);
+        snprintf(c->tmp_name, len + 5, "%s.tmp", filename);
+
+        *cw = c;
+        return OK;
+ERROR:
+        free_checkpoint_writer(c);
+        return FAIL;
+}
+
+/* Snapshots the current state and starts writing it in the background
+ * if at least interval seconds passed since the last checkpoint. Only
+ * blocks if the previous checkpoint is still being written. */
+int checkpoint_writer_submit(struct checkpoint_writer* cw, struct model_bag* mb, struct tl_seq_buffer* sb, struct seqer_thread_data** td, int num_threads)
+{
+        double now;
+        int rc;
+
+        ASSERT(cw != NULL, "No checkpoint writer");
+
+        now = wall_clock();
+        if(now - cw->last < cw->interval){
+                return OK;
+        }
+        /* the slot not being written  */
+        RUN(snapshot_state(&cw->slot[cw->next], mb, sb, td, num_threads));
+
+        if(checkpoint_writer_wait(cw) != OK){
+                WARNING_MSG("Writing checkpoint %s failed.", cw->filename);
+        }
+
+        cw->writing = cw->next;
+        cw->next = cw->next ^ 1;
+        cw->last = now;
+        rc = pthread_create(&cw->thread, NULL, checkpoint_thread, cw);
+        if(rc){
+                cw->writing = -1;
+                ERROR_MSG("Could not start checkpoint thread (error %d).", rc);
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Waits for the background write (if any) and returns its result  */
+int checkpoint_writer_wait(struct checkpoint_writer* cw)
+{
+        ASSERT(cw != NULL, "No checkpoint writer");
+        if(cw->writing != -1){
+                pthread_join(cw->thread, NULL);
+                cw->writing = -1;
+        }
+        return cw->status;
+ERROR:
+        return FAIL;
+}
+
+void* checkpoint_thread(void* arg)
+{
+        struct checkpoint_writer* cw = arg;
+
+        cw->status = write_slot(&cw->slot[cw->writing], cw->tmp_name, cw->filename);
+        if(cw->status == OK){
+                cw->num_written++;
+        }
+        return NULL;
+}
+
+int write_slot(struct checkpoint_slot* s, char* tmp_name, char* filename)
+{
+        int fd;
+
+        /* start from an empty file - a stale one may hold larger datasets  */
+        remove(tmp_name);
+
+        RUN(write_model_bag_hdf5(s->mb, tmp_name));
+        RUN(write_packed_sequences_hdf5(tmp_name, s->seq));
+        RUN(write_thread_data_to_hdf5(tmp_name, s->td, s->num_threads, s->max_len, s->max_K));
+        /* flush to disk before the rename so a crash can not leave a
+           truncated file under the checkpoint name */
+        fd = open(tmp_name, O_RDONLY);
+        if(fd == -1){
+                ERROR_MSG("Could not open %s.", tmp_name);
+        }
+        if(fsync(fd) != 0){
+                close(fd);
+                ERROR_MSG("Could not sync %s.", tmp_name);
+        }
+        close(fd);
+        if(rename(tmp_name, filename) != 0){
+                ERROR_MSG("Could not rename %s to %s.", tmp_name, filename);
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+int snapshot_state(struct checkpoint_slot* s, struct model_bag* mb, struct tl_seq_buffer* sb, struct seqer_thread_data** td, int num_threads)
+{
+        int i;
+
+        RUN(copy_model_bag(&s->mb, mb));
+        RUN(pack_sequences_for_hdf5(&s->seq, sb, mb->num_models));
+
+        /* only the seeds and RNG states are written  */
+        if(s->num_threads != num_threads){
+                if(s->td){
+                        MFREE(s->td);
+                        s->td = NULL;
+                }
+                if(s->td_mem){
+                        MFREE(s->td_mem);
+                        s->td_mem = NULL;
+                }
+                MMALLOC(s->td_mem, sizeof(struct seqer_thread_data) * num_threads);
+                MMALLOC(s->td, sizeof(struct seqer_thread_data*) * num_threads);
+                memset(s->td_mem, 0, sizeof(struct seqer_thread_data) * num_threads);
+                for(i = 0; i < num_threads;i++){
+                        s->td[i] = &s->td_mem[i];
+                }
+                s->num_threads = num_threads;
+        }
+        for(i = 0; i < num_threads;i++){
+                s->td[i]->thread_ID = td[i]->thread_ID;
+                s->td[i]->num_threads = td[i]->num_threads;
+                s->td[i]->seed = td[i]->seed;
+                s->td[i]->rndstate = td[i]->rndstate;
+        }
+        s->max_len = sb->max_len+2;
+        s->max_K = mb->max_num_states;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+void free_slot(struct checkpoint_slot* s)
+{
+        if(s->mb){
+                free_model_bag(s->mb);
+                s->mb = NULL;
+        }
+        if(s->seq){
+                free_seq_hdf5_pack(s->seq);
+                s->seq = NULL;
+        }
+        if(s->td){
+                MFREE(s->td);
+                s->td = NULL;
+        }
+        if(s->td_mem){
+                MFREE(s->td_mem);
+                s->td_mem = NULL;
+        }
+}
+
+void free_checkpoint_writer(struct checkpoint_writer* cw)
+{
+        if(cw){
+                checkpoint_writer_wait(cw);
+                free_slot(&cw->slot[0]);
+                free_slot(&cw->slot[1]);
+                if(cw->filename){
+                        MFREE(cw->filename);
+                }
+                if(cw->tmp_name){
+                        MFREE(cw->tmp_name);
+                }
+                MFREE(cw);
+        }
+}
@@ -0,0 +1,57 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <pthread.h>
+
+#ifdef CHECKPOINT_IMPORT
+#define EXTERN
+#else
+#define EXTERN extern
+#endif
+
+/* Writes the program state (model bag, sequences with labels and the
+ * thread RNG states) from a background thread. Submitting copies the
+ * state into one of two slots and hands it to a writer thread, so
+ * sampling can continue while the previous snapshot is on its way to
+ * disk. The file is written under <filename>.tmp and renamed once
+ * complete; a crash mid-write leaves the last good checkpoint in place.
+ * HDF5 is not thread safe: the caller must not touch HDF5 files until
+ * checkpoint_writer_wait has returned. */
+
+struct model_bag;
+struct tl_seq_buffer;
+struct seq_hdf5_pack;
+struct seqer_thread_data;
+
+struct checkpoint_slot{
+        struct model_bag* mb;
+        struct seq_hdf5_pack* seq;
+        struct seqer_thread_data* td_mem;
+        struct seqer_thread_data** td;
+        int num_threads;
+        int max_len;
+        int max_K;
+};
+
+struct checkpoint_writer{
+        struct checkpoint_slot slot[2];
+        pthread_t thread;
+        char* filename;
+        char* tmp_name;
+        double interval;        /* seconds between checkpoints; 0: every call */
+        double last;
+        int next;               /* slot used by the next snapshot */
+        int writing;            /* slot being written or -1 */
+        int status;             /* result of the last write */
+        int num_written;
+};
+
+EXTERN int alloc_checkpoint_writer(struct checkpoint_writer** cw, char* filename, double interval);
+EXTERN int checkpoint_writer_submit(struct checkpoint_writer* cw, struct model_bag* mb, struct tl_seq_buffer* sb, struct seqer_thread_data** td, int num_threads);
+EXTERN int checkpoint_writer_wait(struct checkpoint_writer* cw);
+EXTERN void free_checkpoint_writer(struct checkpoint_writer* cw);
+
+#undef CHECKPOINT_IMPORT
+#undef EXTERN
+
+#endif
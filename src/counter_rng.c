@@ -0,0 +1,148 @@
+#include "tldevel.h"
+
+#define COUNTER_RNG_IMPORT
+#include "counter_rng.h"
+
+#define PHILOX_M0 0xD2511F53U
+#define PHILOX_M1 0xCD9E8D57U
+#define PHILOX_W0 0x9E3779B9U
+#define PHILOX_W1 0xBB67AE85U
+
+/* same construction as rk_double: 53 random bits */
+#define CRNG_TO_DOUBLE(a,b) ((double)((a) >> 5) * 67108864.0 + (double)((b) >> 6)) / 9007199254740992.0
+
+void crng_init_stream(struct crng_stream* s, uint32_t key0, uint32_t key1, uint32_t id0, uint32_t id1)
+{
+        s->key[0] = key0;
+        s->key[1] = key1;
+        s->id[0] = id0;
+        s->id[1] = id1;
+}
+
+void crng_philox4x32(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4])
+{
+        uint64_t p0,p1;
+        uint32_t c0,c1,c2,c3;
+        uint32_t k0,k1;
+        int i;
+
+        c0 = ctr[0];
+        c1 = ctr[1];
+        c2 = ctr[2];
+        c3 = ctr[3];
+        k0 = key[0];
+        k1 = key[1];
+        for(i = 0; i < 10;i++){
+                p0 = (uint64_t) PHILOX_M0 * (uint64_t) c0;
+                p1 = (uint64_t) PHILOX_M1 * (uint64_t) c2;
+                c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+                c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+                c1 = (uint32_t) p1;
+                c3 = (uint32_t) p0;
+                k0 += PHILOX_W0;
+                k1 += PHILOX_W1;
+        }
+        out[0] = c0;
+        out[1] = c1;
+        out[2] = c2;
+        out[3] = c3;
+}
+
+/* Block j of substream sub is counter (j, sub, id0, id1); every block
+ * gives two doubles. */
+void crng_fill_uniform(const struct crng_stream* s, uint32_t sub, double* out, int n)
+{
+        crng_fill_uniform_at(s, sub, 0, out, n);
+}
+
+void crng_fill_uniform_at(const struct crng_stream* s, uint32_t sub, int first, double* out, int n)
+{
+        uint32_t ctr[4];
+        uint32_t r[4];
+        int i;
+        int pos;
+
+        ctr[1] = sub;
+        ctr[2] = s->id[0];
+        ctr[3] = s->id[1];
+        i = 0;
+        while(i < n){
+                pos = first + i;
+                ctr[0] = (uint32_t) (pos >> 1);
+                crng_philox4x32(ctr, s->key, r);
+                if(pos & 1){
+                        out[i] = CRNG_TO_DOUBLE(r[2], r[3]);
+                        i++;
+                }else{
+                        out[i] = CRNG_TO_DOUBLE(r[0], r[1]);
+                        i++;
+                        if(i < n){
+                                out[i] = CRNG_TO_DOUBLE(r[2], r[3]);
+                                i++;
+                        }
+                }
+        }
+}
+
+#ifdef ITESTCRNG
+
+/* Known answer tests from the Random123 distribution  */
+int main(void)
+{
+        struct crng_stream s;
+        double a[101];
+        double b[7];
+        uint32_t ctr[4];
+        uint32_t key[2];
+        uint32_t out[4];
+        int i;
+
+        ctr[0] = 0;
+        ctr[1] = 0;
+        ctr[2] = 0;
+        ctr[3] = 0;
+        key[0] = 0;
+        key[1] = 0;
+        crng_philox4x32(ctr, key, out);
+        ASSERT(out[0] == 0x6627e8d5U && out[1] == 0xe169c58dU && out[2] == 0xbc57ac4cU && out[3] == 0x9b00dbd8U, "Philox known answer test 1 failed");
+
+        ctr[0] = 0xffffffffU;
+        ctr[1] = 0xffffffffU;
+        ctr[2] = 0xffffffffU;
+        ctr[3] = 0xffffffffU;
+        key[0] = 0xffffffffU;
+        key[1] = 0xffffffffU;
+        crng_philox4x32(ctr, key, out);
+        ASSERT(out[0] == 0x408f276dU && out[1] == 0x41c83b0eU && out[2] == 0xa20bc7c6U && out[3] == 0x6d5451fdU, "Philox known answer test 2 failed");
+
+        ctr[0] = 0x243f6a88U;
+        ctr[1] = 0x85a308d3U;
+        ctr[2] = 0x13198a2eU;
+        ctr[3] = 0x03707344U;
+        key[0] = 0xa4093822U;
+        key[1] = 0x299f31d0U;
+        crng_philox4x32(ctr, key, out);
+        ASSERT(out[0] == 0xd16cfe09U && out[1] == 0x94fdccebU && out[2] == 0x5001e420U && out[3] == 0x24126ea1U, "Philox known answer test 3 failed");
+
+        /* a prefix of a substream does not depend on its length */
+        crng_init_stream(&s, 42, 7, 3, 0);
+        crng_fill_uniform(&s, 11, a, 101);
+        crng_fill_uniform(&s, 11, b, 7);
+        for(i = 0; i < 7;i++){
+                ASSERT(a[i] == b[i], "Substream differs at %d", i);
+        }
+        for(i = 0; i < 101;i++){
+                ASSERT(a[i] >= 0.0 && a[i] < 1.0, "Number out of range: %f", a[i]);
+        }
+        crng_fill_uniform_at(&s, 11, 51, b, 7);
+        for(i = 0; i < 7;i++){
+                ASSERT(a[51+i] == b[i], "Substream offset differs at %d", i);
+        }
+        crng_fill_uniform(&s, 12, b, 7);
+        ASSERT(a[0] != b[0], "Substreams 11 and 12 are identical");
+        LOG_MSG("Counter RNG test passed.");
+        return EXIT_SUCCESS;
+ERROR:
+        return EXIT_FAILURE;
+}
+#endif
@@ -0,0 +1,33 @@
+#ifndef COUNTER_RNG_H
+#define COUNTER_RNG_H
+
+#include <stdint.h>
+
+#ifdef COUNTER_RNG_IMPORT
+#define EXTERN
+#else
+#define EXTERN extern
+#endif
+
+/* Counter based random numbers (Philox4x32-10; Salmon et al. 2011).
+ * The n-th number of substream sub of a stream is a pure function of
+ * (key, id, sub, n), so numbers can be generated in any order and on
+ * any thread with identical results. */
+
+struct crng_stream{
+        uint32_t key[2];
+        uint32_t id[2];
+};
+
+EXTERN void crng_init_stream(struct crng_stream* s, uint32_t key0, uint32_t key1, uint32_t id0, uint32_t id1);
+EXTERN void crng_philox4x32(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4]);
+
+/* Fill out with n uniform doubles in [0,1) from substream sub  */
+EXTERN void crng_fill_uniform(const struct crng_stream* s, uint32_t sub, double* out, int n);
+/* As above starting with the first-th number of the substream  */
+EXTERN void crng_fill_uniform_at(const struct crng_stream* s, uint32_t sub, int first, double* out, int n);
+
+#undef COUNTER_RNG_IMPORT
+#undef EXTERN
+
+#endif
@@ -17,51 +17,9 @@
 /* - sort */
 /* - bin_search upper lower */
 
-// auxiliary functions for RB tree...
-
-static int sort_by_p(const void *a, const void *b);
-static void* get_transition(void* ptr)
-{
-        struct fast_t_item* tmp = (struct fast_t_item*)  ptr;
-        return &tmp->t;
-}
-
-static int resolve_default(void* ptr_a,void* ptr_b)
-{
-        return 1;
-}
-
-long int compare_transition(void* keyA, void* keyB)
-{
-        double* num1 = (double*)keyA;
-        double* num2 = (double*)keyB;
-
-        if(*num1 == *num2){
-                return 0;
-        }
-        if(*num1 > *num2){
-                return 1;
-        }else{
-                return -1;
-        }
-}
-
-
-void print_fast_t_item_struct(void* ptr,FILE* out_ptr)
-{
-        struct fast_t_item* tmp = (struct fast_t_item*)  ptr;
-        fprintf(out_ptr,"%d\t%d\t%f\n",tmp->from , tmp->to,tmp->t);
-}
-
-void free_fast_t_item_struct(void* ptr)
-{
-        //struct fast_t_item* tmp = (struct fast_t_item*)  ptr;
-        if(ptr){
-                MFREE(ptr);
-        }
-}
-
-
+static int resize_arena(struct fast_hmm_param* ft, int num_trans, int num_states);
+static int make_destination_index(struct fast_hmm_param* ft);
+static void merge_sort_perm(const struct fast_hmm_param* ft, int* perm, int* tmp, int n, int (*cmp)(const struct fast_hmm_param* ft, int a, int b));
 
 struct fast_param_bag* alloc_fast_param_bag(int num_models,  int L)
 {
@@ -74,6 +32,7 @@ struct fast_param_bag* alloc_fast_param_bag(int num_models,  int L)
         b->fast_params = NULL;
         b->num_models = num_models;
         b->max_last_state = -1;
+        b->stream_id = 0;
 
         MMALLOC(b->fast_params,sizeof(struct fast_hmm_param*)* b->num_models);
 
@@ -107,52 +66,40 @@ void free_fast_param_bag(struct fast_param_bag* b)
 /* Goal: efficient datastructure for double indexing transition: */
 /* 1) by from and to */
 /* 2) by accessing a list sorted by transition probability  */
-/* Plan: have rb tree for sorted list (i.e. insert then 'flatten' tree)  */
+/* Plan: keep the list as flat arrays and sort a permutation  */
 /* AND a normal transition matrix. */
-/* For efficiency, let's add a vector of transitin structs to avoid millions of malloc calls */
-/* Actually let's not as nodes in RB-tree are allocated anyhow.. */
 
 struct fast_hmm_param* alloc_fast_hmm_param(int k, int L)
 {
         struct fast_hmm_param* ft = NULL;
         int i,j;
-        /* function pointers for left leaning RB tree..  */
-        void*  (*fp_get)(void* ptr) = NULL;
-        long int (*fp_cmp)(void* keyA, void* keyB)= NULL;
-        int (*fp_cmp_same)(void* ptr_a,void* ptr_b);
-        void (*fp_print)(void* ptr,FILE* out_ptr) = NULL;
-        void (*fp_free)(void* ptr) = NULL;
 
         ASSERT(L > 1, "Need more than one letter");
         MMALLOC(ft, sizeof(struct fast_hmm_param));
-        ft->alloc_num_states = k;
+        ft->alloc_num_states = 0;
         ft->alloc_items = 1024 ;
         ft->last_state = 0;
-        ft->list = NULL;
-        ft->infinity = NULL;
+        ft->arena = NULL;
+        ft->t = NULL;
+        ft->from = NULL;
+        ft->to = NULL;
+        ft->perm = NULL;
+        ft->inf_t = NULL;
+        ft->inf_from = NULL;
+        ft->inf_to = NULL;
+        ft->in_t = NULL;
+        ft->in_from = NULL;
+        ft->in_offset = NULL;
         ft->num_items = 0;
         ft->emission = NULL;    /* This will be indexed by letter i.e. e['A']['numstate'] */
         ft->transition = NULL;
+        crng_init_stream(&ft->u_stream, 0, 0, 0, 0);
 
         ft->L = L;
-        //ft->background_emission = NULL;
-        ft->alloc_num_trans = 65536;
-        MMALLOC(ft->list, sizeof(struct fast_t_item*) * ft->alloc_num_trans);
-        for(i = 0; i < ft->alloc_num_trans;i++){
-                ft->list[i] = NULL;
-                MMALLOC(ft->list[i], sizeof(struct fast_t_item));
-        }
+        ft->alloc_num_trans = 0;
         ft->num_trans = 0;
-        //ft->root = NULL;
+        RUN(resize_arena(ft, 65536, k));
 
-        //MMALLOC(ft->background_emission, sizeof(double) * L  );
-
-        //for(i = 0; i < L; i++){
-        //ft->background_emission[i] = 0.0;
-        //}
-
-        /* RUNP(ft->emission = galloc(ft->emission, ft->L, ft->alloc_num_states, 0.0)); */
-        /* RUNP(ft->transition = galloc(ft->transition,  ft->alloc_num_states,  ft->alloc_num_states, 0.0)); */
         RUN(galloc(&ft->transition,  ft->alloc_num_states,  ft->alloc_num_states));
         for(i = 0; i < ft->alloc_num_states;i++){
                 for(j = 0; j < ft->alloc_num_states;j++){
@@ -165,56 +112,105 @@ struct fast_hmm_param* alloc_fast_hmm_param(int k, int L)
                         ft->emission[i][j] = 0.0;
                 }
         }
-
-        /*fp_get = &get_transition;
-        fp_cmp = &compare_transition;
-        fp_print = &print_fast_t_item_struct;
-        fp_cmp_same = &resolve_default;
-        fp_free = &free_fast_t_item_struct;
-
-        ft->root = init_tree(fp_get,fp_cmp,fp_cmp_same,fp_print,fp_free);
-        */
-
-        MMALLOC(ft->infinity, sizeof(struct fast_t_item*) * ft->alloc_num_states);
-
-        for(i = 0; i < ft->alloc_num_states;i++){
-                ft->infinity[i] = NULL;
-                MMALLOC(ft->infinity[i], sizeof(struct fast_t_item));
-                ft->infinity[i]->from = -1;
-                ft->infinity[i]->to = -1;
-                ft->infinity[i]->t = 0.0;
-        }
         return ft;
 ERROR:
         free_fast_hmm_param(ft);
         return NULL;
 }
 
-int sort_by_p(const void *a, const void *b)
+/* (Re)allocates the arena for num_trans list items followed by
+ * num_states infinity transitions; existing items are kept. */
+int resize_arena(struct fast_hmm_param* ft, int num_trans, int num_states)
 {
-        struct fast_t_item* const *one = a;
-        struct fast_t_item* const *two = b;
+        void* arena = NULL;
+        double* t = NULL;
+        uint16_t* from = NULL;
+        uint16_t* to = NULL;
+        size_t n;
+        int i;
 
-        if((*one)->t > (*two)->t){
-                return -1;
+        n = (size_t) num_trans + (size_t) num_states;
+        MMALLOC(arena, (sizeof(double) + 2 * sizeof(uint16_t)) * n);
+        t = (double*) arena;
+        from = (uint16_t*) (t + n);
+        to = from + n;
+
+        if(ft->arena){
+                for(i = 0; i < ft->num_trans;i++){
+                        t[i] = ft->t[i];
+                        from[i] = ft->from[i];
+                        to[i] = ft->to[i];
+                }
+                for(i = 0; i < ft->alloc_num_states;i++){
+                        t[num_trans + i] = ft->inf_t[i];
+                        from[num_trans + i] = ft->inf_from[i];
+                        to[num_trans + i] = ft->inf_to[i];
+                }
+                MFREE(ft->arena);
         }else{
-                return 1;
+                ft->alloc_num_states = 0;
+        }
+        for(i = ft->alloc_num_states; i < num_states;i++){
+                t[num_trans + i] = 0.0;
+                from[num_trans + i] = (uint16_t) -1;
+                to[num_trans + i] = (uint16_t) -1;
         }
+        ft->arena = arena;
+        ft->t = t;
+        ft->from = from;
+        ft->to = to;
+        ft->inf_t = t + num_trans;
+        ft->inf_from = from + num_trans;
+        ft->inf_to = to + num_trans;
+
+        if(num_trans != ft->alloc_num_trans){
+                MREALLOC(ft->perm, sizeof(int) * num_trans);
+                MREALLOC(ft->in_t, sizeof(double) * num_trans);
+                MREALLOC(ft->in_from, sizeof(uint16_t) * num_trans);
+        }
+        if(num_states != ft->alloc_num_states){
+                MREALLOC(ft->in_offset, sizeof(int) * (num_states+1));
+        }
+        ft->alloc_num_trans = num_trans;
+        ft->alloc_num_states = num_states;
+        return OK;
+ERROR:
+        return FAIL;
 }
 
-
+/* Doubles the arena; every resize copies all arrays, so growth has to be
+ * geometric to keep the cost of adding transitions linear. */
 int expand_num_trans(struct fast_hmm_param* ft)
 {
-        int i,o;
-        o = ft->alloc_num_trans;
-        ft->alloc_num_trans = ft->alloc_num_trans + ft->alloc_num_states /2;
+        RUN(resize_arena(ft, MACRO_MAX(ft->alloc_num_trans + 1, ft->alloc_num_trans * 2), ft->alloc_num_states));
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Makes sure the list can hold num_trans transitions (plus one, as
+ * add_fast_transition expects a free slot). */
+int fast_hmm_param_reserve(struct fast_hmm_param* ft, int num_trans)
+{
+        ASSERT(ft != NULL, "No ft struct!");
+        if(num_trans >= ft->alloc_num_trans){
+                RUN(resize_arena(ft, MACRO_MAX(num_trans + 1, ft->alloc_num_trans * 2), ft->alloc_num_states));
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
 
-        MREALLOC(ft->list, sizeof(struct fast_t_item*) * ft->alloc_num_trans);
-        for(i = o; i < ft->alloc_num_trans;i++){
-                ft->list[i] = NULL;
-                MMALLOC(ft->list[i], sizeof(struct fast_t_item));
+int add_fast_transition(struct fast_hmm_param* ft, int from, int to, double t)
+{
+        int i = ft->num_trans;
+        ft->t[i] = t;
+        ft->from[i] = from;
+        ft->to[i] = to;
+        ft->num_trans++;
+        if(ft->num_trans == ft->alloc_num_trans){
+                RUN(expand_num_trans(ft));
         }
-        //ft->num_trans = 0;
         return OK;
 ERROR:
         return FAIL;
@@ -223,54 +219,39 @@ ERROR:
 int expand_ft_if_necessary(struct fast_hmm_param* ft, int new_num_states)
 {
         int i,j, num_old_item;
+        int new_alloc;
         ASSERT(ft != NULL, "No ft struct!");
         ASSERT(new_num_states >2,"No states requested");
 
-
-
         if(new_num_states > ft->alloc_num_states){
                 //WARNING_MSG("Extending: %d %d", new_num_states,ft->alloc_num_states);
                 num_old_item = ft->alloc_num_states;
-                while(new_num_states > ft->alloc_num_states){
-                        ft->alloc_num_states = ft->alloc_num_states + 64;
+                new_alloc = ft->alloc_num_states;
+                while(new_num_states > new_alloc){
+                        new_alloc = new_alloc + 64;
                 }
-                /* RUNP(ft->emission = galloc(ft->emission, ft->L, ft->alloc_num_states, 0.0)); */
-                /* RUNP(ft->transition = galloc(ft->transition,  ft->alloc_num_states,  ft->alloc_num_states, 0.0)); */
+                RUN(resize_arena(ft, ft->alloc_num_trans, new_alloc));
 
                 RUN(galloc(&ft->transition,  ft->alloc_num_states,  ft->alloc_num_states));
                 RUN(galloc(&ft->emission, ft->L, ft->alloc_num_states));
 
                 for(i = 0; i < ft->alloc_num_states;i++){
                         for(j = num_old_item ; j < ft->alloc_num_states;j++){
-                                //if(i >= num_old_item || j >= num_old_item){
                                 ft->transition[i][j] = 0.0;
-                                //}
                         }
                 }
 
                 for(i = num_old_item; i < ft->alloc_num_states;i++){
                         for(j = 0; j < ft->alloc_num_states;j++){
-                                //if(i >= num_old_item || j >= num_old_item){
                                 ft->transition[i][j] = 0.0;
-                                //}
                         }
                 }
 
-
                 for(i = 0; i < ft->L;i++){
                         for(j = num_old_item; j < ft->alloc_num_states;j++){
                                 ft->emission[i][j] = 0.0;
                         }
                 }
-
-                MREALLOC(ft->infinity, sizeof(struct fast_t_item*) * ft->alloc_num_states);
-                for(i = num_old_item; i < ft->alloc_num_states;i++){
-                        ft->infinity[i] = NULL;
-                        MMALLOC(ft->infinity[i], sizeof(struct fast_t_item));
-                        ft->infinity[i]->from = -1;
-                        ft->infinity[i]->to = -1;
-                        ft->infinity[i]->t = 0.0;
-                }
         }
         return OK;
 ERROR:
@@ -278,45 +259,23 @@ ERROR:
         return FAIL;
 }
 
-/*int expand_transition_if_necessary(struct fast_hmm_param* ft)
-  {
-  int i, num_old_item;
-  ASSERT(ft != NULL, "No ft struct!");
-  num_old_item = ft->alloc_items;
-  ft->alloc_items += 1024;
-  LOG_MSG("expanding from: %d to %d",num_old_item, ft->alloc_items);
-  MREALLOC(ft->infinity, sizeof(struct fast_t_item*) * ft->alloc_items);
-  for(i = num_old_item; i < ft->alloc_items;i++){
-  ft->infinity[i] = NULL;
-  MMALLOC(ft->infinity[i], sizeof(struct fast_t_item));
-  ft->infinity[i]->from = -1;
-  ft->infinity[i]->to = -1;
-  ft->infinity[i]->t = 0.0f;
-  }
-  return OK;
-  ERROR:
-  free_fast_hmm_param(ft);
-  return FAIL;
-  }*/
-
 void free_fast_hmm_param(struct fast_hmm_param* ft)
 {
-        int i;
         if(ft){
-                //if(ft->root){
-                //ft->root->free_tree(ft->root);
-                //}
-                if(ft->list){
-                        for(i = 0; i < ft->alloc_num_trans;i++){
-                                MFREE(ft->list[i]);
-                        }
-                        MFREE(ft->list);
+                if(ft->arena){
+                        MFREE(ft->arena);
                 }
-                if(ft->infinity){
-                        for(i = 0; i < ft->alloc_num_states;i++){
-                                MFREE(ft->infinity[i]);
-                        }
-                        MFREE(ft->infinity);
+                if(ft->perm){
+                        MFREE(ft->perm);
+                }
+                if(ft->in_t){
+                        MFREE(ft->in_t);
+                }
+                if(ft->in_from){
+                        MFREE(ft->in_from);
+                }
+                if(ft->in_offset){
+                        MFREE(ft->in_offset);
                 }
                 if(ft->emission){
                         gfree(ft->emission);
@@ -325,10 +284,6 @@ void free_fast_hmm_param(struct fast_hmm_param* ft)
                 if(ft->transition){
                         gfree(ft->transition);
                 }
-                //if(ft->background_emission){
-                //MFREE(ft->background_emission);
-                //}
-
                 MFREE(ft);
         }
 }
@@ -337,34 +292,114 @@ void free_fast_hmm_param(struct fast_hmm_param* ft)
 int make_flat_param_list(struct fast_hmm_param* ft)
 {
         ft->num_items = ft->num_trans;
+        RUN(fast_hmm_param_sort(ft, fast_hmm_param_cmp_by_t_desc));
+        RUN(make_destination_index(ft));
+        return OK;
+ERROR:
+        return FAIL;
+}
 
-        //ft->list = (struct fast_t_item**) ft->root->data_nodes;
-        qsort(ft->list ,ft->num_trans,  sizeof(struct fast_t_item*),sort_by_p);
-        //LOG_MSG("Sorted: %d ", ft->num_trans);
-/*ASSERT(ft != NULL, "No parameters");
-        if(ft->root->data_nodes){
-                MFREE(ft->root->data_nodes);
-                ft->root->data_nodes = NULL;
-                ft->root->cur_data_nodes = 0;
+/* Counting sort of the t-sorted list by destination. The sort is
+ * stable so transitions into each state remain in descending order of
+ * t; the forward pass can stop scanning a state as soon as t <= u. */
+int make_destination_index(struct fast_hmm_param* ft)
+{
+        int* offset = NULL;
+        int i,c,K,item;
+
+        /* include the infinity slot so that the index is valid for all
+           states, including last_state  */
+        K = ft->last_state+1;
+        offset = ft->in_offset;
+        for(i = 0; i <= K;i++){
+                offset[i] = 0;
+        }
+        for(i = 0; i < ft->num_items;i++){
+                ASSERT(ft->to[i] < K,"Transition to state %d is outside model (%d states)",ft->to[i],K);
+                offset[ft->to[i]+1]++;
         }
-        RUN(ft->root->flatten_tree(ft->root));
+        for(i = 1; i <= K;i++){
+                offset[i] += offset[i-1];
+        }
+        for(i = 0; i < ft->num_items;i++){
+                item = ft->perm[i];
+                c = offset[ft->to[item]]++;
+                ft->in_t[c] = ft->t[item];
+                ft->in_from[c] = ft->from[item];
+        }
+        /* shift back - offset[b] was advanced to the start of b+1  */
+        for(i = K; i > 0;i--){
+                offset[i] = offset[i-1];
+        }
+        offset[0] = 0;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+int fast_hmm_param_sort(struct fast_hmm_param* ft, int (*cmp)(const struct fast_hmm_param* ft, int a, int b))
+{
+        int* tmp = NULL;
+        int i;
 
-        ft->num_items = ft->root->num_entries;
-        ft->list = (struct fast_t_item**) ft->root->data_nodes;
-        */
+        for(i = 0; i < ft->num_items;i++){
+                ft->perm[i] = i;
+        }
+        MMALLOC(tmp, sizeof(int) * (ft->num_items+1));
+        merge_sort_perm(ft, ft->perm, tmp, ft->num_items, cmp);
+        MFREE(tmp);
         return OK;
 ERROR:
         return FAIL;
 }
 
-int fast_hmm_param_cmp_by_t_desc(const void *a, const void *b)
+/* bottom up merge sort of item indices; stable  */
+void merge_sort_perm(const struct fast_hmm_param* ft, int* perm, int* tmp, int n, int (*cmp)(const struct fast_hmm_param* ft, int a, int b))
 {
-        struct fast_t_item* const *one = a;
-        struct fast_t_item* const *two = b;
+        int* src = perm;
+        int* dst = tmp;
+        int* swap = NULL;
+        int width;
+        int lo,mid,hi;
+        int i,j,k;
+
+        for(width = 1; width < n; width *= 2){
+                for(lo = 0; lo < n; lo += 2 * width){
+                        mid = MACRO_MIN(lo + width, n);
+                        hi = MACRO_MIN(lo + 2 * width, n);
+                        i = lo;
+                        j = mid;
+                        k = lo;
+                        while(i < mid && j < hi){
+                                if(cmp(ft, src[j], src[i]) < 0){
+                                        dst[k++] = src[j++];
+                                }else{
+                                        dst[k++] = src[i++];
+                                }
+                        }
+                        while(i < mid){
+                                dst[k++] = src[i++];
+                        }
+                        while(j < hi){
+                                dst[k++] = src[j++];
+                        }
+                }
+                swap = src;
+                src = dst;
+                dst = swap;
+        }
+        if(src != perm){
+                for(i = 0; i < n;i++){
+                        perm[i] = src[i];
+                }
+        }
+}
 
-        if((*one)->t > (*two)->t){
+int fast_hmm_param_cmp_by_t_desc(const struct fast_hmm_param* ft, int a, int b)
+{
+        if(ft->t[a] > ft->t[b]){
                 return -1;
-        }else if((*one)->t == (*two)->t){
+        }else if(ft->t[a] == ft->t[b]){
                 return 0;
         }else{
                 return 1;
@@ -372,17 +407,14 @@ int fast_hmm_param_cmp_by_t_desc(const void *a, const void *b)
 }
 
 
-int fast_hmm_param_cmp_by_to_from_asc(const void *a, const void *b)
+int fast_hmm_param_cmp_by_to_from_asc(const struct fast_hmm_param* ft, int a, int b)
 {
-        struct fast_t_item* const *one = a;
-        struct fast_t_item* const *two = b;
-
-        if((*one)->from > (*two)->from){
+        if(ft->from[a] > ft->from[b]){
                 return 1;
-        }else if((*one)->from == (*two)->from){
-                if((*one)->to > (*two)->to){
+        }else if(ft->from[a] == ft->from[b]){
+                if(ft->to[a] > ft->to[b]){
                         return 1;
-                }else if((*one)->to == (*two)->to){
+                }else if(ft->to[a] == ft->to[b]){
                         return 0;
                 }else{
                         return -1;
@@ -393,61 +425,48 @@ int fast_hmm_param_cmp_by_to_from_asc(const void *a, const void *b)
 }
 
 
-int fast_hmm_param_cmp_by_from_asc(const void *a, const void *b)
+int fast_hmm_param_cmp_by_from_asc(const struct fast_hmm_param* ft, int a, int b)
 {
-        struct fast_t_item* const *one = a;
-        struct fast_t_item* const *two = b;
-
-        if((*one)->from > (*two)->from){
+        if(ft->from[a] > ft->from[b]){
                 return 1;
-        }else if((*one)->from == (*two)->from){
-
+        }else if(ft->from[a] == ft->from[b]){
                 return 0;
-
         }else{
                 return -1;
         }
 }
 
-
-
-
-int fast_hmm_param_cmp_by_to_asc(const void *a, const void *b)
+int fast_hmm_param_cmp_by_to_asc(const struct fast_hmm_param* ft, int a, int b)
 {
-        struct fast_t_item* const *one = a;
-        struct fast_t_item* const *two = b;
-
-
-        if((*one)->to > (*two)->to){
+        if(ft->to[a] > ft->to[b]){
                 return 1;
-        }else if((*one)->to == (*two)->to){
+        }else if(ft->to[a] == ft->to[b]){
                 return 0;
         }else{
                 return -1;
         }
-
 }
 
 /* Selects item so that 0 .. return value is greater than x */
 int fast_hmm_param_binarySearch_t(struct fast_hmm_param* ft, double x)
 {
-        struct fast_t_item** list = NULL;
+        int* perm = ft->perm;
+        double* t = ft->t;
         int l,r;
 
         l = 0;
         r = ft->num_items -1;
-        list = ft->list;
         while (l <= r)
         {
                 int m = l + (r-l)/2;
 
                 // Check if x is present at mid
-                if (list[m]->t == x){
+                if (t[perm[m]] == x){
                         return m;
                 }
 
                 // If x greater, ignore left half
-                if (list[m]->t > x){
+                if (t[perm[m]] > x){
                         l = m + 1;
                 }else{
                         r = m - 1;
@@ -460,15 +479,15 @@ int fast_hmm_param_binarySearch_t(struct fast_hmm_param* ft, double x)
 
 int fast_hmm_param_binarySearch_to_lower_bound(struct fast_hmm_param* ft, int x)
 {
-        struct fast_t_item** list = NULL;
+        int* perm = ft->perm;
+        uint16_t* to = ft->to;
         int l,r;
         l = 0;
         r = ft->num_items -1;
-        list = ft->list;
         while (l <= r)
         {
                 int m = l + (r-l)/2;
-                if (list[m]->to < x){
+                if (to[perm[m]] < x){
                         l = m + 1;
                 }else{
                         r = m -1;
@@ -479,16 +498,16 @@ int fast_hmm_param_binarySearch_to_lower_bound(struct fast_hmm_param* ft, int x)
 
 int fast_hmm_param_binarySearch_to_upper_bound(struct fast_hmm_param* ft, int x)
 {
-        struct fast_t_item** list = NULL;
+        int* perm = ft->perm;
+        uint16_t* to = ft->to;
         int l,r;
 
         l = 0;
         r = ft->num_items -1;
-        list = ft->list;
         while (l <= r)
         {
                 int m = l + (r-l)/2;
-                if (x < list[m]->to){
+                if (x < to[perm[m]]){
                         r = m -1;
                 }else{
                         l = m + 1;
@@ -499,15 +518,15 @@ int fast_hmm_param_binarySearch_to_upper_bound(struct fast_hmm_param* ft, int x)
 
 int fast_hmm_param_binarySearch_from_lower_bound(struct fast_hmm_param* ft, int x)
 {
-        struct fast_t_item** list = NULL;
+        int* perm = ft->perm;
+        uint16_t* from = ft->from;
         int l,r;
         l = 0;
         r = ft->num_items -1;
-        list = ft->list;
         while (l <= r)
         {
                 int m = l + (r-l)/2;
-                if (list[m]->from < x){
+                if (from[perm[m]] < x){
                         l = m + 1;
                 }else{
                         r = m -1;
@@ -518,16 +537,16 @@ int fast_hmm_param_binarySearch_from_lower_bound(struct fast_hmm_param* ft, int
 
 int fast_hmm_param_binarySearch_from_upper_bound(struct fast_hmm_param* ft, int x)
 {
-        struct fast_t_item** list = NULL;
+        int* perm = ft->perm;
+        uint16_t* from = ft->from;
         int l,r;
 
         l = 0;
         r = ft->num_items -1;
-        list = ft->list;
         while (l <= r)
         {
                 int m = l + (r-l)/2;
-                if (x < list[m]->from){
+                if (x < from[perm[m]]){
                         r = m -1;
                 }else{
                         l = m + 1;
@@ -552,7 +571,6 @@ int main(const int argc,const char * argv[])
 {
 
         struct fast_hmm_param* ft = NULL;
-        struct fast_t_item* tmp = NULL;
         int i,j;
         int res = 0;
         float x;
@@ -573,21 +591,16 @@ int main(const int argc,const char * argv[])
 
         RUN(make_flat_param_list(ft) );
 
-        //ft->root->flatten_tree(ft->root);
-
-        //ft->root->print_tree(ft->root,NULL);
-        /*LOG_MSG("Sorted by RB tree.");
-        fprintf(stdout,"%d items\n",ft->root->num_entries);
-        for(i = 0; i < ft->root->num_entries;i++){
-                tmp = (struct fast_t_item*) ft->root->data_nodes[i];
-                fprintf(stdout,"%d %f\n",i , tmp->t);
+        LOG_MSG("Check destination index.");
+        for(i = 0; i <= ft->last_state;i++){
+                for(j = ft->in_offset[i]+1; j < ft->in_offset[i+1];j++){
+                        ASSERT(ft->in_t[j-1] >= ft->in_t[j],"Destination index is not sorted");
+                }
         }
-        LOG_MSG("Sorted by sort function.");
-        ft->num_items = ft->root->num_entries;
-        ft->list = (struct fast_t_item**) ft->root->data_nodes;
-        qsort(ft->list, ft->num_items, sizeof(struct fast_t_item*), fast_hmm_param_cmp_by_t_desc);*/
+        ASSERT(ft->in_offset[ft->last_state+1] == ft->num_items,"Destination index is incomplete");
+
         for(i = 0; i < ft->num_items;i++){
-                fprintf(stdout,"%d %f\n",i , ft->list[i]->t);
+                fprintf(stdout,"%d %f\n",i , ft->t[ft->perm[i]]);
         }
 
         RUN(print_fast_hmm_params(ft));
@@ -598,15 +611,15 @@ int main(const int argc,const char * argv[])
                 res = fast_hmm_param_binarySearch_t(ft, x);
                 fprintf(stdout,"search for %f: %d  \n",x, res);
                 for(j = 0; j < res;j++){
-                        ASSERT(ft->list[j]->t >= x,"Warning - binary search seems to have failed");
+                        ASSERT(ft->t[ft->perm[j]] >= x,"Warning - binary search seems to have failed");
                 }
         }
-        x = ft->list[3]->t;
+        x = ft->t[ft->perm[3]];
 
         res = fast_hmm_param_binarySearch_t(ft,x);
         fprintf(stdout,"search for %f: %d   \n",x, res);
         for(j = 0; j < res;j++){
-                ASSERT(ft->list[j]->t >= x,"Warning - binary search seems to have failed");
+                ASSERT(ft->t[ft->perm[j]] >= x,"Warning - binary search seems to have failed");
         }
         RUN(print_fast_hmm_params(ft));
 
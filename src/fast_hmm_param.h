@@ -7,23 +7,36 @@
 #include "tldevel.h"
 #include "tlrbtree.h"
 #include "distributions.h"
+#include "counter_rng.h"
 #include <math.h>
 #include <float.h>
 #include <stdint.h>
 
 
-struct fast_t_item{
-        double t;
-        uint16_t from;
-        uint16_t to;
-};
-
+/* Transitions are stored as a struct of arrays in one arena: item i is
+ * from[i] -> to[i] with probability t[i]. The first alloc_num_trans
+ * entries hold the list, the following alloc_num_states entries the
+ * transition of each state into infinity (inf_t, inf_from and inf_to
+ * point there). perm holds the item order after sorting. */
 struct fast_hmm_param{
-        struct fast_t_item** list;
-        struct fast_t_item** infinity;
+        void* arena;
+        double* t;
+        uint16_t* from;
+        uint16_t* to;
+        int* perm;
+        double* inf_t;
+        uint16_t* inf_from;
+        uint16_t* inf_to;
+        /* transitions grouped by destination state; within each group
+           sorted by t (descending). Predecessors of state b are
+           in_from[in_offset[b]] .. in_from[in_offset[b+1]-1]  */
+        double* in_t;
+        uint16_t* in_from;
+        int* in_offset;
         // struct rbtree_root* root;
         double** transition;
         double** emission;
+        struct crng_stream u_stream; /* slice variables drawn against these parameters */
         //double* background_emission;
         int num_trans;
         int alloc_num_trans;
@@ -39,6 +52,7 @@ struct fast_param_bag{
         struct fast_hmm_param** fast_params;
         int max_last_state;
         int num_models;
+        int stream_id;          /* keeps slice variable streams of shards apart */
 };
 
 
@@ -51,6 +65,10 @@ extern void free_fast_param_bag(struct fast_param_bag* b);
 extern int expand_num_trans(struct fast_hmm_param* ft);
 extern struct fast_hmm_param* alloc_fast_hmm_param(int k,int L);
 
+/* append from -> to with probability t to the list  */
+extern int add_fast_transition(struct fast_hmm_param* ft, int from, int to, double t);
+extern int fast_hmm_param_reserve(struct fast_hmm_param* ft, int num_trans);
+
 
 
 //extern int expand_fast_hmm_param_if_necessary(struct fast_hmm_param* ft, int new_num_states,int new_items);
@@ -65,14 +83,17 @@ extern void free_fast_hmm_param(struct fast_hmm_param* ft);
 /* turn RB tree into a flat indexable structure...  */
 extern int make_flat_param_list(struct fast_hmm_param* ft);
 
-/* Sorting and binary search  */
+/* Sorting and binary search. Comparators take two item indices; sorting
+ * is stable and only permutes ft->perm. */
+
+extern int fast_hmm_param_cmp_by_t_desc(const struct fast_hmm_param* ft, int a, int b);
+extern int fast_hmm_param_cmp_by_to_from_asc(const struct fast_hmm_param* ft, int a, int b);
+extern int fast_hmm_param_cmp_by_from_asc(const struct fast_hmm_param* ft, int a, int b);
+extern int fast_hmm_param_cmp_by_to_asc(const struct fast_hmm_param* ft, int a, int b);
 
-extern int fast_hmm_param_cmp_by_t_desc(const void *a, const void *b);
-extern int fast_hmm_param_cmp_by_to_from_asc(const void *a, const void *b);
-extern int fast_hmm_param_cmp_by_from_asc(const void *a, const void *b);
-extern int fast_hmm_param_cmp_by_to_asc(const void *a, const void *b);
+extern int fast_hmm_param_sort(struct fast_hmm_param* ft, int (*cmp)(const struct fast_hmm_param* ft, int a, int b));
 
-/* return index of first element < x i.e. we can then do for(i =0; i < return;i++) */
+/* return index (in perm) of first element < x i.e. we can then do for(i =0; i < return;i++) */
 
 extern int fast_hmm_param_binarySearch_t(struct fast_hmm_param* ft, double x);
 
@@ -42,7 +42,7 @@ int print_fast_hmm_params(struct fast_hmm_param* ft)
         }
         LOG_MSG("Print infinity transitions.");
         for(j = 0; j< ft->last_state+1;j++){
-                fprintf(stdout,"%d->%d %f\n", ft->infinity[j]->from, ft->infinity[j]->to, ft->infinity[j]->t);
+                fprintf(stdout,"%d->%d %f\n", ft->inf_from[j], ft->inf_to[j], ft->inf_t[j]);
         }
         LOG_MSG("Done.");
         return OK;
@@ -52,9 +52,6 @@ ERROR:
 
 int fill_with_random_transitions(struct fast_hmm_param* ft, int k)
 {
-        //struct fast_t_item** list = NULL;
-
-        struct fast_t_item* tmp = NULL;
         int i,j;
         //int num;
         float sum = 0;
@@ -83,18 +80,7 @@ int fill_with_random_transitions(struct fast_hmm_param* ft, int k)
                 }
                 for(j = 0;j < k;j++){
                         tmp_probs[j] /= sum;
-                        tmp = ft->list[ft->num_trans];
-
-                        //MMALLOC(tmp, sizeof(struct fast_t_item));
-                        tmp->from = i;
-                        tmp->to = j;
-                        tmp->t = tmp_probs[j];
-                        ft->num_trans++;
-                        if(ft->num_trans == ft->alloc_num_trans){
-                                RUN(expand_num_trans(ft));
-                        }
-
-                        //ft->root->tree_insert(ft->root,tmp);
+                        RUN(add_fast_transition(ft, i, j, tmp_probs[j]));
                         ft->transition[i][j] = tmp_probs[j];
                 }
         }
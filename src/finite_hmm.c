@@ -7,12 +7,139 @@ static float rel_entropy(float* vec, float* back,int N);
 
 static int score_bias_forward(struct fhmm* fhmm , struct fhmm_dyn_mat* m, double* ret_score, uint8_t* a, int len);
 
+static int forward_log(struct fhmm* fhmm , struct fhmm_dyn_mat* m, float* ret_score, uint8_t* a, int len, int mode, int rolling);
+static int backward_log(struct fhmm* fhmm,struct fhmm_dyn_mat* m , float* ret_score, uint8_t* a, int len,int mode);
+static int forward_scaled(struct fhmm* fhmm , struct fhmm_dyn_mat* m, float* ret_score, uint8_t* a, int len, int mode, int rolling);
+static int backward_scaled(struct fhmm* fhmm,struct fhmm_dyn_mat* m , float* ret_score, uint8_t* a, int len,int mode);
+static int scaled_to_log(struct fhmm* fhmm, struct fhmm_dyn_mat* m, int len);
+static int trace_path(struct fhmm_dyn_mat* m, int len, int* path);
+
+/* Runs forward in the space selected with fhmm_set_dp  */
 int forward(struct fhmm* fhmm , struct fhmm_dyn_mat* m, float* ret_score, uint8_t* a, int len, int mode)
+{
+        ASSERT(fhmm != NULL, "No model");
+        if(fhmm->dp == FHMM_DP_SCALED){
+                RUN(forward_scaled(fhmm, m, ret_score, a, len, mode, 0));
+        }else{
+                RUN(forward_log(fhmm, m, ret_score, a, len, mode, 0));
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* As forward but only the score is returned. Two rows are reused so m
+ * can be allocated for a length of 1 regardless of len. */
+int forward_score(struct fhmm* fhmm , struct fhmm_dyn_mat* m, float* ret_score, uint8_t* a, int len, int mode)
+{
+        ASSERT(fhmm != NULL, "No model");
+        if(fhmm->dp == FHMM_DP_SCALED){
+                RUN(forward_scaled(fhmm, m, ret_score, a, len, mode, 1));
+        }else{
+                RUN(forward_log(fhmm, m, ret_score, a, len, mode, 1));
+        }
+        /* rows no longer line up with positions  */
+        m->scaled_F = 0;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+int backward(struct fhmm* fhmm,struct fhmm_dyn_mat* m , float* ret_score, uint8_t* a, int len,int mode)
+{
+        ASSERT(fhmm != NULL, "No model");
+        if(fhmm->dp == FHMM_DP_SCALED){
+                RUN(backward_scaled(fhmm, m, ret_score, a, len, mode));
+        }else{
+                RUN(backward_log(fhmm, m, ret_score, a, len, mode));
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Selects log space (FHMM_DP_LOG) or scaled probability space
+ * (FHMM_DP_SCALED) dynamic programming. The latter needs exp(e) and
+ * exp(t), which are made here; call again if the parameters change and
+ * before sharing the model between threads. */
+int fhmm_set_dp(struct fhmm* fhmm, int dp)
+{
+        int i,j;
+
+        ASSERT(fhmm != NULL, "No model");
+        ASSERT(dp == FHMM_DP_LOG || dp == FHMM_DP_SCALED, "Unknown DP mode %d", dp);
+
+        fhmm->dp = dp;
+        if(dp == FHMM_DP_LOG){
+                return OK;
+        }
+        RUN(galloc(&fhmm->pe, fhmm->K, fhmm->L));
+        RUN(galloc(&fhmm->pt, fhmm->K, fhmm->K));
+        for(i = 0; i < fhmm->K;i++){
+                for(j = 0; j < fhmm->L;j++){
+                        fhmm->pe[i][j] = scaledprob2prob(fhmm->e[i][j]);
+                }
+                for(j = 0; j < fhmm->K;j++){
+                        fhmm->pt[i][j] = scaledprob2prob(fhmm->t[i][j]);
+                }
+        }
+        RUN(fhmm_set_pindex(fhmm));
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Builds the destination-major view of tindex: pindex[f] lists the
+ * states with a transition into f (in increasing order) and tin / ptin
+ * the matching transitions. forward and viterbi pull from these so
+ * that every cell is accumulated in a register and written once. Has
+ * to be called whenever t or tindex change. */
+int fhmm_set_pindex(struct fhmm* fhmm)
 {
         int i,j,c,f;
 
+        ASSERT(fhmm != NULL, "No model");
+        ASSERT(fhmm->tindex != NULL, "No transition index");
+
+        RUN(galloc(&fhmm->pindex, fhmm->K, fhmm->K+1));
+        RUN(galloc(&fhmm->tin, fhmm->K, fhmm->K+1));
+        for(f = 0; f < fhmm->K;f++){
+                fhmm->pindex[f][0] = 1;
+        }
+        for(j = 0; j < fhmm->K;j++){
+                for(c = 1; c < fhmm->tindex[j][0];c++){
+                        f = fhmm->tindex[j][c];
+                        i = fhmm->pindex[f][0];
+                        fhmm->pindex[f][i] = j;
+                        fhmm->tin[f][i] = fhmm->t[j][f];
+                        fhmm->pindex[f][0]++;
+                }
+        }
+        if(fhmm->pt){
+                RUN(galloc(&fhmm->ptin, fhmm->K, fhmm->K+1));
+                for(f = 0; f < fhmm->K;f++){
+                        for(c = 1; c < fhmm->pindex[f][0];c++){
+                                fhmm->ptin[f][c] = fhmm->pt[fhmm->pindex[f][c]][f];
+                        }
+                }
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+int forward_log(struct fhmm* fhmm , struct fhmm_dyn_mat* m, float* ret_score, uint8_t* a, int len, int mode, int rolling)
+{
+        int i,j,c,f;
+        int r,pr;
+
         float** NBECJ = NULL;
         float** matrix = NULL;
+        float* prev;
+        float* cur;
+        float* tw;
+        int* pi;
+        float x;
 
         //const float* trans = 0;
         //float tSN;
@@ -33,12 +160,14 @@ int forward(struct fhmm* fhmm , struct fhmm_dyn_mat* m, float* ret_score, uint8_
         //float tmp = 0;
 
         ASSERT(fhmm != NULL, "No model");
+        ASSERT(fhmm->pindex != NULL, "No predecessor index (fhmm_set_pindex)");
         ASSERT(m != NULL, "No dyn programming  matrix");
         ASSERT(a != NULL, "No sequence");
         ASSERT(len > 0, "Seq is of length 0");
 
         matrix = m->F_matrix;
         NBECJ = m->F_NBECJ;
+        m->scaled_F = 0;
 
         if(mode){
                 q = 0.5f;
@@ -72,46 +201,45 @@ int forward(struct fhmm* fhmm , struct fhmm_dyn_mat* m, float* ret_score, uint8_
         NBECJ[0][C_STATE] = -INFINITY;
         NBECJ[0][J_STATE] = -INFINITY;
 
+        r = 0;
         for(i = 1; i < len+1;i++){
-                for(j = 0; j < fhmm->K;j++){
-                        matrix[i][j] = -INFINITY;
-                }
-                for(j = 0; j < 5;j++){
-                        NBECJ[i][j] = -INFINITY;
-                }
-
-                for(j = 0; j < fhmm->K;j++){
-                        for(c = 1; c < fhmm->tindex[j][0];c++){
-                                f = fhmm->tindex[j][c];
-                                matrix[i][f] = logsum(matrix[i][f], matrix[i-1][j] + fhmm->t[j][f]);
+                pr = r;
+                r = rolling ? (i & 1) : i;
+                prev = matrix[pr];
+                cur = matrix[r];
+                NBECJ[r][E_STATE] = -INFINITY;
+                for(f = 0; f < fhmm->K;f++){
+                        pi = fhmm->pindex[f];
+                        tw = fhmm->tin[f];
+                        x = -INFINITY;
+                        for(c = 1; c < pi[0];c++){
+                                x = logsum(x, prev[pi[c]] + tw[c]);
                         }
-                }
-                for(j = 0;j < fhmm->K;j++){
                         /* add transition from B state */
-                        matrix[i][j] = logsum(matrix[i][j], NBECJ[i-1][B_STATE] + tBX);
-                        matrix[i][j] += fhmm->e[j][a[i-1]];
-                        //cur[c] += fhmm->e[c][a[i-1]];
-                        NBECJ[i][E_STATE] = logsum(NBECJ[i][E_STATE], matrix[i][j] + tXE);
+                        x = logsum(x, NBECJ[pr][B_STATE] + tBX);
+                        x += fhmm->e[f][a[i-1]];
+                        cur[f] = x;
+                        NBECJ[r][E_STATE] = logsum(NBECJ[r][E_STATE], x + tXE);
                 }
                 /* J */
-                NBECJ[i][J_STATE] = logsum(NBECJ[i-1][J_STATE] + tJJ, NBECJ[i-1][E_STATE] + tEJ);
+                NBECJ[r][J_STATE] = logsum(NBECJ[pr][J_STATE] + tJJ, NBECJ[pr][E_STATE] + tEJ);
                 /* C */
-                NBECJ[i][C_STATE] = logsum(NBECJ[i-1][C_STATE] + tCC, NBECJ[i-1][E_STATE] + tEC);
+                NBECJ[r][C_STATE] = logsum(NBECJ[pr][C_STATE] + tCC, NBECJ[pr][E_STATE] + tEC);
                 /* N */
-                NBECJ[i][N_STATE] = NBECJ[i-1][N_STATE] + tNN;
+                NBECJ[r][N_STATE] = NBECJ[pr][N_STATE] + tNN;
                 /* B */
-                NBECJ[i][B_STATE] = logsum(NBECJ[i][N_STATE] + tNB, NBECJ[i][J_STATE]+ tJB);
+                NBECJ[r][B_STATE] = logsum(NBECJ[r][N_STATE] + tNB, NBECJ[r][J_STATE]+ tJB);
         }
 
-        *ret_score = logsum(NBECJ[len][C_STATE] + tCT, NBECJ[len][E_STATE] + tCT);
-        /* LOG_MSG("%f %f %f ",NBECJ[len][C_STATE] , fhmm->tCT,NBECJ[len][C_STATE] + fhmm->tCT); */
-        //*ret_score = (NBECJ[len][C_STATE] + tCT);
+        *ret_score = logsum(NBECJ[r][C_STATE] + tCT, NBECJ[r][E_STATE] + tCT);
+        /* LOG_MSG("%f %f %f ",NBECJ[r][C_STATE] , fhmm->tCT,NBECJ[r][C_STATE] + fhmm->tCT); */
+        //*ret_score = (NBECJ[r][C_STATE] + tCT);
         return OK;
 ERROR:
         return FAIL;
 }
 
-int backward(struct fhmm* fhmm,struct fhmm_dyn_mat* m , float* ret_score, uint8_t* a, int len,int mode)
+int backward_log(struct fhmm* fhmm,struct fhmm_dyn_mat* m , float* ret_score, uint8_t* a, int len,int mode)
 {
 
         float tNN;
@@ -132,6 +260,7 @@ int backward(struct fhmm* fhmm,struct fhmm_dyn_mat* m , float* ret_score, uint8_
         int i,j,c,f;
         float** matrix = NULL;
         float** NBECJ = NULL;
+        float x;
         ASSERT(fhmm != NULL, "No model");
         ASSERT(m != NULL, "No dyn programming  matrix");
         ASSERT(a != NULL, "No sequence");
@@ -165,6 +294,7 @@ int backward(struct fhmm* fhmm,struct fhmm_dyn_mat* m , float* ret_score, uint8_
         //LOG_MSG("%d len",len);
         matrix = m->B_matrix;
         NBECJ = m->B_NBECJ;
+        m->scaled_B = 0;
 
 
         NBECJ[len+1][C_STATE] = prob2scaledprob(1.0F);
@@ -197,17 +327,14 @@ int backward(struct fhmm* fhmm,struct fhmm_dyn_mat* m , float* ret_score, uint8_
                 /* N state  */
                 NBECJ[i][N_STATE] = logsum(NBECJ[i+1][N_STATE] + tNN, NBECJ[i][B_STATE] + tNB);
 
+                /* tindex already lists the successors each cell pulls from  */
                 for(j = 0; j < fhmm->K;j++){
-                        matrix[i][j] = NBECJ[i][E_STATE] + tXE;
-                }
-                for(j = 0; j < fhmm->K;j++){
+                        x = NBECJ[i][E_STATE] + tXE;
                         for(c = 1; c < fhmm->tindex[j][0];c++){
                                 f = fhmm->tindex[j][c];
-                                matrix[i][j] = logsum(matrix[i][j],fhmm->t[j][f] + matrix[i+1][f]);
+                                x = logsum(x,fhmm->t[j][f] + matrix[i+1][f]);
                         }
-                }
-                for(j = 0; j < fhmm->K;j++){
-                        matrix[i][j] += fhmm->e[j][(int)a[i-1]];
+                        matrix[i][j] = x + fhmm->e[j][(int)a[i-1]];
                 }
         }
         NBECJ[0][B_STATE] = -INFINITY;
@@ -230,6 +357,506 @@ ERROR:
         return FAIL;
 }
 
+/* As forward_log in probability space. Every row (with its NBECJ
+ * states) is divided by its sum; the logs of these factors add up to
+ * the score. */
+int forward_scaled(struct fhmm* fhmm , struct fhmm_dyn_mat* m, float* ret_score, uint8_t* a, int len, int mode, int rolling)
+{
+        int i,j,c,f;
+        int r,pr;
+
+        float** NBECJ = NULL;
+        float** matrix = NULL;
+        float* prev;
+        float* cur;
+        float* pe;
+        float* tw;
+        int* pi;
+        double* scale;
+        float tNN,tNB,tBX,tXE,tEC,tCC,tCT,tEJ,tJJ,tJB;
+        float p,q;
+        float x;
+        float sum;
+        float from_b;
+
+        ASSERT(fhmm != NULL, "No model");
+        ASSERT(fhmm->pe != NULL, "Scaled DP not set up (fhmm_set_dp)");
+        ASSERT(fhmm->ptin != NULL, "No predecessor index (fhmm_set_pindex)");
+        ASSERT(m != NULL, "No dyn programming  matrix");
+        ASSERT(a != NULL, "No sequence");
+        ASSERT(len > 0, "Seq is of length 0");
+
+        matrix = m->F_matrix;
+        NBECJ = m->F_NBECJ;
+        scale = m->F_scale;
+        m->scaled_F = 1;
+
+        if(mode){
+                q = 0.5f;
+                p = (float) len / ((float)len + 3.0F);
+        }else{
+                q = 0.0F;
+                p = (float) len / ((float)len + 2.0F);
+        }
+
+        tNN = p;
+        tNB = 1.0F - p;
+        tBX = 2.0F / (float) (fhmm->K * ( fhmm->K + 1.0F));
+        tXE = 1.0F;
+        tEC = 1.0F - q;
+        tCC = p;
+        tCT = 1.0F - p;
+        tEJ = q;
+        tJJ = p;
+        tJB = 1.0F - p;
+
+        for(j = 0; j < fhmm->K;j++){
+                matrix[0][j] = 0.0F;
+        }
+        NBECJ[0][N_STATE] = 1.0F;
+        NBECJ[0][B_STATE] = tNB;
+        NBECJ[0][E_STATE] = 0.0F;
+        NBECJ[0][C_STATE] = 0.0F;
+        NBECJ[0][J_STATE] = 0.0F;
+        scale[0] = 0.0;
+
+        r = 0;
+        for(i = 1; i < len+1;i++){
+                pr = r;
+                r = rolling ? (i & 1) : i;
+                prev = matrix[pr];
+                cur = matrix[r];
+                from_b = NBECJ[pr][B_STATE] * tBX;
+                sum = 0.0F;
+                for(f = 0; f < fhmm->K;f++){
+                        pi = fhmm->pindex[f];
+                        tw = fhmm->ptin[f];
+                        x = 0.0F;
+                        for(c = 1; c < pi[0];c++){
+                                x += prev[pi[c]] * tw[c];
+                        }
+                        pe = fhmm->pe[f];
+                        cur[f] = (x + from_b) * pe[a[i-1]];
+                        sum += cur[f];
+                }
+                NBECJ[r][E_STATE] = sum * tXE;
+                NBECJ[r][J_STATE] = NBECJ[pr][J_STATE] * tJJ + NBECJ[pr][E_STATE] * tEJ;
+                NBECJ[r][C_STATE] = NBECJ[pr][C_STATE] * tCC + NBECJ[pr][E_STATE] * tEC;
+                NBECJ[r][N_STATE] = NBECJ[pr][N_STATE] * tNN;
+                NBECJ[r][B_STATE] = NBECJ[r][N_STATE] * tNB + NBECJ[r][J_STATE] * tJB;
+
+                sum += NBECJ[r][N_STATE] + NBECJ[r][C_STATE] + NBECJ[r][J_STATE];
+                if(sum <= 0.0F){
+                        /* nothing reachable  */
+                        *ret_score = -INFINITY;
+                        return OK;
+                }
+                x = 1.0F / sum;
+                for(j = 0;j < fhmm->K;j++){
+                        cur[j] *= x;
+                }
+                for(j = 0; j < 5;j++){
+                        NBECJ[r][j] *= x;
+                }
+                scale[r] = scale[pr] + log(sum);
+        }
+        *ret_score = (float) (log(NBECJ[r][C_STATE] * tCT + NBECJ[r][E_STATE] * tCT) + scale[r]);
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Forward scores of n <= B sequences at once in scaled probability
+ * space. The states of all sequences form a K x B block so that a step
+ * is a product of the transitions (pindex / ptin) with the block;
+ * columns are ordered longest first and drop out once their sequence
+ * ends. */
+int forward_batch(struct fhmm* fhmm, struct fhmm_batch* b, uint8_t** seq, int* len, int n, int mode, float* scores)
+{
+        float* prev;
+        float* cur;
+        float* tmp;
+        float* np;
+        float* nc;
+        float* x;
+        float* y;
+        float* pe;
+        float* tw;
+        int* pi;
+        double* scale;
+        float tBX,tXE,tEC,tEJ;
+        float p,q;
+        float v;
+        int i,j,c,f;
+        int t0,t1;
+        int B,K;
+        int w;
+
+        ASSERT(fhmm != NULL, "No model");
+        ASSERT(fhmm->pe != NULL, "Scaled DP not set up (fhmm_set_dp)");
+        ASSERT(fhmm->ptin != NULL, "No predecessor index (fhmm_set_pindex)");
+        ASSERT(b != NULL, "No batch work space");
+        ASSERT(n <= b->alloc_B, "Too many sequences: %d (%d allocated)", n, b->alloc_B);
+        ASSERT(fhmm->K <= b->alloc_K, "Too many states: %d (%d allocated)", fhmm->K, b->alloc_K);
+
+        if(n == 0){
+                return OK;
+        }
+        B = b->alloc_B;
+        K = fhmm->K;
+        scale = b->scale;
+
+        /* longest first  */
+        for(c = 0; c < n;c++){
+                ASSERT(len[c] > 0, "Seq %d is of length 0", c);
+                i = c;
+                while(i > 0 && len[b->idx[i-1]] < len[c]){
+                        b->idx[i] = b->idx[i-1];
+                        i--;
+                }
+                b->idx[i] = c;
+        }
+        q = mode ? 0.5F : 0.0F;
+        for(c = 0; c < n;c++){
+                b->seq[c] = seq[b->idx[c]];
+                b->len[c] = len[b->idx[c]];
+                if(mode){
+                        p = (float) b->len[c] / ((float) b->len[c] + 3.0F);
+                }else{
+                        p = (float) b->len[c] / ((float) b->len[c] + 2.0F);
+                }
+                b->loop[c] = p;
+                b->move[c] = 1.0F - p;
+                scale[c] = 0.0;
+        }
+        tBX = 2.0F / (float) (fhmm->K * ( fhmm->K + 1.0F));
+        tXE = 1.0F;
+        tEC = 1.0F - q;
+        tEJ = q;
+
+        prev = b->prev;
+        cur = b->cur;
+        np = b->NBECJ;
+        nc = b->NBECJ + 5 * B;
+        for(j = 0; j < K;j++){
+                x = prev + j * B;
+                for(c = 0; c < n;c++){
+                        x[c] = 0.0F;
+                }
+        }
+        for(c = 0; c < n;c++){
+                np[N_STATE * B + c] = 1.0F;
+                np[B_STATE * B + c] = b->move[c];
+                np[E_STATE * B + c] = 0.0F;
+                np[C_STATE * B + c] = 0.0F;
+                np[J_STATE * B + c] = 0.0F;
+        }
+
+        w = n;
+        for(i = 1; i <= b->len[0];i++){
+                for(t0 = 0; t0 < w; t0 += FHMM_BATCH_TILE){
+                        t1 = MACRO_MIN(t0 + FHMM_BATCH_TILE, w);
+                        for(f = 0; f < K;f++){
+                                y = cur + f * B;
+                                pi = fhmm->pindex[f];
+                                tw = fhmm->ptin[f];
+                                for(c = t0; c < t1;c++){
+                                        y[c] = 0.0F;
+                                }
+                                for(j = 1; j < pi[0];j++){
+                                        v = tw[j];
+                                        x = prev + pi[j] * B;
+                                        for(c = t0; c < t1;c++){
+                                                y[c] += v * x[c];
+                                        }
+                                }
+                        }
+                }
+                for(c = 0; c < w;c++){
+                        b->sym[c] = b->seq[c][i-1];
+                        b->from_b[c] = np[B_STATE * B + c] * tBX;
+                        b->sum[c] = 0.0F;
+                }
+                for(j = 0; j < K;j++){
+                        y = cur + j * B;
+                        pe = fhmm->pe[j];
+                        for(c = 0; c < w;c++){
+                                y[c] = (y[c] + b->from_b[c]) * pe[b->sym[c]];
+                                b->sum[c] += y[c];
+                        }
+                }
+                for(c = 0; c < w;c++){
+                        nc[E_STATE * B + c] = b->sum[c] * tXE;
+                        nc[J_STATE * B + c] = np[J_STATE * B + c] * b->loop[c] + np[E_STATE * B + c] * tEJ;
+                        nc[C_STATE * B + c] = np[C_STATE * B + c] * b->loop[c] + np[E_STATE * B + c] * tEC;
+                        nc[N_STATE * B + c] = np[N_STATE * B + c] * b->loop[c];
+                        nc[B_STATE * B + c] = nc[N_STATE * B + c] * b->move[c] + nc[J_STATE * B + c] * b->move[c];
+
+                        v = b->sum[c] + nc[N_STATE * B + c] + nc[C_STATE * B + c] + nc[J_STATE * B + c];
+                        if(v <= 0.0F){
+                                /* nothing reachable; the column stays 0  */
+                                scale[c] = -INFINITY;
+                                v = 1.0F;
+                        }else{
+                                scale[c] += log(v);
+                        }
+                        b->sum[c] = 1.0F / v;
+                        for(j = 0; j < 5;j++){
+                                nc[j * B + c] *= b->sum[c];
+                        }
+                }
+                for(j = 0; j < K;j++){
+                        y = cur + j * B;
+                        for(c = 0; c < w;c++){
+                                y[c] *= b->sum[c];
+                        }
+                }
+                /* shortest sequences are at the end of the block  */
+                while(w > 0 && b->len[w-1] == i){
+                        w--;
+                        scores[b->idx[w]] = (float) (log(nc[C_STATE * B + w] * b->move[w] + nc[E_STATE * B + w] * b->move[w]) + scale[w]);
+                }
+                tmp = prev;
+                prev = cur;
+                cur = tmp;
+                tmp = np;
+                np = nc;
+                nc = tmp;
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* As backward_log in probability space; scale[i] holds the log of the
+ * factors taken out of rows i .. len. */
+int backward_scaled(struct fhmm* fhmm,struct fhmm_dyn_mat* m , float* ret_score, uint8_t* a, int len,int mode)
+{
+        int i,j,c,f;
+        float** matrix = NULL;
+        float** NBECJ = NULL;
+        float* next;
+        float* cur;
+        float* pt;
+        int* ti;
+        double* scale;
+        float tNN,tNB,tBX,tXE,tEC,tCC,tCT,tEJ,tJJ,tJB;
+        float p,q;
+        float x;
+        float sum;
+
+        ASSERT(fhmm != NULL, "No model");
+        ASSERT(fhmm->pe != NULL, "Scaled DP not set up (fhmm_set_dp)");
+        ASSERT(m != NULL, "No dyn programming  matrix");
+        ASSERT(a != NULL, "No sequence");
+        ASSERT(len > 0, "Seq is of length 0");
+
+        if(mode){
+                q = 0.5f;
+                p = (float) len / ((float)len + 3.0F);
+        }else{
+                q = 0.0F;
+                p = (float) len / ((float)len + 2.0F);
+        }
+
+        tNN = p;
+        tNB = 1.0F - p;
+        tBX = 2.0F / (float) (fhmm->K * ( fhmm->K + 1.0F));
+        tXE = 1.0F;
+        tEC = 1.0F - q;
+        tCC = p;
+        tCT = 1.0F - p;
+        tEJ = q;
+        tJJ = p;
+        tJB = 1.0F - p;
+
+        matrix = m->B_matrix;
+        NBECJ = m->B_NBECJ;
+        scale = m->B_scale;
+        m->scaled_B = 1;
+
+        NBECJ[len+1][C_STATE] = 1.0F;
+        NBECJ[len][J_STATE] = 0.0F;
+        NBECJ[len][B_STATE] = 0.0F;
+        NBECJ[len][N_STATE] = 0.0F;
+        NBECJ[len][C_STATE] = tCT;
+        NBECJ[len][E_STATE] = tCT;
+
+        c = a[len-1];
+        sum = NBECJ[len][C_STATE] + NBECJ[len][E_STATE];
+        for(j = 0; j < fhmm->K;j++){
+                matrix[len][j] = NBECJ[len][E_STATE] * tXE * fhmm->pe[j][c];
+                sum += matrix[len][j];
+        }
+        x = 1.0F / sum;
+        for(j = 0; j < fhmm->K;j++){
+                matrix[len][j] *= x;
+        }
+        for(j = 0; j < 5;j++){
+                NBECJ[len][j] *= x;
+        }
+        scale[len] = log(sum);
+
+        for(i = len-1; i >= 1; i-- ){
+                next = matrix[i+1];
+                cur = matrix[i];
+                sum = 0.0F;
+                for(j = 0; j < fhmm->K;j++){
+                        sum += next[j];
+                }
+                NBECJ[i][B_STATE] = sum * tBX;
+                NBECJ[i][J_STATE] = NBECJ[i+1][J_STATE] * tJJ + NBECJ[i][B_STATE] * tJB;
+                NBECJ[i][C_STATE] = NBECJ[i+1][C_STATE] * tCC;
+                NBECJ[i][E_STATE] = NBECJ[i+1][J_STATE] * tEJ + NBECJ[i+1][C_STATE] * tEC;
+                NBECJ[i][N_STATE] = NBECJ[i+1][N_STATE] * tNN + NBECJ[i][B_STATE] * tNB;
+
+                c = a[i-1];
+                sum = NBECJ[i][N_STATE] + NBECJ[i][C_STATE] + NBECJ[i][J_STATE];
+                for(j = 0; j < fhmm->K;j++){
+                        x = NBECJ[i][E_STATE] * tXE;
+                        ti = fhmm->tindex[j];
+                        pt = fhmm->pt[j];
+                        for(f = 1; f < ti[0];f++){
+                                x += pt[ti[f]] * next[ti[f]];
+                        }
+                        cur[j] = x * fhmm->pe[j][c];
+                        sum += cur[j];
+                }
+                if(sum <= 0.0F){
+                        *ret_score = -INFINITY;
+                        return OK;
+                }
+                x = 1.0F / sum;
+                for(j = 0; j < fhmm->K;j++){
+                        cur[j] *= x;
+                }
+                for(j = 0; j < 5;j++){
+                        NBECJ[i][j] *= x;
+                }
+                scale[i] = scale[i+1] + log(sum);
+        }
+        sum = 0.0F;
+        for(j = 0; j < fhmm->K;j++){
+                sum += matrix[1][j];
+        }
+        NBECJ[0][B_STATE] = sum * tBX;
+        NBECJ[0][J_STATE] = 0.0F;
+        NBECJ[0][C_STATE] = 0.0F;
+        NBECJ[0][E_STATE] = 0.0F;
+        NBECJ[0][N_STATE] = NBECJ[1][N_STATE] * tNN + NBECJ[0][B_STATE] * tNB;
+        /* row 0 is in the units of row 1  */
+        scale[0] = scale[1];
+
+        *ret_score = (float) (log(NBECJ[0][N_STATE]) + scale[0]);
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Turns scaled forward / backward matrices back into log space so that
+ * posterior decoding works on either. */
+int scaled_to_log(struct fhmm* fhmm, struct fhmm_dyn_mat* m, int len)
+{
+        double s;
+        int i,j;
+
+        if(m->scaled_F){
+                for(i = 0; i <= len;i++){
+                        s = m->F_scale[i];
+                        for(j = 0; j < fhmm->K;j++){
+                                m->F_matrix[i][j] = (float) (log(m->F_matrix[i][j]) + s);
+                        }
+                        for(j = 0; j < 5;j++){
+                                m->F_NBECJ[i][j] = (float) (log(m->F_NBECJ[i][j]) + s);
+                        }
+                }
+                m->scaled_F = 0;
+        }
+        if(m->scaled_B){
+                for(i = 0; i <= len;i++){
+                        s = m->B_scale[i];
+                        for(j = 0; j < fhmm->K;j++){
+                                m->B_matrix[i][j] = (float) (log(m->B_matrix[i][j]) + s);
+                        }
+                        for(j = 0; j < 5;j++){
+                                m->B_NBECJ[i][j] = (float) (log(m->B_NBECJ[i][j]) + s);
+                        }
+                }
+                m->scaled_B = 0;
+        }
+        return OK;
+}
+
+/* Follows the pointers left in B_matrix / B_NBECJ by posterior_decoding
+ * or viterbi from the better of C and E in the last row. path gets one
+ * entry per residue: N, C or J (< 5) or model state + 5. */
+int trace_path(struct fhmm_dyn_mat* m, int len, int* path)
+{
+        float** F_NBECJ = NULL;
+        float** B_NBECJ = NULL;
+        float** B = NULL;
+        int state;
+        int i,j,c,f;
+
+        F_NBECJ = m->F_NBECJ;
+        B_NBECJ = m->B_NBECJ;
+        B = m->B_matrix;
+
+        if(F_NBECJ[len][C_STATE] > F_NBECJ[len][E_STATE]){
+                state = C_STATE;
+        }else{
+                state = E_STATE;
+        }
+
+
+        c = 0;
+        i = len;
+        while (i > 0){
+                /* Logic:
+                   When encountering a state capable of emitting symbols
+                   decrement i otherwise (B and E states) don't - simple.
+                */
+                switch (state) {
+                case N_STATE:
+                case C_STATE:
+                case J_STATE: {
+                        //LOG_MSG("%d %d LETTER: %d %f ",i,state,a[i-1], F_NBECJ[i][state]);
+                        path[c] = state;
+                        c++;
+                        state = B_NBECJ[i][state];
+
+                        i--;
+                        break;
+                }
+                case B_STATE:
+                case E_STATE:{
+                        state = B_NBECJ[i][state];
+                        break;
+                }
+                default:        /* These are the X states  */
+                        //LOG_MSG("%d %d LETTER: %d %f",i,state,a[i-1] , F[i][state]);
+                        path[c] = state;
+                        c++;
+                        state = B[i][state-5];
+                        i--;
+                        break;
+                }
+        }
+
+        j = c - 1;   // Assigning j to Last array element
+        i = 0;       // Assigning i to first array element
+
+        while (i < j)
+        {
+                f  = path[i];
+                path[i] = path[j];
+                path[j] = f;
+                i++;
+                j--;
+        }
+        return OK;
+}
+
 /*
   This is a slightly odd way to implement posterior decoding.
   In both the forward and backward recursion I add emission
@@ -249,11 +876,10 @@ int posterior_decoding(struct fhmm* fhmm,struct fhmm_dyn_mat* m , float total_sc
 
         float* max = NULL;
 
-        float old;
-        int state;
-
         int i,j,c,f;
 
+        RUN(scaled_to_log(fhmm, m, len));
+
         F_NBECJ = m->F_NBECJ;
         B_NBECJ = m->B_NBECJ;
         F = m->F_matrix;
@@ -562,60 +1188,7 @@ int posterior_decoding(struct fhmm* fhmm,struct fhmm_dyn_mat* m , float total_sc
         //exit(0);
 
 
-        if(F_NBECJ[len][C_STATE] > F_NBECJ[len][E_STATE]){
-                state = C_STATE;
-        }else{
-                state = E_STATE;
-        }
-
-
-        old = F_NBECJ[len][state];
-
-        c = 0;
-        i = len;
-        while (i > 0){
-                /* Logic:
-                   When encountering a state capable of emitting symbols
-                   decrement i otherwise (B and E states) don't - simple.
-                */
-                switch (state) {
-                case N_STATE:
-                case C_STATE:
-                case J_STATE: {
-                        //LOG_MSG("%d %d LETTER: %d %f ",i,state,a[i-1], F_NBECJ[i][state]);
-                        path[c] = state;
-                        c++;
-                        state = B_NBECJ[i][state];
-
-                        i--;
-                        break;
-                }
-                case B_STATE:
-                case E_STATE:{
-                        state = B_NBECJ[i][state];
-                        break;
-                }
-                default:        /* These are the X states  */
-                        //LOG_MSG("%d %d LETTER: %d %f",i,state,a[i-1] , F[i][state]);
-                        path[c] = state;
-                        c++;
-                        state = B[i][state-5];
-                        i--;
-                        break;
-                }
-        }
-
-        j = c - 1;   // Assigning j to Last array element
-        i = 0;       // Assigning i to first array element
-
-        while (i < j)
-        {
-                f  = path[i];
-                path[i] = path[j];
-                path[j] = f;
-                i++;
-                j--;
-        }
+        RUN(trace_path(m, len, path));
 
         /*for(i = 0; i < len; i++){
                 fprintf(stdout,"%3d ", a[i]);
@@ -752,6 +1325,175 @@ ERROR:
 
 
 
+/* Most probable state path (log space). Scores go into F_matrix /
+ * F_NBECJ, pointers into B_matrix / B_NBECJ as in posterior_decoding. */
+int viterbi(struct fhmm* fhmm,struct fhmm_dyn_mat* m , float* ret_score, uint8_t* a, int len,int mode,int* path)
+{
+        float** F = NULL;
+        float** B = NULL;
+        float** F_NBECJ = NULL;
+        float** B_NBECJ = NULL;
+        float tNN,tNB,tBX,tXE,tEC,tCC,tCT,tEJ,tJJ,tJB;
+        float* tw;
+        int* pi;
+        float p,q;
+        float v;
+        float x;
+        int i,j,c,f;
+        int o;
+
+        ASSERT(fhmm != NULL, "No model");
+        ASSERT(fhmm->pindex != NULL, "No predecessor index (fhmm_set_pindex)");
+        ASSERT(m != NULL, "No dyn programming  matrix");
+        ASSERT(a != NULL, "No sequence");
+        ASSERT(len > 0, "Seq is of length 0");
+
+        F = m->F_matrix;
+        B = m->B_matrix;
+        F_NBECJ = m->F_NBECJ;
+        B_NBECJ = m->B_NBECJ;
+        m->scaled_F = 0;
+        m->scaled_B = 0;
+
+        if(mode){
+                q = 0.5f;
+                p = (float) len / ((float)len + 3.0F);
+        }else{
+                q = 0.0F;
+                p = (float) len / ((float)len + 2.0F);
+        }
+
+        tNN = prob2scaledprob(p);
+        tNB = prob2scaledprob(1.0F - p);
+        tBX = prob2scaledprob(2.0F / (float) (fhmm->K * ( fhmm->K + 1.0F)));
+        tXE = prob2scaledprob(1.0F);
+        tEC = prob2scaledprob(1.0F - q);
+        tCC = prob2scaledprob(p);
+        tCT = prob2scaledprob(1.0F - p);
+        tEJ = prob2scaledprob(q);
+        tJJ = prob2scaledprob(p);
+        tJB = prob2scaledprob(1.0F - p);
+
+        for(j = 0; j < fhmm->K;j++){
+                F[0][j] = -INFINITY;
+        }
+        F_NBECJ[0][N_STATE] = 0.0F;
+        F_NBECJ[0][B_STATE] = tNB;
+        F_NBECJ[0][E_STATE] = -INFINITY;
+        F_NBECJ[0][C_STATE] = -INFINITY;
+        F_NBECJ[0][J_STATE] = -INFINITY;
+
+        for(i = 1; i < len+1;i++){
+                for(f = 0; f < fhmm->K;f++){
+                        pi = fhmm->pindex[f];
+                        tw = fhmm->tin[f];
+                        x = F_NBECJ[i-1][B_STATE] + tBX;
+                        o = B_STATE;
+                        for(c = 1; c < pi[0];c++){
+                                v = F[i-1][pi[c]] + tw[c];
+                                if(v > x){
+                                        x = v;
+                                        o = pi[c]+5;
+                                }
+                        }
+                        F[i][f] = x;
+                        B[i][f] = o;
+                }
+                F_NBECJ[i][E_STATE] = -INFINITY;
+                B_NBECJ[i][E_STATE] = 5;
+                for(j = 0; j < fhmm->K;j++){
+                        F[i][j] += fhmm->e[j][a[i-1]];
+                        if(F[i][j] + tXE > F_NBECJ[i][E_STATE]){
+                                F_NBECJ[i][E_STATE] = F[i][j] + tXE;
+                                B_NBECJ[i][E_STATE] = j+5;
+                        }
+                }
+                if(F_NBECJ[i-1][J_STATE] + tJJ > F_NBECJ[i-1][E_STATE] + tEJ){
+                        F_NBECJ[i][J_STATE] = F_NBECJ[i-1][J_STATE] + tJJ;
+                        B_NBECJ[i][J_STATE] = J_STATE;
+                }else{
+                        F_NBECJ[i][J_STATE] = F_NBECJ[i-1][E_STATE] + tEJ;
+                        B_NBECJ[i][J_STATE] = E_STATE;
+                }
+                if(F_NBECJ[i-1][C_STATE] + tCC > F_NBECJ[i-1][E_STATE] + tEC){
+                        F_NBECJ[i][C_STATE] = F_NBECJ[i-1][C_STATE] + tCC;
+                        B_NBECJ[i][C_STATE] = C_STATE;
+                }else{
+                        F_NBECJ[i][C_STATE] = F_NBECJ[i-1][E_STATE] + tEC;
+                        B_NBECJ[i][C_STATE] = E_STATE;
+                }
+                F_NBECJ[i][N_STATE] = F_NBECJ[i-1][N_STATE] + tNN;
+                B_NBECJ[i][N_STATE] = N_STATE;
+                if(F_NBECJ[i][N_STATE] + tNB > F_NBECJ[i][J_STATE] + tJB){
+                        F_NBECJ[i][B_STATE] = F_NBECJ[i][N_STATE] + tNB;
+                        B_NBECJ[i][B_STATE] = N_STATE;
+                }else{
+                        F_NBECJ[i][B_STATE] = F_NBECJ[i][J_STATE] + tJB;
+                        B_NBECJ[i][B_STATE] = J_STATE;
+                }
+        }
+        *ret_score = MACRO_MAX(F_NBECJ[len][C_STATE], F_NBECJ[len][E_STATE]) + tCT;
+        if(path){
+                RUN(trace_path(m, len, path));
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Scores a sequence and computes only what run asks for:
+ * FHMM_RUN_SCORE: forward score; m needs no more than two rows.
+ * FHMM_RUN_POSTERIOR: forward score and the posterior decoding in path.
+ * FHMM_RUN_VITERBI: Viterbi score and path.
+ * m is grown as needed for the last two. */
+int score_fhmm(struct fhmm* fhmm,struct fhmm_dyn_mat* m, uint8_t* a, int len, int mode, int run, float* score, int* path)
+{
+        float b_score;
+
+        ASSERT(fhmm != NULL, "No model");
+        ASSERT(m != NULL, "No dyn programming  matrix");
+
+        switch(run){
+        case FHMM_RUN_SCORE:
+                RUN(forward_score(fhmm, m, score, a, len, mode));
+                break;
+        case FHMM_RUN_POSTERIOR:
+                ASSERT(path != NULL, "No path");
+                RUN(resize_fhmm_dyn_mat(m, len+2, fhmm->K));
+                RUN(forward(fhmm, m, score, a, len, mode));
+                RUN(backward(fhmm, m, &b_score, a, len, mode));
+                RUN(posterior_decoding(fhmm, m, *score, a, len, path));
+                break;
+        case FHMM_RUN_VITERBI:
+                ASSERT(path != NULL, "No path");
+                RUN(resize_fhmm_dyn_mat(m, len+2, fhmm->K));
+                RUN(viterbi(fhmm, m, score, a, len, mode, path));
+                break;
+        default:
+                ERROR_MSG("Unknown run type %d", run);
+                break;
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Validation: runs forward and backward over a and returns their
+ * difference, which should be ~0. */
+int check_fhmm_scores(struct fhmm* fhmm,struct fhmm_dyn_mat* m, uint8_t* a, int len, int mode, float* diff)
+{
+        float f_score;
+        float b_score;
+
+        RUN(resize_fhmm_dyn_mat(m, len+2, fhmm->K));
+        RUN(forward(fhmm, m, &f_score, a, len, mode));
+        RUN(backward(fhmm, m, &b_score, a, len, mode));
+        *diff = f_score - b_score;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
 /* Calculate the bayesian information criteria score for a finite HMM */
 /* ML is the maximum likelihood (i.e. product of p(x^k | M ))  */
 /* data is the number of residues in the training dataset */
@@ -872,6 +1614,10 @@ int setup_model(struct fhmm* fhmm)
                 }
                 fhmm->tindex[i][0] = c+1;
         }
+        RUN(fhmm_set_pindex(fhmm));
+        if(fhmm->dp == FHMM_DP_SCALED){
+                RUN(fhmm_set_dp(fhmm, FHMM_DP_SCALED));
+        }
         //exit(0);
         /* background */
         //for(i = 0; i < fhmm->L;i++){
@@ -23,8 +23,21 @@ extern int calculate_BIC( struct fhmm* fhmm, double ML, double data,double* BIC)
 //extern int random_model_score(double* b, double* ret_score, uint8_t* a, int len, int expected_len);
 
 extern int forward(struct fhmm* fhmm , struct fhmm_dyn_mat* m, float* ret_score, uint8_t* a, int len,int mode);
+extern int forward_score(struct fhmm* fhmm , struct fhmm_dyn_mat* m, float* ret_score, uint8_t* a, int len,int mode);
 extern int backward(struct fhmm* fhmm,struct fhmm_dyn_mat* m , float* ret_score, uint8_t* a, int len,int mode);
+extern int fhmm_set_dp(struct fhmm* fhmm, int dp);
+extern int fhmm_set_pindex(struct fhmm* fhmm);
+extern int forward_batch(struct fhmm* fhmm, struct fhmm_batch* b, uint8_t** seq, int* len, int n, int mode, float* scores);
 int posterior_decoding(struct fhmm* fhmm,struct fhmm_dyn_mat* m , float total_score, uint8_t* a, int len,int* path);
+extern int viterbi(struct fhmm* fhmm,struct fhmm_dyn_mat* m , float* ret_score, uint8_t* a, int len,int mode,int* path);
+
+/* what score_fhmm computes  */
+#define FHMM_RUN_SCORE 0
+#define FHMM_RUN_POSTERIOR 1
+#define FHMM_RUN_VITERBI 2
+
+extern int score_fhmm(struct fhmm* fhmm,struct fhmm_dyn_mat* m, uint8_t* a, int len, int mode, int run, float* score, int* path);
+extern int check_fhmm_scores(struct fhmm* fhmm,struct fhmm_dyn_mat* m, uint8_t* a, int len, int mode, float* diff);
 //extern int backward(struct fhmm* fhmm,float** matrix, float* ret_score, uint8_t* a, int len);
 //extern int backward(struct fhmm* fhmm,double** matrix, double* ret_score, uint8_t* a, int len);
 //extern int posterior_decoding(struct fhmm* fhmm,double** Fmatrix, double** Bmatrix,double score,uint8_t* a, int len,int* path);
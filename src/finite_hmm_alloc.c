@@ -17,6 +17,10 @@ int alloc_fhmm_dyn_mat(struct fhmm_dyn_mat** mat,int L,int K)
         dm->B_matrix = NULL;
         dm->F_NBECJ = NULL;
         dm->B_NBECJ = NULL;
+        dm->F_scale = NULL;
+        dm->B_scale = NULL;
+        dm->scaled_F = 0;
+        dm->scaled_B = 0;
 
         dm->path = NULL;
 
@@ -40,6 +44,8 @@ int alloc_fhmm_dyn_mat(struct fhmm_dyn_mat** mat,int L,int K)
                         dm->B_NBECJ[i][j] = 0.0;
                 }
         }
+        RUN(galloc(&dm->F_scale, dm->alloc_matrix_len+2));
+        RUN(galloc(&dm->B_scale, dm->alloc_matrix_len+2));
 
         *mat = dm;
         return OK;
@@ -81,7 +87,8 @@ int resize_fhmm_dyn_mat(struct fhmm_dyn_mat* dm,int L, int K)
                                 dm->B_NBECJ[i][j] = 0.0;
                         }
                 }
-
+                RUN(galloc(&dm->F_scale, dm->alloc_matrix_len+2));
+                RUN(galloc(&dm->B_scale, dm->alloc_matrix_len+2));
         }
         return OK;
 ERROR:
@@ -103,6 +110,12 @@ int free_fhmm_dyn_mat(struct fhmm_dyn_mat* dm)
                 if(dm->B_NBECJ){
                         gfree(dm->B_NBECJ);
                 }
+                if(dm->F_scale){
+                        gfree(dm->F_scale);
+                }
+                if(dm->B_scale){
+                        gfree(dm->B_scale);
+                }
                 if(dm->path){
                         gfree(dm->path);
                 }
@@ -115,6 +128,91 @@ int free_fhmm_dyn_mat(struct fhmm_dyn_mat* dm)
 }
 
 
+int alloc_fhmm_batch(struct fhmm_batch** batch, int K, int B)
+{
+        struct fhmm_batch* b = NULL;
+
+        ASSERT(K > 0, "K has to be > 0");
+        ASSERT(B > 0, "B has to be > 0");
+
+        MMALLOC(b, sizeof(struct fhmm_batch));
+        b->prev = NULL;
+        b->cur = NULL;
+        b->NBECJ = NULL;
+        b->loop = NULL;
+        b->move = NULL;
+        b->from_b = NULL;
+        b->sum = NULL;
+        b->scale = NULL;
+        b->sym = NULL;
+        b->seq = NULL;
+        b->len = NULL;
+        b->idx = NULL;
+        b->alloc_K = K;
+        b->alloc_B = B;
+
+        MMALLOC(b->prev, sizeof(float) * K * B);
+        MMALLOC(b->cur, sizeof(float) * K * B);
+        MMALLOC(b->NBECJ, sizeof(float) * 2 * 5 * B);
+        MMALLOC(b->loop, sizeof(float) * B);
+        MMALLOC(b->move, sizeof(float) * B);
+        MMALLOC(b->from_b, sizeof(float) * B);
+        MMALLOC(b->sum, sizeof(float) * B);
+        MMALLOC(b->scale, sizeof(double) * B);
+        MMALLOC(b->sym, sizeof(uint8_t) * B);
+        MMALLOC(b->seq, sizeof(uint8_t*) * B);
+        MMALLOC(b->len, sizeof(int) * B);
+        MMALLOC(b->idx, sizeof(int) * B);
+        *batch = b;
+        return OK;
+ERROR:
+        free_fhmm_batch(b);
+        return FAIL;
+}
+
+void free_fhmm_batch(struct fhmm_batch* b)
+{
+        if(b){
+                if(b->prev){
+                        MFREE(b->prev);
+                }
+                if(b->cur){
+                        MFREE(b->cur);
+                }
+                if(b->NBECJ){
+                        MFREE(b->NBECJ);
+                }
+                if(b->loop){
+                        MFREE(b->loop);
+                }
+                if(b->move){
+                        MFREE(b->move);
+                }
+                if(b->from_b){
+                        MFREE(b->from_b);
+                }
+                if(b->sum){
+                        MFREE(b->sum);
+                }
+                if(b->scale){
+                        MFREE(b->scale);
+                }
+                if(b->sym){
+                        MFREE(b->sym);
+                }
+                if(b->seq){
+                        MFREE(b->seq);
+                }
+                if(b->len){
+                        MFREE(b->len);
+                }
+                if(b->idx){
+                        MFREE(b->idx);
+                }
+                MFREE(b);
+        }
+}
+
 struct fhmm* alloc_fhmm(void)
 {
 
@@ -124,6 +222,12 @@ struct fhmm* alloc_fhmm(void)
         fhmm->e = NULL;
         fhmm->t = NULL;
         fhmm->tindex = NULL;
+        fhmm->pe = NULL;
+        fhmm->pt = NULL;
+        fhmm->pindex = NULL;
+        fhmm->tin = NULL;
+        fhmm->ptin = NULL;
+        fhmm->dp = FHMM_DP_LOG;
         fhmm->background = NULL;
         fhmm->m_comp_back = NULL;
         fhmm->K = 0;
@@ -161,6 +265,21 @@ void free_fhmm(struct fhmm* fhmm)
                 if(fhmm->m_comp_back){
                         gfree(fhmm->m_comp_back);
                 }
+                if(fhmm->pe){
+                        gfree(fhmm->pe);
+                }
+                if(fhmm->pt){
+                        gfree(fhmm->pt);
+                }
+                if(fhmm->pindex){
+                        gfree(fhmm->pindex);
+                }
+                if(fhmm->tin){
+                        gfree(fhmm->tin);
+                }
+                if(fhmm->ptin){
+                        gfree(fhmm->ptin);
+                }
                 if(fhmm->tindex){
                         gfree(fhmm->tindex);
                         //free_2d((void**)fhmm->tindex);
@@ -12,6 +12,7 @@
 struct fhmm;
 
 struct fhmm_dyn_mat;
+struct fhmm_batch;
 
 EXTERN struct fhmm* alloc_fhmm(void);
 EXTERN void free_fhmm(struct fhmm* fhmm);
@@ -21,6 +22,9 @@ EXTERN int alloc_fhmm_dyn_mat(struct fhmm_dyn_mat** mat,int L,int K);
 EXTERN int resize_fhmm_dyn_mat(struct fhmm_dyn_mat* dm,int L, int K);
 EXTERN int free_fhmm_dyn_mat(struct fhmm_dyn_mat* dm);
 
+EXTERN int alloc_fhmm_batch(struct fhmm_batch** batch, int K, int B);
+EXTERN void free_fhmm_batch(struct fhmm_batch* b);
+
 
 #undef FINITE_HMM_ALLOC_IMPORT
 #undef EXTERN
@@ -5,6 +5,7 @@
 #include "model_alloc.h"
 #include "finite_hmm_struct.h"
 #include "finite_hmm_alloc.h"
+#include "finite_hmm.h"
 
 #define FINITE_HMM_IO_IMPORT
 #include "finite_hmm_io.h"
@@ -77,7 +78,7 @@ struct fhmm*  read_fhmm_parameters(struct hdf5_data* hdf5_data, char* group)
         RUN(HDFWRAP_READ_DATA(hdf5_data, group, "background", &fhmm->background));
 
         RUN(HDFWRAP_READ_DATA(hdf5_data ,group,"ModelCompoBack",&fhmm->m_comp_back ));
-
+        RUN(fhmm_set_pindex(fhmm));
 
         return fhmm;
 ERROR:
@@ -178,7 +179,7 @@ int read_searchfhmm(char* filename,struct fhmm** ret)
         RUN(HDFWRAP_READ_DATA(hdf5_data, "/bestfhmm", "transition_index", &fhmm->tindex));
 
         RUN(HDFWRAP_READ_DATA(hdf5_data, "/bestfhmm", "background", &fhmm->background));
-
+        RUN(fhmm_set_pindex(fhmm));
 
         close_hdf5_file(&hdf5_data);
 
@@ -1,12 +1,19 @@
 #ifndef FINITE_HMM_STRUCT_H
 #define FINITE_HMM_STRUCT_H
 
+#include <stdint.h>
+
 #define N_STATE 0
 #define B_STATE 1
 #define E_STATE 2
 #define C_STATE 3
 #define J_STATE 4
 
+/* dynamic programming in log space (reference) or in scaled
+ * probability space */
+#define FHMM_DP_LOG 0
+#define FHMM_DP_SCALED 1
+
 
 struct fhmm{
         float** F_matrix;
@@ -16,6 +23,11 @@ struct fhmm{
         float** e;
         float** t;
         int** tindex;
+        float** pe;             /* exp(e) and exp(t) for FHMM_DP_SCALED */
+        float** pt;
+        int** pindex;           /* predecessors of each state; layout as tindex */
+        float** tin;            /* tin[f][c] = t[pindex[f][c]][f] */
+        float** ptin;           /* exp(tin) for FHMM_DP_SCALED */
         float* m_comp_back; /* Equivalent (hopefully to compo in HMMER - see Biased composition filter.) */
         float* background;
         float f_score;
@@ -28,6 +40,7 @@ struct fhmm{
         int alloc_K;
         int K;
         int L;
+        int dp;
 };
 
 struct fhmm_dyn_mat{
@@ -37,9 +50,39 @@ struct fhmm_dyn_mat{
         float** F_NBECJ;
         float** B_NBECJ;
 
+        /* scaled DP: the log of the scaling factors up to each row
+           (forward) or from each row (backward) */
+        double* F_scale;
+        double* B_scale;
+        int scaled_F;
+        int scaled_B;
+
         int* path;
         int alloc_matrix_len;
         int alloc_K;
 };
 
+/* Work space for forward_batch: K x B blocks of scaled forward values
+ * (row = state, column = sequence) plus the NBECJ states and the
+ * length dependent transitions of every column. Columns are processed
+ * in tiles of FHMM_BATCH_TILE. */
+#define FHMM_BATCH_TILE 16
+
+struct fhmm_batch{
+        float* prev;
+        float* cur;
+        float* NBECJ;           /* 2 x 5 x B */
+        float* loop;            /* p: N->N, C->C and J->J */
+        float* move;            /* 1 - p: N->B, C->T and J->B */
+        float* from_b;
+        float* sum;
+        double* scale;
+        uint8_t* sym;
+        uint8_t** seq;
+        int* len;
+        int* idx;
+        int alloc_K;
+        int alloc_B;
+};
+
 #endif
@@ -18,6 +18,10 @@ static int generate_simple_fhmm(struct fhmm** f);
 static int run_forward_diff_len(struct fhmm* fhmm,struct fhmm_dyn_mat*dm, uint8_t* seq, int len);
 
 static int random_seq_test(struct fhmm* fhmm, struct fhmm_dyn_mat*dm);
+static int compare_dp_modes(struct fhmm* fhmm,struct fhmm_dyn_mat*dm, uint8_t* seq, int len);
+static int compare_batch(struct fhmm* fhmm,struct fhmm_dyn_mat*dm, struct fhmm_batch* b, uint8_t** bseq, int* blen, int n, int mode);
+static int test_viterbi(struct fhmm* fhmm,struct fhmm_dyn_mat*dm, uint8_t* seq, int len);
+static int score_path(struct fhmm* fhmm, uint8_t* a, int len, int mode, int* path, float* ret_score);
 /* Purpose: test fhmm search scoring */
 int main(void)
 {
@@ -104,6 +108,11 @@ int main(void)
         LOG_MSG("Multi  hit test");
         RUN(run_forward_diff_len(fhmm,dm,  test_seq, 12));
 
+        LOG_MSG("Log vs scaled DP");
+        RUN(compare_dp_modes(fhmm, dm, test_seq, 12));
+
+        LOG_MSG("Viterbi");
+        RUN(test_viterbi(fhmm, dm, test_seq, 12));
 
         //random_seq_test(fhmm,dm);
         free_fhmm_dyn_mat(dm);
@@ -215,6 +224,195 @@ ERROR:
         return FAIL;
 }
 
+/* scores in scaled probability space have to match the log space ones */
+int compare_dp_modes(struct fhmm* fhmm,struct fhmm_dyn_mat*dm, uint8_t* seq, int len)
+{
+        struct fhmm_batch* b = NULL;
+        uint8_t* bseq[4];
+        int blen[4];
+        int tcount[4];
+        float f_log,b_log;
+        float f_scaled,b_scaled;
+        int mode;
+        int i;
+
+        ASSERT(fhmm->K <= 4, "Test model too large");
+        /* suffixes of seq give a ragged batch  */
+        RUN(alloc_fhmm_batch(&b, fhmm->K, 4));
+        for(i = 0; i < 4;i++){
+                bseq[i] = seq + i;
+                blen[i] = len - i;
+        }
+        for(mode = 0; mode < 2;mode++){
+                RUN(fhmm_set_dp(fhmm, FHMM_DP_LOG));
+                RUN(forward(fhmm, dm, &f_log, seq, len, mode));
+                RUN(backward(fhmm, dm, &b_log, seq, len, mode));
+                RUN(fhmm_set_dp(fhmm, FHMM_DP_SCALED));
+                RUN(forward(fhmm, dm, &f_scaled, seq, len, mode));
+                RUN(backward(fhmm, dm, &b_scaled, seq, len, mode));
+                LOG_MSG("mode %d: log %f %f scaled %f %f", mode, f_log, b_log, f_scaled, b_scaled);
+                ASSERT(fabsf(f_log - f_scaled) < 1e-3f, "Forward scores differ: %f %f", f_log, f_scaled);
+                ASSERT(fabsf(b_log - b_scaled) < 1e-3f, "Backward scores differ: %f %f", b_log, b_scaled);
+
+                RUN(compare_batch(fhmm, dm, b, bseq, blen, 4, mode));
+
+                /* as the bias model: t is set but tindex lists no
+                   transitions  */
+                for(i = 0; i < fhmm->K;i++){
+                        tcount[i] = fhmm->tindex[i][0];
+                        fhmm->tindex[i][0] = 1;
+                }
+                RUN(fhmm_set_pindex(fhmm));
+                RUN(compare_batch(fhmm, dm, b, bseq, blen, 4, mode));
+                for(i = 0; i < fhmm->K;i++){
+                        fhmm->tindex[i][0] = tcount[i];
+                }
+                RUN(fhmm_set_pindex(fhmm));
+        }
+        RUN(fhmm_set_dp(fhmm, FHMM_DP_LOG));
+        free_fhmm_batch(b);
+        return OK;
+ERROR:
+        free_fhmm_batch(b);
+        return FAIL;
+}
+
+/* forward_batch against the log space forward of each sequence  */
+int compare_batch(struct fhmm* fhmm,struct fhmm_dyn_mat*dm, struct fhmm_batch* b, uint8_t** bseq, int* blen, int n, int mode)
+{
+        float bscore[4];
+        float f_log;
+        int dp;
+        int i;
+
+        ASSERT(n <= 4, "Too many sequences");
+        dp = fhmm->dp;
+        RUN(forward_batch(fhmm, b, bseq, blen, n, mode, bscore));
+        RUN(fhmm_set_dp(fhmm, FHMM_DP_LOG));
+        for(i = 0; i < n;i++){
+                RUN(forward(fhmm, dm, &f_log, bseq[i], blen[i], mode));
+                ASSERT(fabsf(f_log - bscore[i]) < 1e-3f, "Batch score of seq %d differs: %f %f", i, f_log, bscore[i]);
+        }
+        RUN(fhmm_set_dp(fhmm, dp));
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* The Viterbi score has to be the score of its own path and can not be
+ * larger than the forward score; posterior decoding has to return a
+ * path of valid states. */
+int test_viterbi(struct fhmm* fhmm,struct fhmm_dyn_mat*dm, uint8_t* seq, int len)
+{
+        int path[100];
+        float f_score;
+        float v_score;
+        float p_score;
+        int mode;
+        int i;
+
+        ASSERT(len <= 100, "Sequence too long");
+        for(mode = 0; mode < 2;mode++){
+                RUN(score_fhmm(fhmm, dm, seq, len, mode, FHMM_RUN_SCORE, &f_score, NULL));
+                RUN(score_fhmm(fhmm, dm, seq, len, mode, FHMM_RUN_VITERBI, &v_score, path));
+                RUN(score_path(fhmm, seq, len, mode, path, &p_score));
+                LOG_MSG("mode %d: forward %f viterbi %f path %f", mode, f_score, v_score, p_score);
+                ASSERT(v_score <= f_score + 1e-4f, "Viterbi score %f above forward %f", v_score, f_score);
+                ASSERT(fabsf(v_score - p_score) < 1e-4f, "Viterbi score %f is not the score of its path %f", v_score, p_score);
+
+                RUN(score_fhmm(fhmm, dm, seq, len, mode, FHMM_RUN_POSTERIOR, &f_score, path));
+                for(i = 0; i < len;i++){
+                        ASSERT(path[i] == N_STATE || path[i] == C_STATE || path[i] == J_STATE || (path[i] >= 5 && path[i] < fhmm->K + 5), "Invalid state %d at %d", path[i], i);
+                }
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Log probability of a path as returned by viterbi (one entry per
+ * residue: N, C, J or state + 5); fails on transitions the model does
+ * not have. */
+int score_path(struct fhmm* fhmm, uint8_t* a, int len, int mode, int* path, float* ret_score)
+{
+        float tNN,tNB,tBX,tEC,tCC,tCT,tEJ,tJJ,tJB;
+        float p,q;
+        float s;
+        int prev;
+        int cur;
+        int i,c;
+        int found;
+
+        if(mode){
+                q = 0.5f;
+                p = (float) len / ((float)len + 3.0F);
+        }else{
+                q = 0.0F;
+                p = (float) len / ((float)len + 2.0F);
+        }
+        tNN = prob2scaledprob(p);
+        tNB = prob2scaledprob(1.0F - p);
+        tBX = prob2scaledprob(2.0F / (float) (fhmm->K * ( fhmm->K + 1.0F)));
+        tEC = prob2scaledprob(1.0F - q);
+        tCC = prob2scaledprob(p);
+        tCT = prob2scaledprob(1.0F - p);
+        tEJ = prob2scaledprob(q);
+        tJJ = prob2scaledprob(p);
+        tJB = prob2scaledprob(1.0F - p);
+
+        s = 0.0F;
+        prev = N_STATE;
+        for(i = 0; i < len;i++){
+                cur = path[i];
+                if(cur >= 5){
+                        ASSERT(cur < fhmm->K + 5, "Invalid state %d", cur);
+                        if(prev == N_STATE){
+                                /* also the first residue: N is 1 in row 0  */
+                                s += tNB + tBX;
+                        }else if(prev == J_STATE){
+                                s += tJB + tBX;
+                        }else if(prev >= 5){
+                                found = 0;
+                                for(c = 1; c < fhmm->tindex[prev-5][0];c++){
+                                        if(fhmm->tindex[prev-5][c] == cur-5){
+                                                found = 1;
+                                        }
+                                }
+                                ASSERT(found, "No transition %d -> %d", prev-5, cur-5);
+                                s += fhmm->t[prev-5][cur-5];
+                        }else{
+                                ERROR_MSG("Model state after C at %d", i);
+                        }
+                        s += fhmm->e[cur-5][a[i]];
+                }else if(cur == N_STATE){
+                        ASSERT(prev == N_STATE, "N after %d at %d", prev, i);
+                        s += tNN;
+                }else if(cur == J_STATE){
+                        if(prev == J_STATE){
+                                s += tJJ;
+                        }else{
+                                ASSERT(prev >= 5, "J after %d at %d", prev, i);
+                                s += tEJ;
+                        }
+                }else if(cur == C_STATE){
+                        if(prev == C_STATE){
+                                s += tCC;
+                        }else{
+                                ASSERT(prev >= 5, "C after %d at %d", prev, i);
+                                s += tEC;
+                        }
+                }else{
+                        ERROR_MSG("Invalid state %d at %d", cur, i);
+                }
+                prev = cur;
+        }
+        ASSERT(prev == C_STATE || prev >= 5, "Path ends in %d", prev);
+        *ret_score = s + tCT;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
 /* generate simple HMM A->C->G->T  */
 
 
@@ -8,6 +8,9 @@
 #include "randomkit_tl_add.h"
 int convert_ihmm_to_fhmm(struct ihmm_model* model,struct fhmm* fhmm, int allow_zero_counts );
 int add_composistion_background(struct fhmm* fhmm, float* occ);
+static void seed_row_rng(rk_state* rng, const uint32_t* key, int row, int kind);
+static void fill_transition_row(struct ihmm_model* model, struct fast_hmm_param* ft, const uint32_t* key, int row, int last_state);
+static void fill_emission_column(struct ihmm_model* model, struct fast_hmm_param* ft, const uint32_t* key, int state);
 
 
 int fill_fast_transitions_only_matrices(struct ihmm_model* model,struct fast_hmm_param* ft)
@@ -137,217 +140,164 @@ ERROR:
 
 
 
-int fill_fast_transitions(struct ihmm_model* model,struct fast_hmm_param* ft)
+/* Each row of the transition matrix and each column of the emission
+ * matrix is drawn with its own generator, seeded by hashing the row
+ * index with a key taken from the model generator. Rows are independent
+ * and are written straight into their slot of the flat transition list
+ * so the result does not depend on the number of threads. */
+int fill_fast_transitions(struct ihmm_model* model,struct fast_hmm_param* ft, int num_threads)
 {
-        struct fast_t_item* tmp = NULL;
-        struct fast_t_item** infinity = NULL;
-        double* tmp_prob = NULL;
-        int i,j;
-        //int list_index;
-        //int last_index;
+        uint32_t key[2];
+        int i;
         int last_state;
-        double sum;
+        int total;
 
         ASSERT(model != NULL, "No model");
         ASSERT(ft != NULL,"No fast_hmm_param structure");
+        ASSERT(num_threads > 0, "No threads");
 
-        // delete old tree...
-        if(!ft->list){
-                ft->alloc_num_trans = 65536;
-                MMALLOC(ft->list, sizeof(struct fast_t_item*) * ft->alloc_num_trans);
-                for(i = 0; i < ft->alloc_num_trans;i++){
-                        ft->list[i] = NULL;
-                        MMALLOC(ft->list[i], sizeof(struct fast_t_item));
-                }
-        }
         ft->num_trans = 0;
-        /*
-        if(ft->root){
-                //ft->root->free_tree(ft->root);
-                free_rbtree(ft->root->node,ft->root->fp_free);
-                ft->root->node = NULL;
-                ft->root->num_entries = 0;
-                ft->root->cur_data_nodes = 0;
-                if(ft->root->data_nodes){
-                        MFREE(ft->root->data_nodes);
-                }
-                }*/
-
-        MMALLOC(tmp_prob, sizeof(double) *(model->num_states));
         last_state = model->num_states -1;
 
         /* check if there is enough space to hold new transitions... */
         /* This is slightly to generous as I am allocating memory for the
          * infinity state as well */
-
         RUN(expand_ft_if_necessary(ft, model->num_states));
-        //RUN(expand_fast_hmm_param_if_necessary(ft, model->num_states *model->num_states  ));
-        /* Empty previous transitions by setting the index to zero  */
-        /* Perhaps clear RBtree...  */
-        infinity = ft->infinity;
-
-        /* Let's start with the transitions from the start state!  */
-        //last_index = list_index;
-        sum = 0.0;
-
-        /* Disallow Start to start transitions */
-
-        tmp = ft->list[ft->num_trans];
-                //MMALLOC(tmp, sizeof(struct fast_t_item));
-        tmp->from = START_STATE;
-        tmp->to = START_STATE;
-        tmp->t =  0.0;
 
-        ft->num_trans++;
-        if(ft->num_trans == ft->alloc_num_trans){
-                RUN(expand_num_trans(ft));
-        }
-        //ft->root->tree_insert(ft->root,tmp);
-        // insert into transition matrix.
-
-        ft->transition[START_STATE][START_STATE] = 0.0;
+        /* START and END rows have last_state entries; all other rows
+         * last_state - 1 (no transitions back to START)  */
+        total = 2 * last_state + (last_state - 2) * (last_state - 1);
+        RUN(fast_hmm_param_reserve(ft, total));
 
+        key[0] = model->seed;
+        key[1] = (uint32_t) rk_random(&model->rndstate);
 
-        /* Disallow Start to end transitions i.e. zero length sequences are not allowed*/
-        tmp = ft->list[ft->num_trans];
-                //MMALLOC(tmp, sizeof(struct fast_t_item));
-        tmp->from = START_STATE;
-        tmp->to = END_STATE;
-        tmp->t =  0.0;
-        ft->num_trans++;
-        if(ft->num_trans == ft->alloc_num_trans){
-                RUN(expand_num_trans(ft));
+#ifdef HAVE_OPENMP
+        omp_set_num_threads(num_threads);
+#pragma omp parallel for schedule(dynamic) private(i)
+#endif
+        for(i = 0; i < last_state;i++){
+                fill_transition_row(model, ft, key, i, last_state);
+                fill_emission_column(model, ft, key, i);
         }
-        //ft->root->tree_insert(ft->root,tmp);
+        ft->num_trans = total;
 
-        ft->transition[START_STATE][END_STATE] = 0.0;
-        /* Now to the remaining existing transitions... */
-        for(i = 2; i < last_state;i++){
-                tmp_prob[i] = rk_gamma(&model->rndstate, model->transition_counts[START_STATE][i] + model->beta[i] * model->alpha,1.0);
-                sum += tmp_prob[i];
-        }
-        /* the last to infinity transition (this is just used in stick breaking
-         * when adding states ). here there should be no counts as this
-         * possibility was not observed in the last transition. */
-        tmp_prob[last_state] = rk_gamma(&model->rndstate, model->beta[last_state] * model->alpha,1.0);
-        sum += tmp_prob[last_state];
+        /* kind of important... */
+        ft->last_state = last_state;
+        return OK;
+ERROR:
+        return FAIL;
+}
 
-        /* Normalize!  */
-        for(i = 2; i < last_state;i++){
-                tmp = ft->list[ft->num_trans];
-                //MMALLOC(tmp, sizeof(struct fast_t_item));
-                tmp->from = START_STATE;
-                tmp->to = i;
-                tmp->t =  tmp_prob[i] / sum;
-                ft->num_trans++;
-                if(ft->num_trans == ft->alloc_num_trans){
-                        RUN(expand_num_trans(ft));
-                }
-                //ft->root->tree_insert(ft->root,tmp);
-                ft->transition[START_STATE][i] = tmp->t;
-        }
-        infinity[START_STATE]->from = START_STATE;
-        infinity[START_STATE]->to = last_state;
-        infinity[START_STATE]->t = tmp_prob[last_state] / sum;;
-        ft->transition[START_STATE][last_state] = infinity[START_STATE]->t;
+void seed_row_rng(rk_state* rng, const uint32_t* key, int row, int kind)
+{
+        uint32_t ctr[4];
+        uint32_t r[4];
+
+        ctr[0] = (uint32_t) row;
+        ctr[1] = (uint32_t) kind;
+        ctr[2] = 0;
+        ctr[3] = 0;
+        crng_philox4x32(ctr, key, r);
+        rk_seed((unsigned long) r[0], rng);
+}
 
+/* Samples row from the Dirichlet posterior, stores it in
+ * ft->transition[row] and in the flat list. The list holds the START
+ * row, then the END row, then rows 2 .. last_state-1 (same order as
+ * when the list was filled by add_fast_transition). */
+void fill_transition_row(struct ihmm_model* model, struct fast_hmm_param* ft, const uint32_t* key, int row, int last_state)
+{
+        rk_state rng;
+        double* p = NULL;
+        double sum;
+        int first;
+        int c;
+        int j;
 
-        /* And now the stop state...  */
-        /* There is no possibility escape the end state - all transitions from
-         * end are zero. I am not sure if this matters in my dyn prig. code but
-         * why not! */
-        for(i = 0; i < last_state;i++){
-                tmp = ft->list[ft->num_trans];
-                //MMALLOC(tmp, sizeof(struct fast_t_item));
-                tmp->from = END_STATE;
-                tmp->to = i;
-                tmp->t = 0.0;
-                ft->num_trans++;
-                if(ft->num_trans == ft->alloc_num_trans){
-                        RUN(expand_num_trans(ft));
-                }
-                //ft->root->tree_insert(ft->root,tmp);
-                ft->transition[END_STATE][i] = 0.0;
+        p = ft->transition[row];
+        if(row == END_STATE){
+                /* There is no possibility escape the end state - all
+                 * transitions from end are zero. */
+                c = last_state;
+                for(j = 0; j < last_state;j++){
+                        p[j] = 0.0;
+                        ft->t[c] = 0.0;
+                        ft->from[c] = END_STATE;
+                        ft->to[c] = j;
+                        c++;
+                }
+                p[last_state] = 0.0;
+                ft->inf_from[END_STATE] = END_STATE;
+                ft->inf_to[END_STATE] = last_state;
+                ft->inf_t[END_STATE] = 0.0;
+                return;
+        }
+
+        seed_row_rng(&rng, key, row, 0);
+        if(row == START_STATE){
+                /* Disallow Start to start and start to end transitions
+                 * i.e. zero length sequences are not allowed */
+                first = 2;
+                p[START_STATE] = 0.0;
+                p[END_STATE] = 0.0;
+                c = 0;
+                ft->t[c] = 0.0;
+                ft->from[c] = START_STATE;
+                ft->to[c] = START_STATE;
+                c++;
+                ft->t[c] = 0.0;
+                ft->from[c] = START_STATE;
+                ft->to[c] = END_STATE;
+                c++;
+        }else{
+                first = 1;
+                c = 2 * last_state + (row - 2) * (last_state - 1);
         }
-        infinity[END_STATE]->from = END_STATE;
-        infinity[END_STATE]->to = last_state;
-        infinity[END_STATE]->t = 0.0;
-        ft->transition[END_STATE][last_state] = 0.0;
-
-
-        for(i = 2; i < last_state;i++){
-                /* Remeber where I started filling...  */
-                //last_index = list_index;
-                sum = 0.0;
+        sum = 0.0;
+        for(j = first; j < last_state;j++){
+                p[j] = rk_gamma(&rng, model->transition_counts[row][j] + model->beta[j] * model->alpha,1.0);
+                sum += p[j];
+        }
+        /* the last to infinity transition (this is just used in stick
+         * breaking when adding states ). here there should be no counts
+         * as this possibility was not observed in the last transition. */
+        p[last_state] = rk_gamma(&rng, model->beta[last_state] * model->alpha,1.0);
+        sum += p[last_state];
+        if(sum == 0.0){
+                sum = 1.0;
+        }
+        for(j = first; j < last_state;j++){
+                p[j] /= sum;
+                ft->t[c] = p[j];
+                ft->from[c] = row;
+                ft->to[c] = j;
+                c++;
+        }
+        p[last_state] /= sum;
+        ft->inf_from[row] = row;
+        ft->inf_to[row] = last_state;
+        ft->inf_t[row] = p[last_state];
+}
 
-                for(j = 1; j < last_state;j++){
-                        tmp_prob[j] = rk_gamma(&model->rndstate, model->transition_counts[i][j] + model->beta[j] * model->alpha,1.0);
-                        sum += tmp_prob[j];
-                }
-                tmp_prob[last_state] = rk_gamma(&model->rndstate, model->beta[last_state] * model->alpha,1.0);
-                sum += tmp_prob[last_state];
-                if(sum == 0.0){
-                        sum = 1.0;
-                }
+void fill_emission_column(struct ihmm_model* model, struct fast_hmm_param* ft, const uint32_t* key, int state)
+{
+        rk_state rng;
+        double sum;
+        int i;
 
-                for(j = 1; j < last_state;j++){
-                        tmp = ft->list[ft->num_trans];
-                        //MMALLOC(tmp, sizeof(struct fast_t_item));
-                        tmp->from = i;
-                        tmp->to = j;
-                        tmp->t = tmp_prob[j] / sum;
-                        ft->num_trans++;
-                        if(ft->num_trans == ft->alloc_num_trans){
-                                RUN(expand_num_trans(ft));
-                        }
-                        //ft->root->tree_insert(ft->root,tmp);
-                        ft->transition[i][j] = tmp->t;
-                }
-                infinity[i]->from = i;
-                infinity[i]->to = last_state;
-                infinity[i]->t = tmp_prob[last_state] / sum;
-                ft->transition[i][last_state] = infinity[i]->t;
+        seed_row_rng(&rng, key, state, 1);
+        sum = 0.0;
+        for(i = 0; i < model->L;i++){
+                ft->emission[i][state] = rk_gamma(&rng, model->emission_counts[i][state] + EMISSION_H, 1.0);
+                sum += ft->emission[i][state];
         }
-        /* init emission probabilities.  */
-        /*  model->emission[i][j]  = rk_gamma(&model->rndstate, model->emission[i][j]+ EMISSION_H, 1.0);
-        //model->emission[i][j]  =  model->emission[i][j]+ EMISSION_H;
-        sum +=model->emission[i][j];
+        if(sum == 0.0){
+                sum = 1.0;
         }
-        for(j = 0;j <model->L;j++){
-        model->emission[i][j] /= sum;*/
         for(i = 0; i < model->L;i++){
-                for(j = 0; j < last_state;j++){
-                        ft->emission[i][j] = rk_gamma(&model->rndstate, model->emission_counts[i][j] + EMISSION_H, 1.0);
-
-                }
+                ft->emission[i][state] /= sum;
         }
-
-
-        for(j = 0; j < last_state;j++){
-                sum = 0.0;
-                for(i = 0; i < model->L;i++){
-                        sum += ft->emission[i][j];
-                }
-                if(sum == 0.0){
-                        sum = 1.0;
-                }
-                for(i = 0; i < model->L;i++){
-                        ft->emission[i][j] /= sum;
-                        //fprintf(stdout,"%d %d: %f\n", i,j, ft->emission[i][j]);
-                }
-
-        }
-
-        /* kind of important... */
-        ft->last_state = last_state;
-
-        //ft->root->print_tree(ft->root,stdout);
-
-
-        MFREE(tmp_prob);
-        return OK;
-ERROR:
-        return FAIL;
 }
 
 
@@ -14,7 +14,7 @@
 extern int convert_ihmm_to_fhmm_models(struct model_bag* model_bag);
 
 /* Move data from model into fast transition data structure */
-extern int fill_fast_transitions(struct ihmm_model* model,struct fast_hmm_param* ft);
+extern int fill_fast_transitions(struct ihmm_model* model,struct fast_hmm_param* ft, int num_threads);
 extern int fill_fast_transitions_only_matrices(struct ihmm_model* model,struct fast_hmm_param* ft);
 
 
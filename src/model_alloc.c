@@ -11,7 +11,7 @@
 #define MODEL_ALLOC_IMPORT
 #include "model_alloc.h"
 
-
+static int copy_ihmm_model(struct ihmm_model** dst, struct ihmm_model* src);
 
 
 struct model_bag* alloc_model_bag(int L, int num_models, int max_states, int seed)
@@ -64,11 +64,13 @@ void free_model_bag(struct model_bag* b)
                                 if(b->models[i]){
                                         free_ihmm_model(b->models[i]);
                                 }
-                                if(b->finite_models[i]){
+                                if(b->finite_models && b->finite_models[i]){
                                         free_fhmm(b->finite_models[i]);
                                 }
                         }
-                        MFREE(b->finite_models);
+                        if(b->finite_models){
+                                MFREE(b->finite_models);
+                        }
                         MFREE(b->models);
                 }
 
@@ -79,6 +81,96 @@ void free_model_bag(struct model_bag* b)
         }
 }
 
+/* Deep copy of the model parameters and random number states (finite
+ * models are not copied). *dst is allocated on the first call and
+ * reused afterwards. */
+int copy_model_bag(struct model_bag** dst, struct model_bag* src)
+{
+        struct model_bag* b = NULL;
+        int i;
+
+        ASSERT(src != NULL, "No model bag");
+
+        b = *dst;
+        if(b && b->num_models != src->num_models){
+                free_model_bag(b);
+                b = NULL;
+                *dst = NULL;
+        }
+        if(!b){
+                MMALLOC(b, sizeof(struct model_bag));
+                b->models = NULL;
+                b->finite_models = NULL;
+                b->min_u = NULL;
+                b->num_models = src->num_models;
+                *dst = b;
+                MMALLOC(b->models, sizeof(struct ihmm_model*)* b->num_models);
+                MMALLOC(b->finite_models, sizeof(struct fhmm*)* b->num_models);
+                MMALLOC(b->min_u , sizeof(double) * b->num_models);
+                for(i = 0; i < b->num_models;i++){
+                        b->models[i] = NULL;
+                        b->finite_models[i] = NULL;
+                }
+        }
+        b->best_model = src->best_model;
+        b->max_num_states = src->max_num_states;
+        b->seed = src->seed;
+        b->rndstate = src->rndstate;
+        for(i = 0; i < b->num_models;i++){
+                b->min_u[i] = src->min_u[i];
+                RUN(copy_ihmm_model(&b->models[i], src->models[i]));
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+int copy_ihmm_model(struct ihmm_model** dst, struct ihmm_model* src)
+{
+        struct ihmm_model* m = NULL;
+        double** tc = NULL;
+        double** ec = NULL;
+        double* beta = NULL;
+        double* bg = NULL;
+        int i,j;
+
+        m = *dst;
+        if(m && (m->alloc_num_states != src->alloc_num_states || m->L != src->L)){
+                free_ihmm_model(m);
+                m = NULL;
+                *dst = NULL;
+        }
+        if(!m){
+                RUNP(m = alloc_ihmm_model(src->alloc_num_states, src->L, src->seed));
+                *dst = m;
+        }
+        tc = m->transition_counts;
+        ec = m->emission_counts;
+        beta = m->beta;
+        bg = m->background;
+        *m = *src;
+        m->transition_counts = tc;
+        m->emission_counts = ec;
+        m->beta = beta;
+        m->background = bg;
+
+        for(i = 0; i < m->alloc_num_states;i++){
+                for(j = 0; j < m->alloc_num_states;j++){
+                        m->transition_counts[i][j] = src->transition_counts[i][j];
+                }
+                m->beta[i] = src->beta[i];
+        }
+        for(i = 0; i < m->L;i++){
+                for(j = 0; j < m->alloc_num_states;j++){
+                        m->emission_counts[i][j] = src->emission_counts[i][j];
+                }
+                m->background[i] = src->background[i];
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
 
 struct ihmm_model* alloc_ihmm_model(int maxK, int L, unsigned int seed)
 {
@@ -13,6 +13,7 @@ struct model_bag;
 EXTERN struct model_bag* alloc_model_bag(int L, int num_models, int max_states, int seed);
 
 EXTERN void free_model_bag(struct model_bag* b);
+EXTERN int copy_model_bag(struct model_bag** dst, struct model_bag* src);
 
 
 EXTERN struct ihmm_model* alloc_ihmm_model(int maxK, int L, unsigned int seed);
@@ -5,11 +5,16 @@
 #include "tlseqbuffer.h"
 
 #include "distributions.h"
+#include "randomkit_tl_add.h"
 
 #include "finite_hmm.h"
 #include <math.h>
 #include <stdint.h>
 
+#ifdef HAVE_OPENMP
+#include <omp.h>
+#endif
+
 #include "sequence_struct.h"
 #include "model_alloc.h"
 
@@ -22,7 +27,9 @@
 #define MODEL_CORE_IMPORT
 #include "model_core.h"
 //static int fill_counts_i(struct ihmm_model* ihmm, struct ihmm_sequence* s, int model_index );
-static int fill_counts_i(struct ihmm_model* ihmm, struct tl_seq* s, int model_index);
+static int fill_counts_i(double** m, double** e, struct tl_seq* s, int model_index);
+static int reduce_count_buffers(double*** m, double*** e, int num_buffers, int K, int L);
+static void count_range(double** m, double** e, uint8_t* seq, uint16_t* label, int len, int lo, int hi, double w);
 //static int label_seq_based_on_random_fhmm(struct seq_buffer* sb, int k, double alpha);
 
 
@@ -81,10 +88,10 @@ int log_likelihood_model(struct ihmm_model* model, struct tl_seq_buffer* sb)
 
         for(i = 0; i < sb->num_seq;i++){
                 RUN(clear_counts(model));
-                RUN(fill_counts_i(model, sb->sequences[i],0));
+                RUN(fill_counts_i(model->transition_counts, model->emission_counts, sb->sequences[i],0));
 
         }
-        RUN(fill_counts(model,sb,0));
+        RUN(fill_counts(model,sb,0,1));
 
         MMALLOC(tmp, sizeof(double) * model->num_states);
         l = 0;
@@ -150,159 +157,422 @@ ERROR:
         return FAIL;
 }
 
-int remove_unused_states_labels(struct ihmm_model* ihmm, struct tl_seq_buffer* sb, int model_index)
+/* relabelled is set if any used state got a new index  */
+int remove_unused_states_labels(struct ihmm_model* ihmm, struct tl_seq_buffer* sb, int model_index, int* relabelled, int num_threads)
+{
+        int* used = NULL;
+
+        ASSERT(ihmm != NULL, "no model");
+        MMALLOC(used, sizeof(int) * ihmm->num_states);
+        RUN(count_used_states(ihmm, sb, model_index, used, num_threads));
+        RUN(relabel_used_states(ihmm, sb, model_index, used, relabelled, num_threads));
+        MFREE(used);
+        return OK;
+ERROR:
+        if(used){
+                MFREE(used);
+        }
+        return FAIL;
+}
+
+/* used[k] receives the number of residues labelled k (num_states entries) */
+int count_used_states(struct ihmm_model* ihmm, struct tl_seq_buffer* sb, int model_index, int* used, int num_threads)
 {
         struct seq_ihmm_data* d = NULL;
-        int i,j;
-        double sum;
+        int i,j,c;
         int len;
-        int* relabel = NULL;
-        int* used = NULL;
+        int K;
+        int** t_used = NULL;
         uint16_t* lab = NULL;
 
         ASSERT(ihmm != NULL, "no model");
         ASSERT(sb != NULL, "no seq struct");
+        ASSERT(num_threads > 0, "No threads");
+#ifndef HAVE_OPENMP
+        num_threads = 1;
+#endif
+        K = ihmm->num_states;
+        MMALLOC(t_used, sizeof(int*) * num_threads);
+        for(c = 0; c < num_threads;c++){
+                t_used[c] = NULL;
+        }
+        for(c = 0; c < num_threads;c++){
+                MMALLOC(t_used[c], sizeof(int) * K);
+                for(i = 0; i < K;i++){
+                        t_used[c][i] = 0;
+                }
+        }
 
-        //LOG_MSG("STATES: %d", ihmm->num_states);
-        MMALLOC(relabel, sizeof(int) * ihmm->num_states);
-        MMALLOC(used, sizeof(int) * ihmm->num_states);
-        for(i = 0; i < ihmm->num_states;i++){
+#ifdef HAVE_OPENMP
+        omp_set_num_threads(num_threads);
+#pragma omp parallel shared(t_used) private(i,j,c,d,lab,len)
+        {
+                c = omp_get_thread_num();
+#pragma omp for schedule(dynamic,64)
+#else
+        c = 0;
+#endif
+                for(i = 0; i < sb->num_seq;i++){
+                        d = sb->sequences[i]->data;
+                        lab = d->label_arr[model_index];
+                        len = sb->sequences[i]->len;
+                        for(j = 0; j < len;j++){
+                                t_used[c][lab[j]]++;
+                        }
+                }
+#ifdef HAVE_OPENMP
+        }
+#endif
+        for(i = 0; i < K;i++){
                 used[i] = 0;
-                relabel[i] = -1;
+                for(c = 0; c < num_threads;c++){
+                        used[i] += t_used[c][i];
+                }
         }
-        used[START_STATE] = 100;
-        used[END_STATE] = 100;
-        int max = -1;
-        for(i = 0; i < sb->num_seq;i++){
-                d = sb->sequences[i]->data;
-                lab = d->label_arr[model_index];
-                len = sb->sequences[i]->len;
-                for(j = 0; j < len;j++){
-                        //LOG_MSG("model:%d seq:%d pos:%d label:%d",model_index,i,j,lab[j]);
-                        used[lab[j]]++;
-                        if(lab[j] > max){
-                                max= lab[j];
+        for(c = 0; c < num_threads;c++){
+                MFREE(t_used[c]);
+        }
+        MFREE(t_used);
+        return OK;
+ERROR:
+        if(t_used){
+                for(c = 0; c < num_threads;c++){
+                        if(t_used[c]){
+                                MFREE(t_used[c]);
                         }
                 }
+                MFREE(t_used);
         }
+        return FAIL;
+}
 
+/* Drops states with used[k] == 0, moves their mass in beta to the
+ * unrepresented state and relabels the sequences. */
+int relabel_used_states(struct ihmm_model* ihmm, struct tl_seq_buffer* sb, int model_index, int* used, int* relabelled, int num_threads)
+{
+        struct seq_ihmm_data* d = NULL;
+        int i,j;
+        double sum;
+        int len;
+        int K;
+        int* relabel = NULL;
+        uint16_t* lab = NULL;
 
+        ASSERT(ihmm != NULL, "no model");
+        ASSERT(sb != NULL, "no seq struct");
+        ASSERT(num_threads > 0, "No threads");
 
-        /*fprintf(stdout,"ORG beta \n");
-        for(i = 0; i < ihmm->num_states;i++){
-                fprintf(stdout,"%3.3f ", ihmm->beta[i]);
+        K = ihmm->num_states;
+        MMALLOC(relabel, sizeof(int) * K);
+        for(i = 0; i < K;i++){
+                relabel[i] = -1;
         }
-        fprintf(stdout,"\n");*/
+        used[START_STATE] = 100;
+        used[END_STATE] = 100;
 
         j = 0;
         sum = 0.0;
-        for(i = 0; i < ihmm->num_states;i++){
+        *relabelled = 0;
+        for(i = 0; i < K;i++){
                 if(used[i] != 0){
                         ihmm->beta[j] = ihmm->beta[i];
                         relabel[i] = j;
+                        if(i != j){
+                                *relabelled = 1;
+                        }
                         j++;
                 }else{
                         relabel[i] = j;
                         sum += ihmm->beta[i];
                 }
         }
-        /*fprintf(stdout,"USED::::\n");
-        for(i = 0; i < ihmm->num_states;i++){
-                fprintf(stdout,"%3d ",used[i]);
-        }
-        fprintf(stdout,"\n");
-        for(i = 0; i < ihmm->num_states;i++){
-                fprintf(stdout,"%3d ",relabel[i]);
-        }
-        fprintf(stdout,"\n");
-        exit(0);*/
         ihmm->beta[j] = sum;
-        //for(i = j+1; i < ihmm->num_states;i++){
-        //       ihmm->beta[i] = 0;
-        //}
         ihmm->num_states = j+1; /* need to add one for the infinite stuff */
 
         RUN(resize_ihmm_model(ihmm, j+1));
-        /*fprintf(stdout,"CUR beta \n");
-        sum = 0.0f;
-        for(i = 0; i < ihmm->num_states;i++){
-                        fprintf(stdout,"%3.3f ", ihmm->beta[i]);
-                sum+= ihmm->beta[i];
-        }
-
-        fprintf(stdout,"\tsum: %f\n",sum);*/
-
 
+#ifdef HAVE_OPENMP
+        omp_set_num_threads(num_threads);
+#pragma omp parallel for schedule(dynamic,64) private(i,j,d,lab,len)
+#endif
         for(i = 0; i < sb->num_seq;i++){
-                //fprintf(stdout,"%3d",i);
                 d = sb->sequences[i]->data;
                 lab = d->label_arr[model_index];
                 len = sb->sequences[i]->len;
                 for(j= 0; j <  len;j++){
                         lab[j] = relabel[lab[j]];
-                        //      fprintf(stdout," %d",lab[j]);
                 }
-                //fprintf(stdout,"\n");
         }
-        MFREE(used);
         MFREE(relabel);
         return OK;
 ERROR:
-        MFREE(used);
-        MFREE(relabel);
+        if(relabel){
+                MFREE(relabel);
+        }
         return FAIL;
 }
 
-
-int fill_counts(struct ihmm_model* ihmm, struct tl_seq_buffer* sb, int model_index)
+/* Sequences are split into fixed blocks (static schedule) and each
+ * thread counts into its own buffer; thread 0 uses the model
+ * arrays. The buffers are then summed pairwise. With the default unit
+ * weights all counts are integers and the result is identical to a
+ * serial count. */
+int fill_counts(struct ihmm_model* ihmm, struct tl_seq_buffer* sb, int model_index, int num_threads)
 {
-
         struct seq_ihmm_data* d;
-        int i,j;
+        double*** m = NULL;
+        double*** e = NULL;
+        int i,j,c;
         uint16_t* label = NULL;
         int max_state_ID;
         int len;
+        int status;
         ASSERT(ihmm != NULL,"No model.");
         ASSERT(sb != NULL,"No iseq struct");
+        ASSERT(num_threads > 0, "No threads");
+#ifndef HAVE_OPENMP
+        num_threads = 1;
+#endif
 
         /* First I need to check what the largest state ID is and see if we have sufficient space allocated in the model.  */
         max_state_ID = -1;
-        //LOG_MSG("SEQ: %d",sb->)
-        //fprintf(stdout,"%d numseq\n",sb->num_seq );
+#ifdef HAVE_OPENMP
+        omp_set_num_threads(num_threads);
+#pragma omp parallel for schedule(dynamic,64) private(i,j,d,label,len) reduction(max:max_state_ID)
+#endif
         for(i = 0; i < sb->num_seq;i++){
                 d = sb->sequences[i]->data;
                 label = d->label_arr[model_index];
                 len = sb->sequences[i]->len;
                 for(j = 0; j < len;j++){
-                        //fprintf(stdout,"%d ",label[j]);
                         if(label[j] > max_state_ID){
                                 max_state_ID = label[j];
                         }
                 }
-                //fprintf(stdout,"\n");
         }
         max_state_ID += 1; // for the infinity possibility; not observed in the current labeling
         max_state_ID += 1; // so I can use the < syntax rather than <=
         ASSERT(max_state_ID > 2, "Not enough states found");
 
-        //
-        //LOG_MSG("MAX_STATE_ID:  %d", max_state_ID);
-        //exit(0);
-        //RUN(resize_ihmm_model(ihmm, max_state_ID));
         ihmm->num_states = max_state_ID;
         /* clear transition counts */
         /* clear emission counts */
         RUN(clear_counts(ihmm));
-        //print_counts(ihmm);
 
+        MMALLOC(m, sizeof(double**) * num_threads);
+        MMALLOC(e, sizeof(double**) * num_threads);
+        for(c = 0; c < num_threads;c++){
+                m[c] = NULL;
+                e[c] = NULL;
+        }
+        m[0] = ihmm->transition_counts;
+        e[0] = ihmm->emission_counts;
+        for(c = 1; c < num_threads;c++){
+                RUN(galloc(&m[c], ihmm->num_states, ihmm->num_states));
+                RUN(galloc(&e[c], ihmm->L, ihmm->num_states));
+                for(i = 0; i < ihmm->num_states;i++){
+                        for(j = 0; j < ihmm->num_states;j++){
+                                m[c][i][j] = 0.0;
+                        }
+                }
+                for(i = 0; i < ihmm->L;i++){
+                        for(j = 0; j < ihmm->num_states;j++){
+                                e[c][i][j] = 0.0;
+                        }
+                }
+        }
+
+        status = OK;
+#ifdef HAVE_OPENMP
+#pragma omp parallel shared(m,e,status) private(i,c)
+        {
+                c = omp_get_thread_num();
+#pragma omp for schedule(static)
+#else
+        c = 0;
+#endif
+                for(i = 0; i < sb->num_seq;i++){
+                        if(fill_counts_i(m[c], e[c], sb->sequences[i],model_index) != OK){
+                                status = FAIL;
+                        }
+                }
+#ifdef HAVE_OPENMP
+        }
+#endif
+        ASSERT(status == OK, "Counting failed");
+        RUN(reduce_count_buffers(m, e, num_threads, ihmm->num_states, ihmm->L));
+
+        for(c = 1; c < num_threads;c++){
+                gfree(m[c]);
+                gfree(e[c]);
+        }
+        MFREE(m);
+        MFREE(e);
+        return OK;
+ERROR:
+        if(m){
+                for(c = 1; c < num_threads;c++){
+                        if(m[c]){
+                                gfree(m[c]);
+                        }
+                        if(e[c]){
+                                gfree(e[c]);
+                        }
+                }
+                MFREE(m);
+                MFREE(e);
+        }
+        return FAIL;
+}
+
+/* Brings the model counts up to date with the current labels. The
+ * sampling sweep records for each sequence the range of positions
+ * [diff_lo, diff_hi] where the new labels (label_arr) differ from the
+ * old ones (tmp_label_arr after the swap); only these positions are
+ * recounted. Counts are rebuilt from scratch if the cache is not valid
+ * (e.g. first call), states were relabelled or the model outgrew the
+ * cache. */
+int refresh_counts(struct ihmm_model* ihmm, struct count_cache* cc, struct tl_seq_buffer* sb, int model_index, int relabelled, int num_threads)
+{
+        struct seq_ihmm_data* d = NULL;
+        struct tl_seq* s = NULL;
+        double w;
+        int i,j;
+        int K;
+
+        ASSERT(ihmm != NULL,"No model.");
+        ASSERT(cc != NULL,"No count cache.");
+
+        K = ihmm->num_states;
+        if(cc->valid && !relabelled && K <= cc->alloc_K){
+                for(i = 0; i < sb->num_seq;i++){
+                        s = sb->sequences[i];
+                        d = s->data;
+                        if(d->diff_lo[model_index] > d->diff_hi[model_index]){
+                                continue;
+                        }
+                        w = d->score_arr[model_index] * (double) d->multiplicity;
+                        count_range(cc->m, cc->e, s->seq, d->tmp_label_arr[model_index], s->len, d->diff_lo[model_index], d->diff_hi[model_index], -w);
+                        count_range(cc->m, cc->e, s->seq, d->label_arr[model_index], s->len, d->diff_lo[model_index], d->diff_hi[model_index], w);
+                        d->diff_lo[model_index] = s->len;
+                        d->diff_hi[model_index] = -1;
+                }
+                RUN(clear_counts(ihmm));
+                for(i = 0; i < K;i++){
+                        for(j = 0; j < K;j++){
+                                /* remove rounding noise from weighted counts */
+                                if(cc->m[i][j] < 1e-9){
+                                        cc->m[i][j] = 0.0;
+                                }
+                                ihmm->transition_counts[i][j] = cc->m[i][j];
+                        }
+                }
+                for(i = 0; i < ihmm->L;i++){
+                        for(j = 0; j < K;j++){
+                                if(cc->e[i][j] < 1e-9){
+                                        cc->e[i][j] = 0.0;
+                                }
+                                ihmm->emission_counts[i][j] = cc->e[i][j];
+                        }
+                }
+                return OK;
+        }
+
+        RUN(fill_counts(ihmm, sb, model_index, num_threads));
+        K = ihmm->num_states;
+        if(K > cc->alloc_K){
+                free_count_cache(cc);
+                cc->alloc_K = ihmm->alloc_num_states;
+                RUN(galloc(&cc->m, cc->alloc_K, cc->alloc_K));
+                RUN(galloc(&cc->e, ihmm->L, cc->alloc_K));
+        }
+        cc->L = ihmm->L;
+        for(i = 0; i < cc->alloc_K;i++){
+                for(j = 0; j < cc->alloc_K;j++){
+                        cc->m[i][j] = (i < K && j < K) ? ihmm->transition_counts[i][j] : 0.0;
+                }
+        }
+        for(i = 0; i < cc->L;i++){
+                for(j = 0; j < cc->alloc_K;j++){
+                        cc->e[i][j] = (j < K) ? ihmm->emission_counts[i][j] : 0.0;
+                }
+        }
         for(i = 0; i < sb->num_seq;i++){
-                RUN(fill_counts_i(ihmm, sb->sequences[i],model_index));
+                d = sb->sequences[i]->data;
+                d->diff_lo[model_index] = sb->sequences[i]->len;
+                d->diff_hi[model_index] = -1;
         }
+        cc->valid = 1;
         return OK;
 ERROR:
+        cc->valid = 0;
         return FAIL;
 }
 
+void free_count_cache(struct count_cache* cc)
+{
+        if(cc){
+                if(cc->m){
+                        gfree(cc->m);
+                        cc->m = NULL;
+                }
+                if(cc->e){
+                        gfree(cc->e);
+                        cc->e = NULL;
+                }
+                cc->alloc_K = 0;
+                cc->valid = 0;
+        }
+}
+
+/* Adds w times the emissions at positions lo..hi and the transitions
+ * into positions lo..hi+1 (START / END at the ends). */
+void count_range(double** m, double** e, uint8_t* seq, uint16_t* label, int len, int lo, int hi, double w)
+{
+        int i;
+
+        for(i = lo; i <= hi;i++){
+                e[(int)seq[i]][label[i]] += w;
+        }
+        for(i = lo; i <= MACRO_MIN(hi+1, len);i++){
+                if(i == 0){
+                        m[START_STATE][label[0]] += w;
+                }else if(i == len){
+                        m[label[len-1]][END_STATE] += w;
+                }else{
+                        m[label[i-1]][label[i]] += w;
+                }
+        }
+}
+
+/* Pairwise (tree) sum of count buffers into m[0] / e[0] */
+int reduce_count_buffers(double*** m, double*** e, int num_buffers, int K, int L)
+{
+        int stride;
+        int c,i,j;
+
+        for(stride = 1; stride < num_buffers; stride *= 2){
+#ifdef HAVE_OPENMP
+#pragma omp parallel for private(c,i,j)
+#endif
+                for(c = 0; c < num_buffers; c += 2 * stride){
+                        if(c + stride < num_buffers){
+                                for(i = 0; i < K;i++){
+                                        for(j = 0; j < K;j++){
+                                                m[c][i][j] += m[c+stride][i][j];
+                                        }
+                                }
+                                for(i = 0; i < L;i++){
+                                        for(j = 0; j < K;j++){
+                                                e[c][i][j] += e[c+stride][i][j];
+                                        }
+                                }
+                        }
+                }
+        }
+        return OK;
+}
+
 
 
 int add_pseudocounts_emission(struct ihmm_model* model, double alpha)
@@ -333,36 +603,24 @@ ERROR:
 
 }
 
-int fill_counts_i(struct ihmm_model* ihmm, struct tl_seq* s, int model_index)
+int fill_counts_i(double** m, double** e, struct tl_seq* s, int model_index)
 {
         struct seq_ihmm_data* d = NULL;
         uint16_t* label = NULL;
         uint8_t* seq = NULL;
-        double** e = NULL;
-        double** m = NULL;
         double score = 0.0;
-        //float* u = NULL;
-        //float r;
         int len;
         int i;
 
-
-        ASSERT(ihmm != NULL,"no model");
+        ASSERT(m != NULL,"no transition counts");
+        ASSERT(e != NULL,"no emission counts");
 
         d = s->data;
         label = d->label_arr[model_index];
         seq = s->seq;
         len = s->len;
-        score = d->score_arr[model_index];
-
-
-        // 1.0;// - scaledprob2prob(s->score);
-        //score =1.0 - scaledprob2prob ( s->score - logsum(s->score,  s->r_score));
-        //u = sb->sequences[seq_ID]->u;
-        //fprintf(stdout,"%f %f %f\n", s->score,s->r_score, scaledprob2prob ( s->score - logsum(s->score,  s->r_score)));
-
-        e = ihmm->emission_counts;
-        m = ihmm->transition_counts;
+        /* a collapsed sequence counts once per copy  */
+        score = d->score_arr[model_index] * (double) d->multiplicity;
 
         m[START_STATE][label[0]]  += score;
         e[(int)seq[0]][label[0]]+= score;
@@ -370,17 +628,8 @@ int fill_counts_i(struct ihmm_model* ihmm, struct tl_seq* s, int model_index)
         for(i = 1; i < len;i++){
                 m[label[i-1]][label[i]] += score;
                 e[(int)seq[i]][label[i]] += score;
-                //e[(int)seq[i]][label[i]] += scaledprob2prob(u[i]);
-                //r = rk_double(&ihmm->rndstate);
-                //m[label[i-1]][label[i]] += (r - 0.5f);
-                //r = rk_double(&ihmm->rndstate);
-                //e[(int)seq[i]][label[i]]+=  (r - 0.5f);//r / 1.0;
-
         }
         m[label[len-1]][END_STATE] += score;
-        // r = rk_double(&ihmm->rndstate);
-        // m[label[len-1]][IHMM_END_STATE] += (r*2 - 1.0f);// r / 1.0;
-        //LOG_MSG("SCORE: %f", score);
         return OK;
 ERROR:
         return FAIL;
@@ -388,10 +637,9 @@ ERROR:
 
 int iHmmHyperSample(struct ihmm_model* model, int iterations)
 {
-        int i,j,c;
+        int i,j;
         int last_state;
         double** transition_counts = NULL;
-        double** M = NULL;
         double** supp = NULL;
         double* sum_M = NULL;
         double* sum_N = NULL;
@@ -399,6 +647,7 @@ int iHmmHyperSample(struct ihmm_model* model, int iterations)
         double* p = NULL;
         double* s = NULL;
         double total_M = 0.0;
+        double m;
         double alpha;
         double gamma;
         double sum, sum_s, sum_w, mu, pi_mu;
@@ -409,13 +658,6 @@ int iHmmHyperSample(struct ihmm_model* model, int iterations)
         last_state = model->num_states-1;
 
         /* alloc auxillary data structures  */
-        //RUNP(M = galloc(M, model->num_states,model->num_states, 0.0));
-        RUN(galloc(&M, model->num_states,model->num_states));
-        for(i = 0; i < model->num_states;i++){
-                for(j = 0; j < model->num_states;j++){
-                        M[i][j] = 0.0;
-                }
-        }
         //RUNP(supp = galloc(supp, 5,model->num_states, 0.0));
         RUN(galloc(&supp, 5,model->num_states));
         for(i = 0; i < 5;i++){
@@ -434,25 +676,18 @@ int iHmmHyperSample(struct ihmm_model* model, int iterations)
 
         //LOG_MSG("%d %d  LAST:%d",  model->rndstate.pos, model->rndstate.key[model->rndstate.pos],last_state);
 
+        /* Number of times state i generated colour j (M[i][j]) is a
+           table count; only the column sums are needed. */
         total_M = 0.0f;
         for(i = 0; i < last_state;i++){
                 for(j = 0; j < last_state;j++){
-                        if(transition_counts[i][j] == 0){
-                                M[i][j] = 0;
-                        }else{
-                                for(c = 1;c <= transition_counts[i][j];c++){
-                                        if(rk_double( &model->rndstate) < (alpha * model->beta[j]) / (alpha * model->beta[j] + (double)c -1.0)){
-                                                M[i][j] = M[i][j] + 1; // number of times state i generated color j...
-                                                total_M = total_M + 1.0;
-                                        }
-                                }
-
+                        if(transition_counts[i][j] != 0){
+                                m = (double) rk_crt(&model->rndstate, (long) transition_counts[i][j], alpha * model->beta[j]);
+                                sum_M[j] += m;
+                                total_M += m;
+                                sum_N[i] += transition_counts[i][j];
                         }
-                        //fprintf(stdout," %d(%d)", M[i][j],transition_counts[i][j]);
-                        sum_M[j] += M[i][j];
-                        sum_N[i] += transition_counts[i][j];
                 }
-                //fprintf(stdout,"\n");
         }
         //fprintf(stdout,"\n");
         //LOG_MSG("%d %d %f %d",  model->rndstate.pos, model->rndstate.key[model->rndstate.pos] , model->rndstate.gauss, model->rndstate.has_gauss);
@@ -521,12 +756,10 @@ int iHmmHyperSample(struct ihmm_model* model, int iterations)
                 }
 
         }
-        gfree(M);
         gfree(supp);
 
         return OK;
 ERROR:
-        gfree(M);
         gfree(supp);
         return FAIL;
 }
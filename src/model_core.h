@@ -18,10 +18,24 @@ struct tl_seq_buffer;          /* forward declaration  */
 /* Fill counts from sequences  */
 EXTERN int clear_counts(struct ihmm_model* ihmm);
 
-EXTERN int fill_counts(struct ihmm_model* ihmm, struct tl_seq_buffer* sb, int model_index);
+EXTERN int fill_counts(struct ihmm_model* ihmm, struct tl_seq_buffer* sb, int model_index, int num_threads);
 EXTERN int add_pseudocounts_emission(struct ihmm_model* model, double alpha);
 //extern int remove_unused_states_labels(struct ihmm_model* ihmm, struct seq_buffer* sb);
-EXTERN int remove_unused_states_labels(struct ihmm_model* ihmm, struct tl_seq_buffer* sb, int model_index);
+EXTERN int remove_unused_states_labels(struct ihmm_model* ihmm, struct tl_seq_buffer* sb, int model_index, int* relabelled, int num_threads);
+EXTERN int count_used_states(struct ihmm_model* ihmm, struct tl_seq_buffer* sb, int model_index, int* used, int num_threads);
+EXTERN int relabel_used_states(struct ihmm_model* ihmm, struct tl_seq_buffer* sb, int model_index, int* used, int* relabelled, int num_threads);
+
+/* Counts without pseudocounts kept between sweeps; see refresh_counts  */
+struct count_cache{
+        double** m;
+        double** e;
+        int alloc_K;
+        int L;
+        int valid;
+};
+
+EXTERN int refresh_counts(struct ihmm_model* ihmm, struct count_cache* cc, struct tl_seq_buffer* sb, int model_index, int relabelled, int num_threads);
+EXTERN void free_count_cache(struct count_cache* cc);
 
 /* set hyperparameters  */
 EXTERN int set_model_hyper_parameters(struct model_bag* b, double alpha, double gamma);
@@ -4,6 +4,9 @@
 #include "tldevel.h"
 
 #include <string.h>
+#include <math.h>
+
+#include "distributions.h"
 
 #define RANDOMKIT_TL_ADD_IMPORT
 #include "randomkit_tl_add.h"
@@ -28,6 +31,125 @@ ERROR:
 
 #endif
 
+#ifdef ITESTCRT
+/* Mean and variance of rk_crt against the exact sums of a / (a + i)
+ * and a i / (a + i)^2; the three n cover the exact, binomial and
+ * normal branches. */
+int main(void)
+{
+        rk_state state;
+        long n_test[3] = {20, 1000, 100000};
+        double a_test[3] = {0.5, 1.0, 50.0};
+        int num_draws = 20000;
+        double mean;
+        double var;
+        double m;
+        double v;
+        double x;
+        long i;
+        int t;
+        int r;
+
+        rk_seed(42, &state);
+        for(t = 0; t < 3;t++){
+                mean = 0.0;
+                var = 0.0;
+                for(i = 0; i < n_test[t];i++){
+                        x = a_test[t] / (a_test[t] + (double) i);
+                        mean += x;
+                        var += x * (1.0 - x);
+                }
+                m = 0.0;
+                v = 0.0;
+                for(r = 0; r < num_draws;r++){
+                        x = (double) rk_crt(&state, n_test[t], a_test[t]);
+                        m += x;
+                        v += x * x;
+                }
+                m /= (double) num_draws;
+                v = v / (double) num_draws - m * m;
+                LOG_MSG("n: %ld a: %f mean: %f (%f) var: %f (%f)", n_test[t], a_test[t], m, mean, v, var);
+                ASSERT(fabs(m - mean) < 4.0 * sqrt(var / (double) num_draws), "Mean of rk_crt is off: %f, expected %f", m, mean);
+                ASSERT(fabs(v - var) < 0.1 * var, "Variance of rk_crt is off: %f, expected %f", v, var);
+        }
+        return EXIT_SUCCESS;
+ERROR:
+        return EXIT_FAILURE;
+}
+#endif
+
+/* Customers beyond CRT_EXACT are summarised by their mean and variance;
+ * a binomial draw with the same mean (Poisson like for small
+ * probabilities) is used while the expected number of extra tables is
+ * small and a rounded normal above that. */
+#define CRT_EXACT 32
+#define CRT_SMALL_MEAN 10.0
+
+static double digamma(double x);
+static double trigamma(double x);
+
+long rk_crt(rk_state* state, long n, double a)
+{
+        double mean;
+        double var;
+        double x;
+        long exact;
+        long tables;
+        long c;
+
+        if(n <= 0){
+                return 0;
+        }
+        exact = MACRO_MIN(n, CRT_EXACT);
+        tables = 0;
+        for(c = 1; c <= exact;c++){
+                if(rk_double(state) < a / (a + (double) c - 1.0)){
+                        tables++;
+                }
+        }
+        if(n == exact){
+                return tables;
+        }
+        /* sum of a / (a + c - 1) and of its square over c = exact+1..n */
+        mean = a * (digamma(a + (double) n) - digamma(a + (double) exact));
+        var = mean - a * a * (trigamma(a + (double) exact) - trigamma(a + (double) n));
+        if(mean < CRT_SMALL_MEAN){
+                c = rk_binomial(state, n - exact, MACRO_MIN(mean / (double) (n - exact), 1.0));
+        }else{
+                x = floor(mean + sqrt(MACRO_MAX(var, 0.0)) * rk_gauss(state) + 0.5);
+                c = (long) MACRO_MAX(x, 0.0);
+        }
+        c = MACRO_MIN(c, n - exact);
+        return tables + c;
+}
+
+/* Asymptotic expansions after shifting x above 6 */
+double digamma(double x)
+{
+        double r = 0.0;
+        double f;
+
+        while(x < 6.0){
+                r -= 1.0 / x;
+                x += 1.0;
+        }
+        f = 1.0 / (x * x);
+        return r + log(x) - 0.5 / x - f * (1.0/12.0 - f * (1.0/120.0 - f * (1.0/252.0 - f * (1.0/240.0 - f / 132.0))));
+}
+
+double trigamma(double x)
+{
+        double r = 0.0;
+        double f;
+
+        while(x < 6.0){
+                r += 1.0 / (x * x);
+                x += 1.0;
+        }
+        f = 1.0 / (x * x);
+        return r + 1.0 / x + f / 2.0 + f / x * (1.0/6.0 - f * (1.0/30.0 - f * (1.0/42.0 - f / 30.0)));
+}
+
 int copy_rk_state(rk_state* source, rk_state* target)
 {
         //int i;
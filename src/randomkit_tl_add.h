@@ -15,6 +15,11 @@
 EXTERN int copy_rk_state(rk_state* source, rk_state* target);
 EXTERN int compare_rk_state(rk_state* a, rk_state* b);
 
+/* Number of tables occupied by n customers in a Chinese restaurant
+ * process with concentration a (i.e. the sum over c = 1..n of
+ * Bernoulli(a / (a + c - 1))). */
+EXTERN long rk_crt(rk_state* state, long n, double a);
+
 #undef RANDOMKIT_TL_ADD_IMPORT
 #undef EXTERN
 
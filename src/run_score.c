@@ -11,10 +11,13 @@
 
 #include "model_struct.h"
 
+static int sort_by_len(const void* a, const void* b);
+
 int run_score_sequences(struct fhmm** fhmm, struct tl_seq_buffer* sb,struct seqer_thread_data** td, int n_model,int mode)
 {
         //struct fhmm** container = NULL;
         int i;
+        int dp;
         int num_threads;
         ASSERT(fhmm != NULL,"no model");
         ASSERT(sb != NULL, "no parameters");
@@ -26,6 +29,14 @@ int run_score_sequences(struct fhmm** fhmm, struct tl_seq_buffer* sb,struct seqe
         //LOG_MSG("new len: %d states:%d", sb->max_len,fhmm->K);
         num_threads = td[0]->num_threads;
 
+        /* forward_batch works on exp(e), exp(t) and the predecessor
+         * index; rebuild them here as the parameters may have changed
+         * since the last call. */
+        for(i = 0; i < n_model;i++){
+                dp = fhmm[i]->dp;
+                RUN(fhmm_set_dp(fhmm[i], FHMM_DP_SCALED));
+                RUN(fhmm_set_dp(fhmm[i], dp));
+        }
         //MMALLOC(container, sizeof(struct fhmm*) * 1);
         //container[0] = fhmm;
         for(i = 0; i < num_threads;i++){
@@ -56,25 +67,24 @@ ERROR:
 void* do_score_sequences(void* threadarg)
 {
         struct seqer_thread_data *data;
-        struct tl_seq* seq = NULL;
-        struct seq_ihmm_data* d = NULL;
         struct fhmm_dyn_mat* m;
+        struct fhmm_batch* b = NULL;
+        uint8_t* seq[FHMM_BATCH_TILE];
+        int len[FHMM_BATCH_TILE];
+        float fwd[FHMM_BATCH_TILE];
+        float bias[FHMM_BATCH_TILE];
+        int* order = NULL;
         double* s = NULL;
         int mode;
         int i;
         int j;
+        int c;
+        int n;
+        int num;
         int num_threads;
         int thread_id;
         int num_models;
-        double fwd;
-        double bias;
         double null;
-        /* function pointer  */
-        /* remember:
-           return_type (*function_name)(arguments)
-        */
-
-        int (*func_ptr)(struct fhmm*, struct fhmm_dyn_mat*, uint8_t* , int,int , double*);
 
         data = (struct seqer_thread_data *) threadarg;
 
@@ -83,18 +93,10 @@ void* do_score_sequences(void* threadarg)
         num_models = data->num_models;
         mode = data->info;
 
-        if(mode == FHMM_SCORE_P_LODD){
-                func_ptr = fhmm_score_p_lodd;
-        }else if(mode == FHMM_SCORE_LODD){
-                func_ptr = fhmm_score_lodd;
-        }else if(mode == FHMM_SCORE_FULL){
-                /* Run in full  more */
-        }else{
+        if(mode != FHMM_SCORE_P_LODD && mode != FHMM_SCORE_LODD && mode != FHMM_SCORE_FULL){
                 ERROR_MSG("Unknown function type!");
         }
-//model_id = data->model_ID;
         m = data->fmat;
-        //fhmm = data->fhmm;
         j = 0;
         for(i = 0; i < data->num_models;i++){
 
@@ -102,54 +104,82 @@ void* do_score_sequences(void* threadarg)
                         j = data->fhmm[i]->K;
                 }
         }
-        /* make sure we have enough memory  */
+        /* make sure we have enough memory - the null score still runs
+         * over a full matrix */
 
         if(m->alloc_matrix_len < data->sb->max_len || m->alloc_K < j){
-                //LOG_MSG("have: %d %d", m->alloc_matrix_len, m->alloc_K);
-                //LOG_MSG("want: %d %d", data->sb->max_len,  j);
                 resize_fhmm_dyn_mat(m,
                                     MACRO_MAX(m->alloc_matrix_len, data->sb->max_len),
                                     MACRO_MAX(m->alloc_K,j)
                         );
         }
+        RUN(alloc_fhmm_batch(&b, j, FHMM_BATCH_TILE));
+
+        /* this thread's sequences, longest first, so that the sequences
+         * in a block are about the same length */
+        MMALLOC(order, sizeof(int) * 2 * (data->sb->num_seq / num_threads + 1));
+        num = 0;
+        for(i = thread_id; i < data->sb->num_seq;i += num_threads){
+                order[num*2] = data->sb->sequences[i]->len;
+                order[num*2+1] = i;
+                num++;
+        }
+        qsort(order, num, sizeof(int) * 2, sort_by_len);
 
-        if(mode == FHMM_SCORE_FULL){
-                /* run forward on model, bias model and random  */
-                for(i =0; i < data->sb->num_seq;i++){
-                        if( i% num_threads == thread_id){
-                                seq = data->sb->sequences[i];
-                                s = seq->data;
-                                fhmm_score_fwd(data->fhmm[0],m,seq->seq, seq->len,1, &fwd);
-                                fhmm_score_fwd(data->fhmm[1],m,seq->seq, seq->len,1, &bias);
-                                fhmm_score_null(data->fhmm[1],m,seq->seq, seq->len,1, &null);
-                                s[0] =(fwd - null) / 0.69314718055994529;
-                                s[1] =(fwd - bias) / 0.69314718055994529;
+        for(i = 0; i < num;i += FHMM_BATCH_TILE){
+                n = MACRO_MIN(FHMM_BATCH_TILE, num - i);
+                for(c = 0; c < n;c++){
+                        seq[c] = data->sb->sequences[order[(i+c)*2+1]]->seq;
+                        len[c] = order[(i+c)*2];
+                }
+                if(mode == FHMM_SCORE_FULL){
+                        /* run forward on model, bias model and random  */
+                        RUN(forward_batch(data->fhmm[0], b, seq, len, n, 1, fwd));
+                        RUN(forward_batch(data->fhmm[1], b, seq, len, n, 1, bias));
+                        for(c = 0; c < n;c++){
+                                s = data->sb->sequences[order[(i+c)*2+1]]->data;
+                                RUN(fhmm_score_null(data->fhmm[1],m,seq[c], len[c],1, &null));
+                                s[0] =((double) fwd[c] - null) / 0.69314718055994529;
+                                s[1] =((double) fwd[c] - (double) bias[c]) / 0.69314718055994529;
                                 s[2] = esl_exp_surv(s[0], data->fhmm[0]->tau,data->fhmm[0]->lambda);
                                 s[3] = esl_exp_surv(s[1], data->fhmm[0]->tau,data->fhmm[0]->lambda);
                         }
+                        continue;
                 }
-                return NULL;
-        }
-        //LOG_MSG("Average sequence length: %d",expected_len);
-        for(i =0; i < data->sb->num_seq;i++){
-                if( i% num_threads == thread_id){
-                        seq = data->sb->sequences[i];
-                        s = seq->data;
-                        for(j = 0; j < num_models;j++){
-                                func_ptr(data->fhmm[j],m,seq->seq, seq->len,1, &s[j]);
-                                //LOG_MSG("Thread: %d;model:%d Seq: %s %f %f",thread_id,model_id, data->sb->sequences[i]->name, f_score, logP);
-                                //RUN(forward(fhmm, m, &f_score, seq->seq, seq->seq_len ));
-                                //seq->score_arr[thread_id] = logP
-                                //seq->score = f_score;
+                for(j = 0; j < num_models;j++){
+                        RUN(forward_batch(data->fhmm[j], b, seq, len, n, 1, fwd));
+                        for(c = 0; c < n;c++){
+                                s = data->sb->sequences[order[(i+c)*2+1]]->data;
+                                RUN(fhmm_score_null(data->fhmm[j],m,seq[c], len[c],1, &null));
+                                s[j] =((double) fwd[c] - null) / 0.69314718055994529;
+                                if(mode == FHMM_SCORE_P_LODD){
+                                        s[j] = esl_exp_surv(s[j], data->fhmm[j]->tau,data->fhmm[j]->lambda);
+                                }
                         }
                 }
         }
+        MFREE(order);
+        free_fhmm_batch(b);
         return NULL;
 ERROR:
         WARNING_MSG("Something really went wrong....");
+        if(order){
+                MFREE(order);
+        }
+        free_fhmm_batch(b);
         return NULL;
 }
 
+int sort_by_len(const void* a, const void* b)
+{
+        const int* x = a;
+        const int* y = b;
+        if(x[0] != y[0]){
+                return (x[0] > y[0]) ? -1 : 1;
+        }
+        return (x[1] < y[1]) ? -1 : (x[1] > y[1]);
+}
+
 
 
 
@@ -0,0 +1,244 @@
+#include "tldevel.h"
+#include "tlseqbuffer.h"
+#include "randomkit.h"
+
+#include "finite_hmm.h"
+#include "finite_hmm_alloc.h"
+#include "finite_hmm_score.h"
+
+#include "model_struct.h"
+#include "sequence_struct.h"
+#include "thread_data.h"
+#include "run_score.h"
+
+#define SCORE_PIPELINE_IMPORT
+#include "score_pipeline.h"
+
+static int alloc_score_slot(struct score_slot** slot, struct tl_seq_buffer* sb, int num_models, int num_threads, int max_K, unsigned int seed);
+static int collect_oldest(struct score_pipeline* sp, struct tl_seq_buffer* sb);
+static void* score_thread(void* arg);
+static void free_scored_models(struct score_slot* s);
+static void free_score_slot(struct score_slot* s);
+
+int alloc_score_pipeline(struct score_pipeline** sp, struct tl_seq_buffer* sb, int num_models, int num_threads, int staleness, int max_K, unsigned int seed)
+{
+        struct score_pipeline* p = NULL;
+        int i;
+
+        ASSERT(sb != NULL, "No sequences");
+        ASSERT(num_models > 0, "No models");
+        ASSERT(num_threads > 0, "No threads");
+        ASSERT(staleness > 0, "Staleness has to be >= 1");
+
+        MMALLOC(p, sizeof(struct score_pipeline));
+        p->slot = NULL;
+        p->num_slots = staleness;
+        p->head = 0;
+        p->running = 0;
+        p->num_models = num_models;
+        p->num_threads = num_threads;
+
+        MMALLOC(p->slot, sizeof(struct score_slot*) * staleness);
+        for(i = 0; i < staleness;i++){
+                p->slot[i] = NULL;
+        }
+        for(i = 0; i < staleness;i++){
+                RUN(alloc_score_slot(&p->slot[i], sb, num_models, num_threads, max_K, seed + (unsigned int) i));
+        }
+
+        *sp = p;
+        return OK;
+ERROR:
+        free_score_pipeline(p);
+        return FAIL;
+}
+
+int alloc_score_slot(struct score_slot** slot, struct tl_seq_buffer* sb, int num_models, int num_threads, int max_K, unsigned int seed)
+{
+        struct score_slot* s = NULL;
+        rk_state rndstate;
+        int i;
+
+        MMALLOC(s, sizeof(struct score_slot));
+        s->fhmm = NULL;
+        s->view = NULL;
+        s->seq_mem = NULL;
+        s->td = NULL;
+        s->scores = NULL;
+        s->num_models = num_models;
+        s->status = OK;
+
+        RUN(galloc(&s->scores, sb->num_seq, num_models));
+
+        /* shallow copies of the sequences whose data points to the
+           score rows; the residues are shared */
+        MMALLOC(s->view, sizeof(struct tl_seq_buffer));
+        *s->view = *sb;
+        s->view->sequences = NULL;
+        MMALLOC(s->view->sequences, sizeof(struct tl_seq*) * sb->num_seq);
+        MMALLOC(s->seq_mem, sizeof(struct tl_seq) * sb->num_seq);
+        for(i = 0; i < sb->num_seq;i++){
+                s->seq_mem[i] = *sb->sequences[i];
+                s->seq_mem[i].data = s->scores[i];
+                s->view->sequences[i] = &s->seq_mem[i];
+        }
+
+        /* scorer threads get their own DP matrices; the RNG is not used */
+        rk_seed(seed, &rndstate);
+        RUN(create_seqer_thread_data(&s->td, num_threads, sb->max_len+2, max_K, &rndstate));
+
+        *slot = s;
+        return OK;
+ERROR:
+        free_score_slot(s);
+        return FAIL;
+}
+
+/* Takes the finite models out of the bag and scores them in the
+ * background; a later convert_ihmm_to_fhmm_models builds new ones. */
+int score_pipeline_start(struct score_pipeline* sp, struct model_bag* mb)
+{
+        struct score_slot* s = NULL;
+        int rc;
+
+        ASSERT(sp != NULL, "No score pipeline");
+        ASSERT(sp->running < sp->num_slots, "All %d scoring slots in use", sp->num_slots);
+        ASSERT(mb->finite_models != NULL, "No finite models");
+        ASSERT(mb->num_models == sp->num_models, "Number of models changed");
+
+        s = sp->slot[(sp->head + sp->running) % sp->num_slots];
+        s->fhmm = mb->finite_models;
+        mb->finite_models = NULL;
+        s->status = OK;
+        rc = pthread_create(&s->thread, NULL, score_thread, s);
+        if(rc){
+                ERROR_MSG("Could not start scoring thread (error %d).", rc);
+        }
+        sp->running++;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Waits for the oldest snapshot and copies its scores into score_arr
+ * once all slots are in use. have_scores is 0 while fewer snapshots
+ * are in flight. */
+int score_pipeline_finish(struct score_pipeline* sp, struct tl_seq_buffer* sb, int* have_scores)
+{
+        ASSERT(sp != NULL, "No score pipeline");
+
+        *have_scores = 0;
+        if(sp->running < sp->num_slots){
+                return OK;
+        }
+        RUN(collect_oldest(sp, sb));
+        *have_scores = 1;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* As score_pipeline_finish but collects the oldest snapshot whenever
+ * one is in flight; call until have_scores is 0. */
+int score_pipeline_drain(struct score_pipeline* sp, struct tl_seq_buffer* sb, int* have_scores)
+{
+        ASSERT(sp != NULL, "No score pipeline");
+
+        *have_scores = 0;
+        if(!sp->running){
+                return OK;
+        }
+        RUN(collect_oldest(sp, sb));
+        *have_scores = 1;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+int collect_oldest(struct score_pipeline* sp, struct tl_seq_buffer* sb)
+{
+        struct seq_ihmm_data* d = NULL;
+        struct score_slot* s = NULL;
+        int i,j;
+
+        s = sp->slot[sp->head];
+        pthread_join(s->thread, NULL);
+        sp->head = (sp->head + 1) % sp->num_slots;
+        sp->running--;
+        free_scored_models(s);
+        if(s->status != OK){
+                ERROR_MSG("Background scoring failed.");
+        }
+
+        for(i = 0; i < sb->num_seq;i++){
+                d = sb->sequences[i]->data;
+                for(j = 0; j < sp->num_models;j++){
+                        d->score_arr[j] = s->scores[i][j];
+                }
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+void* score_thread(void* arg)
+{
+        struct score_slot* s = arg;
+
+        s->status = run_score_sequences(s->fhmm, s->view, s->td, s->num_models, FHMM_SCORE_LODD);
+        return NULL;
+}
+
+void free_scored_models(struct score_slot* s)
+{
+        int i;
+        if(s->fhmm){
+                for(i = 0; i < s->num_models;i++){
+                        free_fhmm(s->fhmm[i]);
+                }
+                MFREE(s->fhmm);
+                s->fhmm = NULL;
+        }
+}
+
+void free_score_slot(struct score_slot* s)
+{
+        if(s){
+                free_scored_models(s);
+                if(s->td){
+                        free_seqer_thread_data(s->td);
+                }
+                if(s->view){
+                        if(s->view->sequences){
+                                MFREE(s->view->sequences);
+                        }
+                        MFREE(s->view);
+                }
+                if(s->seq_mem){
+                        MFREE(s->seq_mem);
+                }
+                if(s->scores){
+                        gfree(s->scores);
+                }
+                MFREE(s);
+        }
+}
+
+void free_score_pipeline(struct score_pipeline* sp)
+{
+        int i;
+        if(sp){
+                while(sp->running){
+                        pthread_join(sp->slot[sp->head]->thread, NULL);
+                        sp->head = (sp->head + 1) % sp->num_slots;
+                        sp->running--;
+                }
+                if(sp->slot){
+                        for(i = 0; i < sp->num_slots;i++){
+                                free_score_slot(sp->slot[i]);
+                        }
+                        MFREE(sp->slot);
+                }
+                MFREE(sp);
+        }
+}
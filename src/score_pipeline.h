@@ -0,0 +1,58 @@
+#ifndef SCORE_PIPELINE_H
+#define SCORE_PIPELINE_H
+
+#include <pthread.h>
+
+#ifdef SCORE_PIPELINE_IMPORT
+#define EXTERN
+#else
+#define EXTERN extern
+#endif
+
+/* Scores sequences with a snapshot of the finite models on a few
+ * threads of their own while beam sampling continues on the rest.
+ * score_pipeline_start takes over the finite models of the bag;
+ * score_pipeline_finish waits for the oldest snapshot once staleness
+ * of them are in flight and copies its scores into the score_arr of
+ * each sequence, where analysis and the weight update pick them up.
+ * Weights therefore lag the sampler by staleness outer iterations.
+ * score_pipeline_drain collects the remaining snapshots, oldest first.
+ * Every slot has its own DP matrices and score rows. Scoring only reads
+ * the residues, never the labels or weights. */
+
+struct tl_seq;
+struct tl_seq_buffer;
+struct fhmm;
+struct model_bag;
+struct seqer_thread_data;
+
+struct score_slot{
+        pthread_t thread;
+        struct fhmm** fhmm;             /* models being scored */
+        struct tl_seq_buffer* view;     /* sequences with data -> scores */
+        struct tl_seq* seq_mem;
+        struct seqer_thread_data** td;
+        double** scores;
+        int num_models;
+        int status;
+};
+
+struct score_pipeline{
+        struct score_slot** slot;
+        int num_slots;                  /* staleness */
+        int head;                       /* oldest snapshot in flight */
+        int running;                    /* snapshots in flight */
+        int num_models;
+        int num_threads;
+};
+
+EXTERN int alloc_score_pipeline(struct score_pipeline** sp, struct tl_seq_buffer* sb, int num_models, int num_threads, int staleness, int max_K, unsigned int seed);
+EXTERN int score_pipeline_start(struct score_pipeline* sp, struct model_bag* mb);
+EXTERN int score_pipeline_finish(struct score_pipeline* sp, struct tl_seq_buffer* sb, int* have_scores);
+EXTERN int score_pipeline_drain(struct score_pipeline* sp, struct tl_seq_buffer* sb, int* have_scores);
+EXTERN void free_score_pipeline(struct score_pipeline* sp);
+
+#undef SCORE_PIPELINE_IMPORT
+#undef EXTERN
+
+#endif
@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 #include <getopt.h>
 #include <libgen.h>
 #include <omp.h>
@@ -34,6 +35,9 @@
 
 #include "finite_hmm_score.h"
 
+/* hits scored together by forward_batch  */
+#define SEARCH_BATCH 32
+
 struct parameters{
         char* in_model;
         char* in_sequences;
@@ -42,6 +46,7 @@ struct parameters{
         char* summary_file;
         double threshold;
         int num_threads;
+        int check;
         rk_state rndstate;
         struct rng_state* rng;
 };
@@ -55,6 +60,117 @@ static int free_parameters(struct parameters* param);
 static int run_search(struct parameters* param);
 static int run_score_pipe(struct fhmm** fhmm, struct tl_seq_buffer* sb, struct parameters* param);
 
+#ifdef ITESTSEARCH
+#include "null_model_emission.h"
+#include "sequences_sim.h"
+
+static int generate_test_fhmm(struct fhmm** f, int K);
+
+/* Runs the score pipe on simulated sequences of different lengths and
+ * compares against scoring each sequence on a full matrix. */
+int main(void)
+{
+        struct parameters param;
+        struct fhmm** fhmm = NULL;
+        struct fhmm_dyn_mat* m = NULL;
+        struct tl_seq_buffer* sb = NULL;
+        struct rng_state* rng = NULL;
+        float fwd;
+        double null;
+        double* s = NULL;
+        double x;
+        int i;
+
+        init_logsum();
+        RUNP(rng = init_rng(42));
+        MMALLOC(fhmm, sizeof(struct fhmm*) * 2);
+        fhmm[0] = NULL;
+        fhmm[1] = NULL;
+        RUN(generate_test_fhmm(&fhmm[0], 6));
+        RUN(generate_test_fhmm(&fhmm[1], 2));
+        RUN(fhmm_set_dp(fhmm[0], FHMM_DP_SCALED));
+        RUN(fhmm_set_dp(fhmm[1], FHMM_DP_SCALED));
+        fhmm[0]->lambda = 0.69314718055994529;
+
+        RUN(sim_sequences(100, 4, 200, &sb, rng));
+        for(i = 0; i < sb->num_seq;i++){
+                sb->sequences[i]->len = 2 + (i * 37) % 199;
+                MMALLOC(s, sizeof(double)* 6);
+                sb->sequences[i]->data = s;
+        }
+        param.num_threads = 2;
+        param.check = 0;
+        RUN(run_score_pipe(fhmm, sb, &param));
+
+        RUN(alloc_fhmm_dyn_mat(&m, 200, MACRO_MAX(fhmm[0]->K, fhmm[1]->K)));
+        for(i = 0; i < sb->num_seq;i++){
+                s = sb->sequences[i]->data;
+                RUN(score_fhmm(fhmm[0], m, sb->sequences[i]->seq, sb->sequences[i]->len, 1, FHMM_RUN_SCORE, &fwd, NULL));
+                RUN(fhmm_score_null(fhmm[1], m, sb->sequences[i]->seq, sb->sequences[i]->len, 1, &null));
+                x = ((double) fwd - null) / 0.69314718055994529;
+                if(fabs(x - s[0]) > 1e-3){
+                        ERROR_MSG("Seq %d (len %d): pipe %f, full matrix %f", i, sb->sequences[i]->len, s[0], x);
+                }
+        }
+        LOG_MSG("Pipe and full matrix scores agree on %d sequences.", sb->num_seq);
+
+        for(i = 0; i < sb->num_seq;i++){
+                MFREE(sb->sequences[i]->data);
+                sb->sequences[i]->data = NULL;
+        }
+        free_tl_seq_buffer(sb);
+        free_fhmm_dyn_mat(m);
+        free_fhmm(fhmm[0]);
+        free_fhmm(fhmm[1]);
+        MFREE(fhmm);
+        free_rng(rng);
+        return EXIT_SUCCESS;
+ERROR:
+        return EXIT_FAILURE;
+}
+
+/* K states in a chain; state i prefers letter i % 4  */
+int generate_test_fhmm(struct fhmm** f, int K)
+{
+        struct fhmm* fhmm = NULL;
+        double* back = NULL;
+        int i,j;
+
+        RUNP(fhmm = alloc_fhmm());
+        fhmm->K = K;
+        fhmm->L = 4;
+        fhmm->alloc_K = K;
+
+        RUN(get_null_model_emissions(&back, fhmm->L));
+        RUN(galloc(&fhmm->background,fhmm->L));
+        for(i = 0;i < fhmm->L;i++){
+                fhmm->background[i] = (float) back[i];
+        }
+        gfree(back);
+
+        RUN(galloc(&fhmm->e, fhmm->K, fhmm->L));
+        RUN(galloc(&fhmm->t, fhmm->K, fhmm->K));
+        for(i = 0; i < fhmm->K;i++){
+                for(j = 0;j < fhmm->L;j++){
+                        fhmm->e[i][j] = (1.0 - 0.9) / 3.0;
+                        if(i % 4 == j){
+                                fhmm->e[i][j] = 0.9;
+                        }
+                }
+                for(j = 0;j < fhmm->K;j++){
+                        fhmm->t[i][j] = 0.0;
+                }
+        }
+        for(i = 1;i < fhmm->K;i++){
+                fhmm->t[i-1][i] = 1.0;
+        }
+        RUN(setup_model(fhmm));
+        *f = fhmm;
+        return OK;
+ERROR:
+        return FAIL;
+}
+#else
 int main (int argc, char *argv[])
 {
 
@@ -76,6 +192,7 @@ int main (int argc, char *argv[])
         param->summary_file = NULL;
         param->threshold = 3.0;   /* z_score cutoff for pst model scores  */
         param->rng = NULL;
+        param->check = 0;
 
         while (1){
                 static struct option long_options[] ={
@@ -85,6 +202,7 @@ int main (int argc, char *argv[])
                         {"nthreads",required_argument,0,'t'},
                         {"background",required_argument,0,'b'},
                         {"summary",required_argument,0,'s'},
+                        {"check",0,0,'c'},
                         {"help",0,0,'h'},
                         {0, 0, 0, 0}
                 };
@@ -113,6 +231,9 @@ int main (int argc, char *argv[])
                 case 's':
                         param->summary_file = optarg;
                         break;
+                case 'c':
+                        param->check = 1;
+                        break;
                 case 'h':
                         RUN(print_help(argv));
                         MFREE(param);
@@ -179,6 +300,7 @@ ERROR:
         free_parameters(param);
         return EXIT_FAILURE;
 }
+#endif
 
 int run_search(struct parameters* param)
 {
@@ -214,6 +336,9 @@ int run_search(struct parameters* param)
 
         RUN(read_searchfhmm(param->in_model, &fhmm[0]));
         RUN(read_biasfhmm(param->in_model, &fhmm[1]));
+        /* hits are scored in blocks by forward_batch  */
+        RUN(fhmm_set_dp(fhmm[0], FHMM_DP_SCALED));
+        RUN(fhmm_set_dp(fhmm[1], FHMM_DP_SCALED));
 
         LOG_MSG("Run scoring");
 
@@ -272,63 +397,125 @@ ERROR:
 
 int run_score_pipe(struct fhmm** fhmm, struct tl_seq_buffer* sb, struct parameters* param)
 {
-        struct fhmm_dyn_mat** mats = NULL;
+        struct fhmm_dyn_mat** mats = NULL; /* null score: grown to the longest hit */
+        struct fhmm_dyn_mat** full = NULL; /* --check: grown to the longest hit */
+        struct fhmm_batch** batch = NULL;  /* hits are scored in blocks */
+        float* max_diff = NULL;
+        float diff;
+        int num_blocks;
+        int K;
         int i;
 
         ASSERT(fhmm != NULL,"no model");
         ASSERT(sb != NULL, "no parameters");
         /* just to be 100% safe... */
         init_logsum();
-        //MMALLOC(container, sizeof(struct fhmm*) * 1);
-        //container[0] = fhmm;
+        K = MACRO_MAX(fhmm[0]->K,fhmm[1]->K);
         MMALLOC(mats, sizeof(struct  fhmm_dyn_mat*)* param->num_threads);
+        MMALLOC(full, sizeof(struct  fhmm_dyn_mat*)* param->num_threads);
+        MMALLOC(batch, sizeof(struct fhmm_batch*)* param->num_threads);
+        MMALLOC(max_diff, sizeof(float)* param->num_threads);
         for(i = 0; i < param->num_threads;i++){
                 mats[i] = NULL;
-                RUN(alloc_fhmm_dyn_mat(&mats[i], sb->max_len+2, MACRO_MAX(fhmm[0]->K,fhmm[1]->K)));
+                full[i] = NULL;
+                batch[i] = NULL;
+                max_diff[i] = 0.0F;
+        }
+        for(i = 0; i < param->num_threads;i++){
+                RUN(alloc_fhmm_dyn_mat(&mats[i], 1, K));
+                if(param->check){
+                        RUN(alloc_fhmm_dyn_mat(&full[i], 1, K));
+                }
+                RUN(alloc_fhmm_batch(&batch[i], K, SEARCH_BATCH));
         }
+        num_blocks = (sb->num_seq + SEARCH_BATCH - 1) / SEARCH_BATCH;
 
 #ifdef HAVE_OPENMP
         omp_set_num_threads(param->num_threads);
-#pragma omp parallel shared(mats,fhmm,sb,param) private(i)
+#pragma omp parallel shared(mats,full,batch,max_diff,fhmm,sb,param,num_blocks) private(i,diff)
         {
 #pragma omp for schedule(dynamic) nowait
 #endif
-                for(i =0; i < sb->num_seq;i++){
+                for(i =0; i < num_blocks;i++){
 #ifdef HAVE_OPENMP
                         int ID = omp_get_thread_num();
 #else
                         int ID = 0;
 #endif
-
-                        //LOG_MSG("Thread %d working on %s", ID, sb->sequences[i]->name);
-                        double* s = sb->sequences[i]->data;
-                        uint8_t * seq = sb->sequences[i]->seq;
-                        int len = sb->sequences[i]->len;
-
-                        double fwd,bwd,bias,null;
-
-                        fhmm_score_fwd(fhmm[0],mats[ID],seq, len,1, &fwd);
-                        fhmm_score_fwd(fhmm[1],mats[ID],seq, len,1, &bias);
-                        fhmm_score_null(fhmm[1],mats[ID],seq, len,1, &null);
-                        fhmm_score_bwd(fhmm[0],mats[ID],seq, len,1, &bwd);
-                        s[0] =(fwd - null) / 0.69314718055994529;
-                        s[1] =(fwd - bias) / 0.69314718055994529;
-                        s[2] = esl_exp_surv(s[0], fhmm[0]->tau,fhmm[0]->lambda);
-                        s[3] = esl_exp_surv(s[1], fhmm[0]->tau,fhmm[0]->lambda);
-                        LOG_MSG("%f %f diff: %f ",fwd,bwd,fwd-bwd);
-
-
+                        uint8_t* seq[SEARCH_BATCH];
+                        int len[SEARCH_BATCH];
+                        float fwd[SEARCH_BATCH];
+                        float bias[SEARCH_BATCH];
+                        double null;
+                        double* s;
+                        int start = i * SEARCH_BATCH;
+                        int n = MACRO_MIN(SEARCH_BATCH, sb->num_seq - start);
+                        int j;
+
+                        for(j = 0; j < n;j++){
+                                seq[j] = sb->sequences[start + j]->seq;
+                                len[j] = sb->sequences[start + j]->len;
+                        }
+                        forward_batch(fhmm[0], batch[ID], seq, len, n, 1, fwd);
+                        forward_batch(fhmm[1], batch[ID], seq, len, n, 1, bias);
+                        for(j = 0; j < n;j++){
+                                s = sb->sequences[start + j]->data;
+                                /* fhmm_score_null fills a full matrix  */
+                                resize_fhmm_dyn_mat(mats[ID], len[j], fhmm[1]->K);
+                                fhmm_score_null(fhmm[1],mats[ID],seq[j], len[j],1, &null);
+                                s[0] =((double) fwd[j] - null) / 0.69314718055994529;
+                                s[1] =((double) fwd[j] - (double) bias[j]) / 0.69314718055994529;
+                                s[2] = esl_exp_surv(s[0], fhmm[0]->tau,fhmm[0]->lambda);
+                                s[3] = esl_exp_surv(s[1], fhmm[0]->tau,fhmm[0]->lambda);
+                                if(param->check){
+                                        check_fhmm_scores(fhmm[0], full[ID], seq[j], len[j], 1, &diff);
+                                        max_diff[ID] = MACRO_MAX(max_diff[ID], fabsf(diff));
+                                }
+                        }
                 }
 #ifdef HAVE_OPENMP
         }
 #endif
+        if(param->check){
+                diff = 0.0F;
+                for(i = 0; i < param->num_threads;i++){
+                        diff = MACRO_MAX(diff, max_diff[i]);
+                }
+                LOG_MSG("Largest forward / backward difference: %f", diff);
+        }
 
         for(i = 0; i < param->num_threads;i++){
                 free_fhmm_dyn_mat(mats[i]);
+                free_fhmm_dyn_mat(full[i]);
+                free_fhmm_batch(batch[i]);
         }
         MFREE(mats);
+        MFREE(full);
+        MFREE(batch);
+        MFREE(max_diff);
         return OK;
 ERROR:
+        if(mats){
+                for(i = 0; i < param->num_threads;i++){
+                        free_fhmm_dyn_mat(mats[i]);
+                }
+                MFREE(mats);
+        }
+        if(full){
+                for(i = 0; i < param->num_threads;i++){
+                        free_fhmm_dyn_mat(full[i]);
+                }
+                MFREE(full);
+        }
+        if(batch){
+                for(i = 0; i < param->num_threads;i++){
+                        free_fhmm_batch(batch[i]);
+                }
+                MFREE(batch);
+        }
+        if(max_diff){
+                MFREE(max_diff);
+        }
         return FAIL;
 }
 
@@ -353,6 +540,7 @@ int print_help(char **argv)
 
         fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--nthreads","Number of threads." ,"[8]"  );
         fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--background","Background sequences - residue counts from these will be ADDED to the background model. " ,"[8]"  );
+        fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--check","Also run backward and report the largest forward / backward difference." ,"[off]"  );
         return OK;
 }
 
@@ -10,27 +10,35 @@
 
 
 static int alloc_multi_model_label_and_u(struct ihmm_sequence* sequence,int max_len, int num_models);
+static int alloc_u(struct seq_ihmm_data* d, int num_models, int len, int u_mode);
 
-int alloc_ihmm_seq_data(struct tl_seq* s, int num_models, int max_len)
+/* Arrays are sized to the length of each sequence (not the longest
+ * one in the buffer). */
+int alloc_ihmm_seq_data(struct tl_seq* s, int num_models, int u_mode)
 {
         struct seq_ihmm_data* d = NULL;
-
+        int len;
         int i,j;
+
+        len = s->len;
         MMALLOC(d, sizeof(struct seq_ihmm_data));
         d->u_arr = NULL;
+        d->u_arr_f = NULL;
         d->has_path = NULL;
         d->label_arr = NULL;
         d->tmp_label_arr = NULL;
         d->score_arr = NULL;
-        RUN(galloc(&d->u_arr, num_models, max_len+1));
+        d->diff_lo = NULL;
+        d->diff_hi = NULL;
+        d->multiplicity = 1;
+        RUN(alloc_u(d, num_models, len, u_mode));
 
-        RUN(galloc(&d->label_arr, num_models, max_len+1));
+        RUN(galloc(&d->label_arr, num_models, len+1));
 
-        RUN(galloc(&d->tmp_label_arr, num_models, max_len+1));
+        RUN(galloc(&d->tmp_label_arr, num_models, len+1));
 
         for(i =0; i < num_models;i++){
-                for(j = 0; j < max_len+1;j++){
-                        d->u_arr[i][j] = 0.0;
+                for(j = 0; j < len+1;j++){
                         d->label_arr[i][j] = 0;
                         d->tmp_label_arr[i][j] = 0;
                 }
@@ -43,6 +51,12 @@ int alloc_ihmm_seq_data(struct tl_seq* s, int num_models, int max_len)
         }
 
         RUN(galloc(&d->has_path,num_models));
+        RUN(galloc(&d->diff_lo,num_models));
+        RUN(galloc(&d->diff_hi,num_models));
+        for(i = 0; i < num_models;i++){
+                d->diff_lo[i] = len;
+                d->diff_hi[i] = -1;
+        }
         s->data = d;
         return OK;
 ERROR:
@@ -50,6 +64,62 @@ ERROR:
         return FAIL;
 }
 
+/* Switches the slice variable storage of all sequences, e.g. after
+ * reading a saved run from disk. */
+int set_ihmm_seq_u_mode(struct tl_seq_buffer* sb, int num_models, int u_mode)
+{
+        struct seq_ihmm_data* d = NULL;
+        int i;
+
+        for(i = 0; i < sb->num_seq;i++){
+                d = sb->sequences[i]->data;
+                if(d->u_arr){
+                        gfree(d->u_arr);
+                        d->u_arr = NULL;
+                }
+                if(d->u_arr_f){
+                        gfree(d->u_arr_f);
+                        d->u_arr_f = NULL;
+                }
+                RUN(alloc_u(d, num_models, sb->sequences[i]->len, u_mode));
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+int alloc_u(struct seq_ihmm_data* d, int num_models, int len, int u_mode)
+{
+        int i,j;
+
+        switch (u_mode) {
+        case IHMM_U_DOUBLE:
+                RUN(galloc(&d->u_arr, num_models, len+1));
+                for(i = 0; i < num_models;i++){
+                        for(j = 0; j < len+1;j++){
+                                d->u_arr[i][j] = 0.0;
+                        }
+                }
+                break;
+        case IHMM_U_FLOAT:
+                RUN(galloc(&d->u_arr_f, num_models, len+1));
+                for(i = 0; i < num_models;i++){
+                        for(j = 0; j < len+1;j++){
+                                d->u_arr_f[i][j] = 0.0f;
+                        }
+                }
+                break;
+        case IHMM_U_REGENERATE:
+                break;
+        default:
+                ERROR_MSG("Unknown u mode: %d", u_mode);
+                break;
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
 int free_ihmm_seq_data(struct seq_ihmm_data** data)
 {
         struct seq_ihmm_data* d = NULL;
@@ -58,6 +128,9 @@ int free_ihmm_seq_data(struct seq_ihmm_data** data)
                 if(d->u_arr){
                         gfree(d->u_arr);
                 }
+                if(d->u_arr_f){
+                        gfree(d->u_arr_f);
+                }
                 if(d->label_arr ){
                         gfree(d->label_arr);
                 }
@@ -68,6 +141,12 @@ int free_ihmm_seq_data(struct seq_ihmm_data** data)
                 if(d->score_arr){
                         gfree(d->score_arr);
                 }
+                if(d->diff_lo){
+                        gfree(d->diff_lo);
+                }
+                if(d->diff_hi){
+                        gfree(d->diff_hi);
+                }
                 MFREE(d);
         }
         *data = NULL;
@@ -14,7 +14,9 @@
 struct seq_ihmm_data;
 
 struct tl_seq;
-EXTERN int alloc_ihmm_seq_data(struct tl_seq* s, int num_models, int max_len);
+struct tl_seq_buffer;
+EXTERN int alloc_ihmm_seq_data(struct tl_seq* s, int num_models, int u_mode);
+EXTERN int set_ihmm_seq_u_mode(struct tl_seq_buffer* sb, int num_models, int u_mode);
 EXTERN int free_ihmm_seq_data(struct seq_ihmm_data** data);
 
 #undef SEQUENCE_ALLOC_IMPORT
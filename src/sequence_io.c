@@ -6,6 +6,8 @@
 #include "tlhdf5wrap.h"
 #include "tlmisc.h"
 
+#include <hdf5.h>
+
 #include "sequence_struct.h"
 #include "sequence_alloc.h"
 
@@ -16,6 +18,7 @@
 
 static int detect_aligned(struct tl_seq_buffer* sb,int* aligned);
 static int unalign(struct tl_seq_buffer* sb);
+static int has_dataset(char* filename, char* path, int* found);
 
 int read_sequences_file(struct tl_seq_buffer** seq_buf,char* filename )
 {
@@ -220,148 +223,167 @@ ERROR:
 
 int add_sequences_to_hdf5_model(char* filename,struct tl_seq_buffer* sb, int num_models)
 {
-        struct hdf5_data* hdf5_data = NULL;
+        struct seq_hdf5_pack* p = NULL;
+
+        RUN(pack_sequences_for_hdf5(&p, sb, num_models));
+        RUN(write_packed_sequences_hdf5(filename, p));
+        free_seq_hdf5_pack(p);
+        return OK;
+ERROR:
+        free_seq_hdf5_pack(p);
+        return FAIL;
+}
+
+/* Copies sequences, labels and scores into the matrices written to the
+ * model file. If *pack already exists (same sequences) only labels and
+ * scores are refreshed. */
+int pack_sequences_for_hdf5(struct seq_hdf5_pack** pack, struct tl_seq_buffer* sb, int num_models)
+{
+        struct seq_hdf5_pack* p = NULL;
         struct seq_ihmm_data* d = NULL;
         int i,j,c,len;
         int pos;
 
-        char** name = NULL;
-        char** seq = NULL;
-        int** label = NULL;
-        double** scores = NULL;
-        int max_name_len;
-        //int has_seq_info;
-
         ASSERT(sb!=NULL, "No sequence buffer");
 
-        /* make sequence name matrix */
-        max_name_len = -1;
-        for(i = 0; i < sb->num_seq;i++){
-                len = strlen(sb->sequences[i]->name);
-                if(len > max_name_len){
-                        max_name_len = len;
+        p = *pack;
+        if(p){
+                ASSERT(p->num_seq == sb->num_seq, "Sequence buffer changed");
+                ASSERT(p->num_models == num_models, "Number of models changed");
+        }else{
+                MMALLOC(p, sizeof(struct seq_hdf5_pack));
+                p->name = NULL;
+                p->seq = NULL;
+                p->label = NULL;
+                p->scores = NULL;
+                p->multiplicity = NULL;
+                p->num_seq = sb->num_seq;
+                p->max_len = sb->max_len;
+                p->L = sb->L;
+                p->num_models = num_models;
+                *pack = p;
+
+                /* make sequence name matrix */
+                p->max_name_len = -1;
+                for(i = 0; i < sb->num_seq;i++){
+                        len = strlen(sb->sequences[i]->name);
+                        if(len > p->max_name_len){
+                                p->max_name_len = len;
+                        }
                 }
-        }
-        max_name_len+=1;
+                p->max_name_len+=1;
 
-        RUN(galloc(&name, sb->num_seq, max_name_len));
-        for(i = 0; i < sb->num_seq;i++){
-                len = strlen(sb->sequences[i]->name);
-                for (j = 0; j < len;j++){
-                        name[i][j] = sb->sequences[i]->name[j];
-                }
-                for(j = len;j < max_name_len;j++){
-                        name[i][j] = 0;
+                RUN(galloc(&p->name, sb->num_seq, p->max_name_len));
+                for(i = 0; i < sb->num_seq;i++){
+                        len = strlen(sb->sequences[i]->name);
+                        for (j = 0; j < len;j++){
+                                p->name[i][j] = sb->sequences[i]->name[j];
+                        }
+                        for(j = len;j < p->max_name_len;j++){
+                                p->name[i][j] = 0;
+                        }
                 }
-        }
 
-        /* make sequence matrix */
-
-        //RUNP(seq = galloc(seq, sb->num_seq, sb->max_len, -1));
-        RUN(galloc(&seq, sb->num_seq, sb->max_len));
-        for(i = 0; i < sb->num_seq;i++){
-                len = sb->sequences[i]->len;
-                for (j = 0; j < len;j++){
-                        seq[i][j] = sb->sequences[i]->seq[j];
+                /* make sequence matrix */
+                RUN(galloc(&p->seq, sb->num_seq, sb->max_len));
+                for(i = 0; i < sb->num_seq;i++){
+                        len = sb->sequences[i]->len;
+                        for (j = 0; j < len;j++){
+                                p->seq[i][j] = sb->sequences[i]->seq[j];
+                        }
+                        for(j = len;j < sb->max_len;j++){
+                                p->seq[i][j] = -1;
+                        }
                 }
-                /* NEW  */
-                for(j = len;j < sb->max_len;j++){
-                        seq[i][j] = -1;
+                RUN(galloc(&p->label, sb->num_seq, (sb->max_len+1)* num_models));
+                RUN(galloc(&p->scores, sb->num_seq, num_models));
+                RUN(galloc(&p->multiplicity, sb->num_seq));
+                for(i = 0; i < sb->num_seq;i++){
+                        d = sb->sequences[i]->data;
+                        p->multiplicity[i] = d->multiplicity;
                 }
-
         }
 
         /* make  label matrix */
-
-        //RUNP(label = galloc(label, sb->num_seq, (sb->max_len+1)* num_models, -1));
-        RUN(galloc(&label, sb->num_seq, (sb->max_len+1)* num_models));
-
         for(i = 0; i < sb->num_seq;i++){
                 d = sb->sequences[i]->data;
                 len = sb->sequences[i]->len;
                 pos = 0;
                 for(c = 0; c < num_models;c++){
-                        for (j = 0; j < sb->max_len+1;j++){
-                                label[i][pos] = d->label_arr[c][j];
+                        for (j = 0; j < len+1;j++){
+                                p->label[i][pos] = d->label_arr[c][j];
+                                pos++;
+                        }
+                        for (j = len+1; j < sb->max_len+1;j++){
+                                p->label[i][pos] = -1;
                                 pos++;
                         }
-                }
-                for(c = pos; c < (sb->max_len+1)* num_models;c++){
-                        label[i][c] = -1;
                 }
         }
 
         /* Score matrix */
-
-        //RUNP(scores = galloc(scores, sb->num_seq, num_models,0.0));
-        RUN(galloc(&scores, sb->num_seq, num_models));
-
         for(i = 0; i < sb->num_seq;i++){
                 d = sb->sequences[i]->data;
-                len = sb->sequences[i]->len;
-                pos = 0;
                 for(j = 0; j < num_models;j++){
-                        scores[i][j] = d->score_arr[j];
-
+                        p->scores[i][j] = d->score_arr[j];
                 }
         }
+        return OK;
+ERROR:
+        /* a partial pack is owned (and freed) by the caller  */
+        return FAIL;
+}
 
-        open_hdf5_file(&hdf5_data, filename);
+int write_packed_sequences_hdf5(char* filename, struct seq_hdf5_pack* p)
+{
+        struct hdf5_data* hdf5_data = NULL;
 
-        //hdf5_open_file(struct hdf5_data *hdf5_data)
-        //RUNP(hdf5_data = hdf5_create());
+        ASSERT(p != NULL, "No packed sequences");
 
-        //hdf5_open_file(filename,hdf5_data);
-        /*
-        get_group_names(hdf5_data);
+        RUN(open_hdf5_file(&hdf5_data, filename));
 
-        has_seq_info = 0;
+        RUN(HDFWRAP_WRITE_ATTRIBUTE(hdf5_data, "/SequenceInformation", "Numseq", p->num_seq));
+        RUN(HDFWRAP_WRITE_ATTRIBUTE(hdf5_data, "/SequenceInformation", "MaxLen", p->max_len));
+        RUN(HDFWRAP_WRITE_ATTRIBUTE(hdf5_data, "/SequenceInformation", "MaxNameLen",p->max_name_len));
+        RUN(HDFWRAP_WRITE_ATTRIBUTE(hdf5_data, "/SequenceInformation", "Alphabet", p->L));
+        RUN(HDFWRAP_WRITE_ATTRIBUTE(hdf5_data, "/SequenceInformation", "NumModels", p->num_models));
 
-        for(i = 0; i < hdf5_data->grp_names->num_names;i++){
-                if(strncmp("SequenceInformation", hdf5_data->grp_names->names[i],19) == 0){
-                        has_seq_info = 1;
-                }
-        }
-        if(!has_seq_info ){
-                hdf5_create_group("SequenceInformation",hdf5_data);
-        }else{
-                hdf5_open_group("SequenceInformation",hdf5_data);
-        }
-        hdf5_data->num_attr = 0;
-        */
-        RUN(HDFWRAP_WRITE_ATTRIBUTE(hdf5_data, "/SequenceInformation", "Numseq", sb->num_seq));
-        RUN(HDFWRAP_WRITE_ATTRIBUTE(hdf5_data, "/SequenceInformation", "MaxLen", sb->max_len));
-        RUN(HDFWRAP_WRITE_ATTRIBUTE(hdf5_data, "/SequenceInformation", "MaxNameLen",max_name_len));
-        RUN(HDFWRAP_WRITE_ATTRIBUTE(hdf5_data, "/SequenceInformation", "Alphabet", sb->L));
-        RUN(HDFWRAP_WRITE_ATTRIBUTE(hdf5_data, "/SequenceInformation", "NumModels", num_models));
-
-        RUN(HDFWRAP_WRITE_DATA(hdf5_data, "/SequenceInformation", "Names", name));
-        RUN(HDFWRAP_WRITE_DATA(hdf5_data, "/SequenceInformation", "Sequences", seq));
-        RUN(HDFWRAP_WRITE_DATA(hdf5_data, "/SequenceInformation", "Labels", label));
-        RUN(HDFWRAP_WRITE_DATA(hdf5_data, "/SequenceInformation", "CompetitiveScores", scores));
-        //RUN(HDFWRAP_WRITE_DATA(hdf5_data, "/SequenceInformation", "Background", sb->background));
+        RUN(HDFWRAP_WRITE_DATA(hdf5_data, "/SequenceInformation", "Names", p->name));
+        RUN(HDFWRAP_WRITE_DATA(hdf5_data, "/SequenceInformation", "Sequences", p->seq));
+        RUN(HDFWRAP_WRITE_DATA(hdf5_data, "/SequenceInformation", "Labels", p->label));
+        RUN(HDFWRAP_WRITE_DATA(hdf5_data, "/SequenceInformation", "CompetitiveScores", p->scores));
+        RUN(HDFWRAP_WRITE_DATA(hdf5_data, "/SequenceInformation", "Multiplicity", p->multiplicity));
         RUN(close_hdf5_file(&hdf5_data));
-        gfree(label);
-        gfree(name);
-        gfree(seq);
         return OK;
 ERROR:
         if(hdf5_data){
-                RUN(close_hdf5_file(&hdf5_data));
-
-        }
-        if(label){
-                gfree(label);
-        }
-        if(name){
-                gfree(name);
-        }
-        if(seq){
-                gfree(seq);
+                close_hdf5_file(&hdf5_data);
         }
         return FAIL;
 }
 
+void free_seq_hdf5_pack(struct seq_hdf5_pack* p)
+{
+        if(p){
+                if(p->name){
+                        gfree(p->name);
+                }
+                if(p->seq){
+                        gfree(p->seq);
+                }
+                if(p->label){
+                        gfree(p->label);
+                }
+                if(p->scores){
+                        gfree(p->scores);
+                }
+                if(p->multiplicity){
+                        gfree(p->multiplicity);
+                }
+                MFREE(p);
+        }
+}
+
 struct tl_seq_buffer* get_sequences_from_hdf5_model(char* filename, int mode)
 {
         struct hdf5_data* hdf5_data = NULL;
@@ -371,6 +393,7 @@ struct tl_seq_buffer* get_sequences_from_hdf5_model(char* filename, int mode)
         char** seq = NULL;
         int** label = NULL;
         double** scores = NULL;
+        int* multiplicity = NULL;
         //double* background;
 
         int num_seq;
@@ -380,6 +403,7 @@ struct tl_seq_buffer* get_sequences_from_hdf5_model(char* filename, int mode)
         int i,j,c;
         int num_models;
         int pos;
+        int found;
         ASSERT(filename != NULL, "No filename");
         ASSERT(my_file_exists(filename) != 0,"File %s does not exist.",filename);
 
@@ -408,6 +432,12 @@ struct tl_seq_buffer* get_sequences_from_hdf5_model(char* filename, int mode)
 
         if(mode == IHMM_SEQ_READ_ALL){
                 RUN(HDFWRAP_READ_DATA(hdf5_data, "/SequenceInformation", "Labels", &label));
+                /* absent in files written before duplicates were
+                 * collapsed - every sequence then counts once */
+                RUN(has_dataset(filename, "/SequenceInformation/Multiplicity", &found));
+                if(found){
+                        RUN(HDFWRAP_READ_DATA(hdf5_data, "/SequenceInformation", "Multiplicity", &multiplicity));
+                }
         }else{
                 label= NULL;
         }
@@ -450,16 +480,21 @@ struct tl_seq_buffer* get_sequences_from_hdf5_model(char* filename, int mode)
                 //RUN(add_multi_model_label_and_u(sb, num_models));
                 /* copy stuff over */
                 for(i = 0; i < sb->num_seq;i++){
-                        RUN(alloc_ihmm_seq_data(sb->sequences[i], num_models, max_len));
+                        /* u is not stored; callers pick the storage
+                           with set_ihmm_seq_u_mode */
+                        RUN(alloc_ihmm_seq_data(sb->sequences[i], num_models, IHMM_U_REGENERATE));
                         d = sb->sequences[i]->data;
-                        pos = 0;
                         for(c = 0; c < num_models;c++){
-                                for (j = 0; j < sb->max_len+1;j++){
+                                pos = c * (sb->max_len+1);
+                                for (j = 0; j < sb->sequences[i]->len+1;j++){
                                         d->label_arr[c][j] = label[i][pos];
                                         pos++;
                                 }
                                 d->score_arr[c] = scores[i][c];
                         }
+                        if(multiplicity){
+                                d->multiplicity = multiplicity[i];
+                        }
                 }
         }
 
@@ -489,6 +524,9 @@ struct tl_seq_buffer* get_sequences_from_hdf5_model(char* filename, int mode)
         if(mode == IHMM_SEQ_READ_ALL){
                 gfree(label);
         }
+        if(multiplicity){
+                gfree(multiplicity);
+        }
         gfree(scores);
         gfree(name);
         gfree(seq);
@@ -506,6 +544,31 @@ ERROR:
         if(seq){
                 gfree(seq);
         }
+        if(multiplicity){
+                gfree(multiplicity);
+        }
 
         return NULL;
 }
+
+/* HDFWRAP_READ_DATA treats a missing dataset as an error; look first. */
+int has_dataset(char* filename, char* path, int* found)
+{
+        hid_t file;
+        htri_t status;
+
+        *found = 0;
+        file = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
+        if(file < 0){
+                ERROR_MSG("Could not open %s.", filename);
+        }
+        status = H5Lexists(file, path, H5P_DEFAULT);
+        H5Fclose(file);
+        if(status < 0){
+                ERROR_MSG("Could not look up %s in %s.", path, filename);
+        }
+        *found = status > 0;
+        return OK;
+ERROR:
+        return FAIL;
+}
@@ -14,6 +14,20 @@
 struct seq_buffer;
 struct tl_seq_buffer;
 
+/* Sequence information in the layout written to model files  */
+struct seq_hdf5_pack{
+        char** name;
+        char** seq;
+        int** label;
+        double** scores;
+        int* multiplicity;
+        int num_seq;
+        int max_len;
+        int max_name_len;
+        int L;
+        int num_models;
+};
+
 EXTERN int read_sequences_file(struct tl_seq_buffer** seq_buf,char* filename );
 //EXTERN int read_sequences_file(struct seq_buffer** seq_buf,char* filename );
 EXTERN int convert_tl_seq_buf_into_ihmm_seq_buf(struct tl_seq_buffer* tlsb, struct seq_buffer** ret);
@@ -21,6 +35,9 @@ EXTERN int convert_ihmm_seq_buf_into_tl_seq_buf(struct seq_buffer* in,struct tl_
 
 EXTERN struct tl_seq_buffer* get_sequences_from_hdf5_model(char* filename, int mode);
 EXTERN int add_sequences_to_hdf5_model(char* filename,struct tl_seq_buffer* sb, int num_models);
+EXTERN int pack_sequences_for_hdf5(struct seq_hdf5_pack** pack, struct tl_seq_buffer* sb, int num_models);
+EXTERN int write_packed_sequences_hdf5(char* filename, struct seq_hdf5_pack* p);
+EXTERN void free_seq_hdf5_pack(struct seq_hdf5_pack* p);
 
 
 #undef SEQUENCE_IO_IMPORT
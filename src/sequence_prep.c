@@ -1,4 +1,5 @@
 #include <ctype.h>
+#include <string.h>
 
 #include "tldevel.h"
 #include "tlalphabet.h"
@@ -19,29 +20,45 @@ static int random_label_sequences(struct tl_seq_buffer* sb, int K, int model_ind
 
 
 static int set_alphabet_and_convert(struct tl_seq_buffer* sb, struct rng_state* rng);
+static int collapse_duplicates(struct tl_seq_buffer* sb, int** multiplicity);
+static uint64_t hash_residues(const uint8_t* seq, int len);
 /* This function should prepare sequences to be used in beam sampleing
    This involves:
    - adding an alphabet (and sanity checks !!! )
    - convert sequences from char to numbered
+   - collapse identical sequences (dedup != 0)
    - add multi_u etc arrays
    - initial random labelling
 
  */
-int prep_sequences(struct tl_seq_buffer* sb, struct rng_state* rng, int num_models,int num_states, double sigma)
+int prep_sequences(struct tl_seq_buffer* sb, struct rng_state* rng, int num_models,int num_states, double sigma, int u_mode, int dedup)
 {
-        
+        struct seq_ihmm_data* d = NULL;
+        int* multiplicity = NULL;
         int i;
-        
+
         ASSERT(sb != NULL, "No sequence buffer");
         ASSERT(num_models > 0, "No num_models");
 
         /* alphabet */
         RUN(set_alphabet_and_convert(sb,rng));
 
+        if(dedup){
+                RUN(collapse_duplicates(sb, &multiplicity));
+        }
+
         /* add u and label */
         for(i = 0; i < sb->num_seq;i++){
                 //d = sb->sequences[i]->data;
-                RUN(alloc_ihmm_seq_data(sb->sequences[i],num_models, sb->max_len));
+                RUN(alloc_ihmm_seq_data(sb->sequences[i],num_models, u_mode));
+                if(multiplicity){
+                        d = sb->sequences[i]->data;
+                        d->multiplicity = multiplicity[i];
+                }
+        }
+        if(multiplicity){
+                MFREE(multiplicity);
+                multiplicity = NULL;
         }
         //RUN(add_multi_model_label_and_u(sb, num_models));
         LOG_MSG("Start: %d", num_states);
@@ -51,9 +68,108 @@ int prep_sequences(struct tl_seq_buffer* sb, struct rng_state* rng, int num_mode
         LOG_MSG("SEQUENCES: %d", sb->num_seq);
         return OK;
 ERROR:
+        if(multiplicity){
+                MFREE(multiplicity);
+        }
+        return FAIL;
+}
+
+/* Keeps the first copy of every distinct sequence and counts how often
+ * it occurred. Duplicates are moved behind num_seq so the buffer still
+ * owns (and frees) them. */
+int collapse_duplicates(struct tl_seq_buffer* sb, int** multiplicity)
+{
+        struct tl_seq** keep = NULL;
+        struct tl_seq** drop = NULL;
+        struct tl_seq* s = NULL;
+        struct tl_seq* o = NULL;
+        int* table = NULL;
+        int* mult = NULL;
+        uint64_t h;
+        int size;
+        int n_keep;
+        int n_drop;
+        int i,j;
+
+        size = 1;
+        while(size < 2 * sb->num_seq){
+                size = size << 1;
+        }
+        MMALLOC(table, sizeof(int) * size);
+        MMALLOC(mult, sizeof(int) * sb->num_seq);
+        MMALLOC(keep, sizeof(struct tl_seq*) * sb->num_seq);
+        MMALLOC(drop, sizeof(struct tl_seq*) * sb->num_seq);
+        for(i = 0; i < size;i++){
+                table[i] = -1;
+        }
+        n_keep = 0;
+        n_drop = 0;
+        for(i = 0; i < sb->num_seq;i++){
+                s = sb->sequences[i];
+                h = hash_residues(s->seq, s->len);
+                /* linear probing; entries are indices into keep */
+                j = (int) (h & (uint64_t) (size - 1));
+                while(table[j] != -1){
+                        o = keep[table[j]];
+                        if(o->len == s->len && memcmp(o->seq, s->seq, s->len) == 0){
+                                break;
+                        }
+                        j = (j + 1) & (size - 1);
+                }
+                if(table[j] == -1){
+                        table[j] = n_keep;
+                        mult[n_keep] = 1;
+                        keep[n_keep] = s;
+                        n_keep++;
+                }else{
+                        mult[table[j]]++;
+                        drop[n_drop] = s;
+                        n_drop++;
+                }
+        }
+        for(i = 0; i < n_keep;i++){
+                sb->sequences[i] = keep[i];
+        }
+        for(i = 0; i < n_drop;i++){
+                sb->sequences[n_keep + i] = drop[i];
+        }
+        sb->num_seq = n_keep;
+        if(n_drop){
+                LOG_MSG("Collapsed %d duplicate sequences; %d unique sequences remain.", n_drop, n_keep);
+        }
+        MFREE(table);
+        MFREE(keep);
+        MFREE(drop);
+        *multiplicity = mult;
+        return OK;
+ERROR:
+        if(table){
+                MFREE(table);
+        }
+        if(mult){
+                MFREE(mult);
+        }
+        if(keep){
+                MFREE(keep);
+        }
+        if(drop){
+                MFREE(drop);
+        }
         return FAIL;
 }
 
+/* FNV-1a */
+uint64_t hash_residues(const uint8_t* seq, int len)
+{
+        uint64_t h = 14695981039346656037ULL;
+        int i;
+        for(i = 0; i < len;i++){
+                h ^= (uint64_t) seq[i];
+                h *= 1099511628211ULL;
+        }
+        return h;
+}
+
 int init_labelling(struct tl_seq_buffer* sb, struct rng_state* rng, int num_models,int num_states, double sigma)
 {
         double average_sequence_len = 0.0;
@@ -10,7 +10,7 @@
 struct seq_buffer;
 struct rng_state;
 
-EXTERN int prep_sequences(struct tl_seq_buffer* sb, struct rng_state* rng, int num_models,int num_states, double sigma);
+EXTERN int prep_sequences(struct tl_seq_buffer* sb, struct rng_state* rng, int num_models,int num_states, double sigma, int u_mode, int dedup);
 
 
 EXTERN int get_res_counts(struct seq_buffer* sb, double* counts);
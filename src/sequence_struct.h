@@ -27,13 +27,27 @@ struct seq_score_data{
         double b_score;
 };
 
+/* Storage of the slice variables; in IHMM_U_REGENERATE mode u is
+ * recomputed from the counter RNG inside the dynamic programming.
+ * Per residue and model this is u plus the two uint16_t label arrays:
+ * 12, 8 and 4 bytes. Both label arrays are needed between sweeps (the
+ * incremental count refresh reads the old path), so IHMM_U_FLOAT only
+ * saves 1.5x. */
+#define IHMM_U_DOUBLE 0
+#define IHMM_U_FLOAT 1
+#define IHMM_U_REGENERATE 2
+
 struct seq_ihmm_data{
         uint8_t* has_path;
         double** u_arr;
+        float** u_arr_f;
         double* score_arr;
         uint16_t** label_arr;
         uint16_t** tmp_label_arr;
+        int* diff_lo;           /* positions where the last sweep changed */
+        int* diff_hi;           /* the labels (empty if lo > hi) */
         double* u;
+        int multiplicity;       /* number of identical input sequences */
 };
 
 /*struct seq_buffer{
@@ -32,7 +32,7 @@ int main(int argc, char *argv[])
 
 
 
-        RUN(prep_sequences(sb, rng, 1,0,0.0));
+        RUN(prep_sequences(sb, rng, 1,0,0.0, IHMM_U_DOUBLE, 0));
 
         free_rng(rng);
         free_tl_seq_buffer(sb);
@@ -0,0 +1,517 @@
+#include "tldevel.h"
+#include "tlseqbuffer.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "model_struct.h"
+#include "sequence_alloc.h"
+#include "sequence_struct.h"
+
+#define SHARD_IMPORT
+#include "shard.h"
+
+#define SHARD_OP_SUM 0
+#define SHARD_OP_SUM_INT 1
+#define SHARD_OP_MIN 2
+
+struct socket_data{
+        int* fd;
+        pid_t* pid;
+};
+
+static int socket_send(struct shard_transport* t, int peer, const void* buf, size_t len);
+static int socket_recv(struct shard_transport* t, int peer, void* buf, size_t len);
+static void socket_free(struct shard_transport* t);
+
+static int assign_owners(struct shard* s, struct tl_seq_buffer* sb);
+static int sort_by_len(const void* a, const void* b);
+static int allreduce(struct shard* s, void* x, int n, int op);
+static int reserve_buf(struct shard* s, size_t len);
+
+int shard_transport_socket(struct shard_transport** t, int size)
+{
+        struct shard_transport* tr = NULL;
+        struct socket_data* sd = NULL;
+        pid_t pid;
+        int sv[2];
+        int i,j;
+
+        ASSERT(size > 1, "Need at least two processes (got %d)", size);
+
+        MMALLOC(tr, sizeof(struct shard_transport));
+        tr->send = socket_send;
+        tr->recv = socket_recv;
+        tr->free = socket_free;
+        tr->data = NULL;
+        tr->rank = 0;
+        tr->size = size;
+        MMALLOC(sd, sizeof(struct socket_data));
+        sd->fd = NULL;
+        sd->pid = NULL;
+        tr->data = sd;
+        MMALLOC(sd->fd, sizeof(int) * size);
+        MMALLOC(sd->pid, sizeof(pid_t) * size);
+        for(i = 0; i < size;i++){
+                sd->fd[i] = -1;
+                sd->pid[i] = 0;
+        }
+        /* children inherit unflushed output otherwise */
+        fflush(NULL);
+        for(i = 1; i < size;i++){
+                if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0){
+                        ERROR_MSG("socketpair failed: %s", strerror(errno));
+                }
+                pid = fork();
+                if(pid < 0){
+                        ERROR_MSG("fork failed: %s", strerror(errno));
+                }
+                if(pid == 0){
+                        /* worker: only keep the link to the coordinator */
+                        close(sv[0]);
+                        for(j = 1; j < i;j++){
+                                close(sd->fd[j]);
+                                sd->fd[j] = -1;
+                                sd->pid[j] = 0;
+                        }
+                        sd->fd[0] = sv[1];
+                        tr->rank = i;
+                        *t = tr;
+                        return OK;
+                }
+                close(sv[1]);
+                sd->fd[i] = sv[0];
+                sd->pid[i] = pid;
+        }
+        *t = tr;
+        return OK;
+ERROR:
+        if(tr){
+                socket_free(tr);
+        }
+        return FAIL;
+}
+
+int socket_send(struct shard_transport* t, int peer, const void* buf, size_t len)
+{
+        struct socket_data* sd = t->data;
+        const char* p = buf;
+        ssize_t n;
+
+        while(len){
+                n = write(sd->fd[peer], p, len);
+                if(n < 0){
+                        if(errno == EINTR){
+                                continue;
+                        }
+                        ERROR_MSG("Sending to process %d failed: %s", peer, strerror(errno));
+                }
+                p += n;
+                len -= (size_t) n;
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+int socket_recv(struct shard_transport* t, int peer, void* buf, size_t len)
+{
+        struct socket_data* sd = t->data;
+        char* p = buf;
+        ssize_t n;
+
+        while(len){
+                n = read(sd->fd[peer], p, len);
+                if(n < 0){
+                        if(errno == EINTR){
+                                continue;
+                        }
+                        ERROR_MSG("Receiving from process %d failed: %s", peer, strerror(errno));
+                }
+                if(n == 0){
+                        ERROR_MSG("Process %d closed the connection.", peer);
+                }
+                p += n;
+                len -= (size_t) n;
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+void socket_free(struct shard_transport* t)
+{
+        struct socket_data* sd = NULL;
+        int status;
+        int i;
+
+        if(t){
+                sd = t->data;
+                if(sd){
+                        if(sd->fd){
+                                for(i = 0; i < t->size;i++){
+                                        if(sd->fd[i] != -1){
+                                                close(sd->fd[i]);
+                                        }
+                                }
+                                MFREE(sd->fd);
+                        }
+                        if(sd->pid){
+                                /* workers see EOF once the sockets are closed */
+                                if(t->rank == 0){
+                                        for(i = 1; i < t->size;i++){
+                                                if(sd->pid[i] > 0){
+                                                        waitpid(sd->pid[i], &status, 0);
+                                                }
+                                        }
+                                }
+                                MFREE(sd->pid);
+                        }
+                        MFREE(sd);
+                }
+                MFREE(t);
+        }
+}
+
+/* Deals the sequences to processes (longest first, to the process with
+ * the fewest residues) and switches the buffer to the local view. The
+ * deal only depends on the sequence lengths, so all processes agree on
+ * it. Workers drop the sampling state of sequences they do not own. */
+int alloc_shard(struct shard** s, struct shard_transport* t, struct tl_seq_buffer* sb)
+{
+        struct shard* sh = NULL;
+        struct seq_ihmm_data* d = NULL;
+        int i,c;
+
+        ASSERT(t != NULL, "No transport");
+        ASSERT(sb != NULL, "No sequences");
+        ASSERT(sb->num_seq >= t->size, "Fewer sequences (%d) than processes (%d)", sb->num_seq, t->size);
+
+        MMALLOC(sh, sizeof(struct shard));
+        sh->t = t;
+        sh->all = sb->sequences;
+        sh->local = NULL;
+        sh->owner = NULL;
+        sh->buf = NULL;
+        sh->alloc_buf = 0;
+        sh->num_all = sb->num_seq;
+        sh->num_local = 0;
+        sh->rank = t->rank;
+        sh->size = t->size;
+
+        RUN(assign_owners(sh, sb));
+
+        MMALLOC(sh->local, sizeof(struct tl_seq*) * sb->malloc_num);
+        c = 0;
+        for(i = 0; i < sh->num_all;i++){
+                if(sh->owner[i] == sh->rank){
+                        sh->local[c] = sh->all[i];
+                        c++;
+                }
+        }
+        sh->num_local = c;
+        for(i = 0; i < sh->num_all;i++){
+                if(sh->owner[i] != sh->rank){
+                        sh->local[c] = sh->all[i];
+                        c++;
+                }
+        }
+        for(i = sh->num_all; i < sb->malloc_num;i++){
+                sh->local[i] = sh->all[i];
+        }
+        if(sh->rank){
+                for(i = 0; i < sh->num_all;i++){
+                        if(sh->owner[i] != sh->rank){
+                                d = sh->all[i]->data;
+                                RUN(free_ihmm_seq_data(&d));
+                                sh->all[i]->data = NULL;
+                        }
+                }
+        }
+        LOG_MSG("Process %d of %d: %d of %d sequences.", sh->rank, sh->size, sh->num_local, sh->num_all);
+        RUN(shard_local_view(sh, sb));
+        *s = sh;
+        return OK;
+ERROR:
+        if(sh){
+                if(sh->local){
+                        MFREE(sh->local);
+                }
+                if(sh->owner){
+                        MFREE(sh->owner);
+                }
+                MFREE(sh);
+        }
+        return FAIL;
+}
+
+int assign_owners(struct shard* s, struct tl_seq_buffer* sb)
+{
+        int* order = NULL;
+        uint64_t* load = NULL;
+        int i,j,k;
+
+        MMALLOC(s->owner, sizeof(int) * s->num_all);
+        MMALLOC(order, sizeof(int) * s->num_all * 2);
+        MMALLOC(load, sizeof(uint64_t) * s->size);
+        for(i = 0; i < s->num_all;i++){
+                order[i*2] = sb->sequences[i]->len;
+                order[i*2+1] = i;
+        }
+        qsort(order, s->num_all, sizeof(int) * 2, sort_by_len);
+        for(i = 0; i < s->size;i++){
+                load[i] = 0;
+        }
+        for(i = 0; i < s->num_all;i++){
+                k = 0;
+                for(j = 1; j < s->size;j++){
+                        if(load[j] < load[k]){
+                                k = j;
+                        }
+                }
+                s->owner[order[i*2+1]] = k;
+                load[k] += (uint64_t) order[i*2];
+        }
+        MFREE(order);
+        MFREE(load);
+        return OK;
+ERROR:
+        if(order){
+                MFREE(order);
+        }
+        if(load){
+                MFREE(load);
+        }
+        return FAIL;
+}
+
+/* longest first, ties by input order  */
+int sort_by_len(const void* a, const void* b)
+{
+        const int* x = a;
+        const int* y = b;
+        if(x[0] != y[0]){
+                return (x[0] > y[0]) ? -1 : 1;
+        }
+        return (x[1] < y[1]) ? -1 : (x[1] > y[1]);
+}
+
+int shard_local_view(struct shard* s, struct tl_seq_buffer* sb)
+{
+        ASSERT(s != NULL, "No shard");
+        sb->sequences = s->local;
+        sb->num_seq = s->num_local;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* All sequences in input order; on workers only the owned ones carry
+ * sampling state. */
+int shard_full_view(struct shard* s, struct tl_seq_buffer* sb)
+{
+        ASSERT(s != NULL, "No shard");
+        sb->sequences = s->all;
+        sb->num_seq = s->num_all;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+int shard_allreduce_sum(struct shard* s, double* x, int n)
+{
+        return allreduce(s, x, n, SHARD_OP_SUM);
+}
+
+int shard_allreduce_sum_int(struct shard* s, int* x, int n)
+{
+        return allreduce(s, x, n, SHARD_OP_SUM_INT);
+}
+
+int shard_allreduce_min(struct shard* s, double* x, int n)
+{
+        return allreduce(s, x, n, SHARD_OP_MIN);
+}
+
+/* Workers send to the coordinator, which combines in rank order and
+ * sends the result back - every process ends up with the same bits. */
+int allreduce(struct shard* s, void* x, int n, int op)
+{
+        struct shard_transport* t = s->t;
+        size_t len;
+        double* xd = x;
+        double* bd = NULL;
+        int* xi = x;
+        int* bi = NULL;
+        int i,r;
+
+        if(n <= 0){
+                return OK;
+        }
+        len = (op == SHARD_OP_SUM_INT) ? sizeof(int) * n : sizeof(double) * n;
+        if(s->rank){
+                RUN(t->send(t, 0, x, len));
+                RUN(t->recv(t, 0, x, len));
+                return OK;
+        }
+        RUN(reserve_buf(s, len));
+        bd = s->buf;
+        bi = s->buf;
+        for(r = 1; r < s->size;r++){
+                RUN(t->recv(t, r, s->buf, len));
+                switch (op) {
+                case SHARD_OP_SUM:
+                        for(i = 0; i < n;i++){
+                                xd[i] += bd[i];
+                        }
+                        break;
+                case SHARD_OP_SUM_INT:
+                        for(i = 0; i < n;i++){
+                                xi[i] += bi[i];
+                        }
+                        break;
+                case SHARD_OP_MIN:
+                        for(i = 0; i < n;i++){
+                                xd[i] = MACRO_MIN(xd[i], bd[i]);
+                        }
+                        break;
+                default:
+                        ERROR_MSG("Unknown reduction: %d", op);
+                        break;
+                }
+        }
+        for(r = 1; r < s->size;r++){
+                RUN(t->send(t, r, x, len));
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+int shard_broadcast(struct shard* s, void* buf, size_t len)
+{
+        struct shard_transport* t = s->t;
+        int r;
+
+        if(s->rank){
+                RUN(t->recv(t, 0, buf, len));
+                return OK;
+        }
+        for(r = 1; r < s->size;r++){
+                RUN(t->send(t, r, buf, len));
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Sums the transition and emission counts of the used states  */
+int shard_reduce_counts(struct shard* s, struct ihmm_model* ihmm)
+{
+        int K;
+        int i;
+
+        K = ihmm->num_states;
+        for(i = 0; i < K;i++){
+                RUN(shard_allreduce_sum(s, ihmm->transition_counts[i], K));
+        }
+        for(i = 0; i < ihmm->L;i++){
+                RUN(shard_allreduce_sum(s, ihmm->emission_counts[i], K));
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Sends the coordinator's beta, alpha, gamma and random number state  */
+int shard_broadcast_hyper(struct shard* s, struct ihmm_model* ihmm)
+{
+        double ag[2];
+
+        ag[0] = ihmm->alpha;
+        ag[1] = ihmm->gamma;
+        RUN(shard_broadcast(s, ag, sizeof(double) * 2));
+        RUN(shard_broadcast(s, ihmm->beta, sizeof(double) * ihmm->num_states));
+        RUN(shard_broadcast(s, &ihmm->rndstate, sizeof(rk_state)));
+        ihmm->alpha = ag[0];
+        ihmm->gamma = ag[1];
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Copies labels and weights of all sequences to the coordinator  */
+int shard_gather_labels(struct shard* s, int num_models)
+{
+        struct shard_transport* t = s->t;
+        struct seq_ihmm_data* d = NULL;
+        struct tl_seq* seq = NULL;
+        int i,c;
+
+        for(i = 0; i < s->num_all;i++){
+                if(s->owner[i] == 0){
+                        continue;
+                }
+                if(s->rank != 0 && s->owner[i] != s->rank){
+                        continue;
+                }
+                seq = s->all[i];
+                d = seq->data;
+                for(c = 0; c < num_models;c++){
+                        if(s->rank){
+                                RUN(t->send(t, 0, d->label_arr[c], sizeof(uint16_t) * (seq->len+1)));
+                        }else{
+                                RUN(t->recv(t, s->owner[i], d->label_arr[c], sizeof(uint16_t) * (seq->len+1)));
+                        }
+                }
+                if(s->rank){
+                        RUN(t->send(t, 0, d->score_arr, sizeof(double) * num_models));
+                }else{
+                        RUN(t->recv(t, s->owner[i], d->score_arr, sizeof(double) * num_models));
+                }
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+int reserve_buf(struct shard* s, size_t len)
+{
+        if(len > s->alloc_buf){
+                if(s->buf){
+                        MFREE(s->buf);
+                        s->buf = NULL;
+                }
+                MMALLOC(s->buf, len);
+                s->alloc_buf = len;
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Restores the full view so that the buffer can be freed as usual  */
+void free_shard(struct shard* s, struct tl_seq_buffer* sb)
+{
+        if(s){
+                if(sb){
+                        sb->sequences = s->all;
+                        sb->num_seq = s->num_all;
+                }
+                if(s->local){
+                        MFREE(s->local);
+                }
+                if(s->owner){
+                        MFREE(s->owner);
+                }
+                if(s->buf){
+                        MFREE(s->buf);
+                }
+                MFREE(s);
+        }
+}
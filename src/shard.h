@@ -0,0 +1,72 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stddef.h>
+
+#ifdef SHARD_IMPORT
+#define EXTERN
+#else
+#define EXTERN extern
+#endif
+
+/* Sharded training over several processes. Every process holds a full
+ * copy of the models (with identical random number states) but runs
+ * the dynamic programming only on its own shard of the sequences. At
+ * each parameter update the processes exchange sufficient statistics
+ * (state usage, transition / emission counts, min_u, number of
+ * sequences without a path) through the coordinator (rank 0). The
+ * coordinator samples the hyper parameters and broadcasts them; all
+ * processes then derive the same fast parameters.
+ *
+ * Messages travel through a shard_transport. send / recv move exactly
+ * len bytes to / from a peer; workers only talk to rank 0. */
+
+struct tl_seq;
+struct tl_seq_buffer;
+struct ihmm_model;
+
+struct shard_transport{
+        int (*send)(struct shard_transport* t, int peer, const void* buf, size_t len);
+        int (*recv)(struct shard_transport* t, int peer, void* buf, size_t len);
+        void (*free)(struct shard_transport* t);
+        void* data;
+        int rank;
+        int size;
+};
+
+struct shard{
+        struct shard_transport* t;
+        struct tl_seq** all;    /* the buffer's own array (input order) */
+        struct tl_seq** local;  /* owned sequences first */
+        int* owner;
+        void* buf;
+        size_t alloc_buf;
+        int num_all;
+        int num_local;
+        int rank;
+        int size;
+};
+
+/* Forks size - 1 worker processes connected by unix sockets; returns in
+ * every process with t->rank set. */
+EXTERN int shard_transport_socket(struct shard_transport** t, int size);
+
+EXTERN int alloc_shard(struct shard** s, struct shard_transport* t, struct tl_seq_buffer* sb);
+EXTERN int shard_local_view(struct shard* s, struct tl_seq_buffer* sb);
+EXTERN int shard_full_view(struct shard* s, struct tl_seq_buffer* sb);
+
+EXTERN int shard_allreduce_sum(struct shard* s, double* x, int n);
+EXTERN int shard_allreduce_sum_int(struct shard* s, int* x, int n);
+EXTERN int shard_allreduce_min(struct shard* s, double* x, int n);
+EXTERN int shard_broadcast(struct shard* s, void* buf, size_t len);
+
+EXTERN int shard_reduce_counts(struct shard* s, struct ihmm_model* ihmm);
+EXTERN int shard_broadcast_hyper(struct shard* s, struct ihmm_model* ihmm);
+EXTERN int shard_gather_labels(struct shard* s, int num_models);
+
+EXTERN void free_shard(struct shard* s, struct tl_seq_buffer* sb);
+
+#undef SHARD_IMPORT
+#undef EXTERN
+
+#endif
@@ -1,28 +1,42 @@
 #include "tldevel.h"
+#include <string.h>
 #include "randomkit.h"
 #include "randomkit_tl_add.h"
 
 #include "finite_hmm_alloc.h"
+#include "beam_kernels.h"
 
 #define THREAD_DATA_IMPORT
 #include "thread_data.h"
 
 //#include "global.h"
 
+static int alloc_dyn_rows(double*** m, int rows, int cols);
+static int alloc_dyn_rows_f(float*** m, int rows, int cols);
+static void free_dyn_rows(double** m);
+static void free_dyn_rows_f(float** m);
 
 
 int create_seqer_thread_data(struct seqer_thread_data*** t, int num_threads, int max_len, int K,rk_state* random)
 {
         struct seqer_thread_data** td = NULL;
-        int i,j,c;
+        int i;
 
         MMALLOC(td, sizeof(struct seqer_thread_data*) * num_threads);
         for(i = 0; i < num_threads;i++){
                 td[i] = NULL;
                 MMALLOC(td[i], sizeof(struct seqer_thread_data));
                 td[i]->dyn = NULL;
+                td[i]->dyn_f = NULL;
+                td[i]->kern = NULL;
+                td[i]->u_buf = NULL;
+                td[i]->dyn_multi = NULL;
+                td[i]->u_multi = NULL;
+                td[i]->u_lock = NULL;
+                td[i]->num_dyn_multi = 0;
                 td[i]->fhmm = NULL;
                 td[i]->bias = NULL;
+                td[i]->sched = NULL;
                 td[i]->info = 0;
                 td[i]->num_models = 0;
                 td[i]->num_threads = num_threads;
@@ -34,17 +48,11 @@ int create_seqer_thread_data(struct seqer_thread_data*** t, int num_threads, int
 
                 //  RUNP(matrix = malloc_2d_float(matrix,sb->max_len+1, ft->last_state, 0.0f));
 
-                RUN(galloc(&td[i]->dyn, max_len, K));
+                RUN(alloc_dyn_rows(&td[i]->dyn, max_len, K));
+                RUN(galloc(&td[i]->u_buf, max_len));
 
                 //RUN(galloc(&td[i]->F_matrix, max_len, K));
                 //RUN(galloc(&td[i]->B_matrix, max_len, K));
-                for(j = 0; j < max_len;j++){
-                        for(c = 0; c < K;c++){
-                                td[i]->dyn[j][c] = 0.0;
-                                //td[i]->F_matrix[j][c] = 0.0;
-                                //td[i]->B_matrix[j][c] = 0.0;
-                        }
-                }
 
                 /* was initailized to -INFINITY  */
                 /*if(mode == THREAD_DATA_FULL){
@@ -97,23 +105,21 @@ ERROR:
 
 int resize_seqer_thread_data(struct seqer_thread_data** td, int max_len, int K)
 {
-        int i,j,c;
+        int i;
 
         int num_threads = td[0]->num_threads;
         //LOG_MSG("mallocing auxiliary datastructures to %d %d", max_len,K);
         for(i = 0; i < num_threads;i++){
-                RUN(galloc(&td[i]->dyn, max_len, K));
+                if(td[i]->dyn_f){
+                        RUN(alloc_dyn_rows_f(&td[i]->dyn_f, max_len, K));
+                }else{
+                        RUN(alloc_dyn_rows(&td[i]->dyn, max_len, K));
+                }
+                RUN(galloc(&td[i]->u_buf, max_len));
                 LOG_MSG("Alloc: %d %d", max_len,K);
                 RUN(resize_fhmm_dyn_mat(td[i]->fmat , max_len, K));
                 //RUN(galloc(&td[i]->F_matrix, max_len, K));
                 //RUN(galloc(&td[i]->B_matrix, max_len, K));
-                for(j = 0; j < max_len;j++){
-                        for(c = 0; c < K;c++){
-                                td[i]->dyn[j][c] = 0.0;
-                                //td[i]->F_matrix[j][c] = 0.0;
-                                //td[i]->B_matrix[j][c] = 0.0;
-                        }
-                }
                 /*RUN(galloc(&td[i]->t, K,K));
                 RUN(galloc(&td[i]->e,ALPHABET_PROTEIN,K));
                 for(j = 0; j < K;j++){
@@ -134,6 +140,139 @@ ERROR:
         return FAIL;
 }
 
+/* Switches the beam sampling DP to single precision rows  */
+int set_seqer_thread_data_float_dp(struct seqer_thread_data** td, int max_len, int K)
+{
+        int i;
+        int num_threads = td[0]->num_threads;
+        for(i = 0; i < num_threads;i++){
+                free_dyn_rows(td[i]->dyn);
+                td[i]->dyn = NULL;
+                RUN(alloc_dyn_rows_f(&td[i]->dyn_f, max_len, K));
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Resizes only the beam sampling DP rows (e.g. when long sequences are
+ * sampled in blocks) */
+int resize_seqer_thread_data_dp(struct seqer_thread_data** td, int max_len, int K)
+{
+        int i;
+        int num_threads = td[0]->num_threads;
+        for(i = 0; i < num_threads;i++){
+                if(td[i]->dyn_f){
+                        RUN(alloc_dyn_rows_f(&td[i]->dyn_f, max_len, K));
+                }else{
+                        RUN(alloc_dyn_rows(&td[i]->dyn, max_len, K));
+                }
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Gives every thread one DP matrix per model so that all models can be
+ * run over a sequence in lockstep. */
+int set_seqer_thread_data_lockstep(struct seqer_thread_data** td, int num_models, int max_len, int K)
+{
+        int i,j;
+        int num_threads = td[0]->num_threads;
+
+        ASSERT(num_models > 0, "No models");
+        for(i = 0; i < num_threads;i++){
+                ASSERT(td[i]->dyn_multi == NULL, "Lockstep DP already set");
+                MMALLOC(td[i]->dyn_multi, sizeof(double**) * num_models);
+                for(j = 0; j < num_models;j++){
+                        td[i]->dyn_multi[j] = NULL;
+                }
+                td[i]->num_dyn_multi = num_models;
+                for(j = 0; j < num_models;j++){
+                        RUN(alloc_dyn_rows(&td[i]->dyn_multi[j], max_len, K));
+                }
+                RUN(galloc(&td[i]->u_multi, num_models, max_len));
+                MMALLOC(td[i]->u_lock, sizeof(double*) * num_models);
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* One zeroed block per matrix; each row starts on a BEAM_ROW_ALIGN
+ * boundary so the row kernels can use full width vector loads. */
+int alloc_dyn_rows(double*** m, int rows, int cols)
+{
+        double** r = NULL;
+        double* mem = NULL;
+        size_t stride;
+        int i;
+
+        ASSERT(rows > 0, "No rows");
+        stride = BEAM_ROW_ALIGN / sizeof(double);
+        stride = ((size_t) cols + stride - 1) / stride * stride;
+
+        free_dyn_rows(*m);
+        *m = NULL;
+        MMALLOC(r, sizeof(double*) * rows);
+        if(posix_memalign((void**) &mem, BEAM_ROW_ALIGN, sizeof(double) * stride * rows)){
+                MFREE(r);
+                ERROR_MSG("posix_memalign failed");
+        }
+        memset(mem, 0, sizeof(double) * stride * rows);
+        for(i = 0; i < rows;i++){
+                r[i] = mem + (size_t) i * stride;
+        }
+        *m = r;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+int alloc_dyn_rows_f(float*** m, int rows, int cols)
+{
+        float** r = NULL;
+        float* mem = NULL;
+        size_t stride;
+        int i;
+
+        ASSERT(rows > 0, "No rows");
+        stride = BEAM_ROW_ALIGN / sizeof(float);
+        stride = ((size_t) cols + stride - 1) / stride * stride;
+
+        free_dyn_rows_f(*m);
+        *m = NULL;
+        MMALLOC(r, sizeof(float*) * rows);
+        if(posix_memalign((void**) &mem, BEAM_ROW_ALIGN, sizeof(float) * stride * rows)){
+                MFREE(r);
+                ERROR_MSG("posix_memalign failed");
+        }
+        memset(mem, 0, sizeof(float) * stride * rows);
+        for(i = 0; i < rows;i++){
+                r[i] = mem + (size_t) i * stride;
+        }
+        *m = r;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+void free_dyn_rows(double** m)
+{
+        if(m){
+                free(m[0]);
+                MFREE(m);
+        }
+}
+
+void free_dyn_rows_f(float** m)
+{
+        if(m){
+                free(m[0]);
+                MFREE(m);
+        }
+}
+
 int compare_wims_data(struct seqer_thread_data** a , struct seqer_thread_data** b, int num)
 {
         int i;
@@ -152,11 +291,25 @@ ERROR:
 
 void free_seqer_thread_data(struct seqer_thread_data** td)
 {
-        int i;
+        int i,j;
         if(td){
                 int num_threads = td[0]->num_threads;
                 for(i = 0; i < num_threads;i++){
-                        gfree(td[i]->dyn);
+                        free_dyn_rows(td[i]->dyn);
+                        free_dyn_rows_f(td[i]->dyn_f);
+                        gfree(td[i]->u_buf);
+                        if(td[i]->dyn_multi){
+                                for(j = 0; j < td[i]->num_dyn_multi;j++){
+                                        free_dyn_rows(td[i]->dyn_multi[j]);
+                                }
+                                MFREE(td[i]->dyn_multi);
+                        }
+                        if(td[i]->u_multi){
+                                gfree(td[i]->u_multi);
+                        }
+                        if(td[i]->u_lock){
+                                MFREE(td[i]->u_lock);
+                        }
                         free_fhmm_dyn_mat(td[i]->fmat);
                         //gfree(td[i]->F_matrix);
                         //gfree(td[i]->B_matrix);
@@ -22,7 +22,15 @@ struct seqer_thread_data{
         struct fhmm** fhmm;
         struct fhmm* bias;
         struct fhmm_dyn_mat* fmat;
-        double** dyn;
+        struct beam_scheduler* sched;
+        struct beam_kernels* kern;
+        double** dyn;           /* aligned, padded rows; see alloc_dyn_rows */
+        float** dyn_f;          /* used instead of dyn for single precision DP */
+        double* u_buf;          /* slice variables if not stored per sequence */
+        double*** dyn_multi;    /* one matrix per model for lockstep DP (NULL: off) */
+        double** u_multi;       /* slice variable buffers per model for lockstep DP */
+        double** u_lock;        /* slice variables used by each model (buffer or stored) */
+        int num_dyn_multi;
         int info;
         //double** F_matrix;
         //double** B_matrix;
@@ -39,6 +47,9 @@ struct seqer_thread_data{
 EXTERN int create_seqer_thread_data(struct seqer_thread_data*** t, int num_threads, int max_len, int K,rk_state* random);
 //EXTERN struct seqer_thread_data** create_seqer_thread_data(int* num_threads, int max_len, int K,rk_state* random, int mode);
 EXTERN int resize_seqer_thread_data(struct seqer_thread_data** td, int max_len, int K);
+EXTERN int set_seqer_thread_data_float_dp(struct seqer_thread_data** td, int max_len, int K);
+EXTERN int resize_seqer_thread_data_dp(struct seqer_thread_data** td, int max_len, int K);
+EXTERN int set_seqer_thread_data_lockstep(struct seqer_thread_data** td, int num_models, int max_len, int K);
 EXTERN int compare_seqer_thread_data(struct seqer_thread_data** a , struct seqer_thread_data** b, int num);
 
 EXTERN void free_seqer_thread_data(struct seqer_thread_data** td);
@@ -0,0 +1,228 @@
+#include "tldevel.h"
+
+#include <math.h>
+
+#include "wall_clock.h"
+
+#define TRAIN_CONTROL_IMPORT
+#include "train_control.h"
+
+static int check_convergence(struct train_control* tc);
+
+int alloc_train_control(struct train_control** tc, int num_models, int window, double tol, double budget)
+{
+        struct train_control* t = NULL;
+        int i;
+
+        ASSERT(num_models > 0, "No models");
+        ASSERT(window >= 2, "Window has to be at least 2 (got %d)", window);
+        ASSERT(tol >= 0.0, "Negative tolerance");
+        ASSERT(budget >= 0.0, "Negative time budget");
+
+        MMALLOC(t, sizeof(struct train_control));
+        t->stat = NULL;
+        t->change = NULL;
+        t->tol = tol;
+        t->budget = budget;
+        t->window = window;
+        t->num_models = num_models;
+        t->n = 0;
+        t->reason = TC_STOP_NONE;
+        t->longest = 0.0;
+        t->start = wall_clock();
+        t->last = t->start;
+
+        MMALLOC(t->stat, sizeof(double) * window * num_models * TC_NUM_STAT);
+        MMALLOC(t->change, sizeof(double) * num_models * TC_NUM_STAT);
+        for(i = 0; i < num_models * TC_NUM_STAT;i++){
+                t->change[i] = INFINITY;
+        }
+        *tc = t;
+        return OK;
+ERROR:
+        free_train_control(t);
+        return FAIL;
+}
+
+/* Call once per outer iteration; stop is set if training should end  */
+int train_control_update(struct train_control* tc, const double* stat, int* stop)
+{
+        double now;
+        double* row;
+        int i;
+        int n_stat;
+
+        ASSERT(tc != NULL, "No train control");
+        ASSERT(stat != NULL, "No statistics");
+
+        n_stat = tc->num_models * TC_NUM_STAT;
+        row = tc->stat + (tc->n % tc->window) * n_stat;
+        for(i = 0; i < n_stat;i++){
+                row[i] = stat[i];
+        }
+        tc->n++;
+
+        now = wall_clock();
+        tc->longest = MACRO_MAX(tc->longest, now - tc->last);
+        tc->last = now;
+
+        *stop = 0;
+        if(tc->tol > 0.0 && tc->n >= tc->window){
+                if(check_convergence(tc)){
+                        tc->reason = TC_STOP_CONVERGED;
+                        *stop = 1;
+                        return OK;
+                }
+        }
+        if(tc->budget > 0.0 && now - tc->start + tc->longest > tc->budget){
+                tc->reason = TC_STOP_TIME;
+                *stop = 1;
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Compares the mean of the older and the newer half of the window  */
+int check_convergence(struct train_control* tc)
+{
+        double a,b,scale;
+        int n_stat;
+        int half;
+        int i,j;
+        int r;
+        int converged;
+
+        n_stat = tc->num_models * TC_NUM_STAT;
+        half = tc->window / 2;
+        converged = 1;
+        for(i = 0; i < n_stat;i++){
+                a = 0.0;
+                b = 0.0;
+                for(j = 0; j < half;j++){
+                        /* oldest first */
+                        r = (tc->n + j) % tc->window;
+                        a += tc->stat[r * n_stat + i];
+                        r = (tc->n + tc->window - half + j) % tc->window;
+                        b += tc->stat[r * n_stat + i];
+                }
+                a /= (double) half;
+                b /= (double) half;
+                scale = MACRO_MAX(fabs(a), fabs(b));
+                if(scale < 1e-12){
+                        tc->change[i] = 0.0;
+                }else{
+                        tc->change[i] = fabs(b - a) / scale;
+                }
+                if(tc->change[i] > tc->tol){
+                        converged = 0;
+                }
+        }
+        return converged;
+}
+
+int train_control_report(struct train_control* tc)
+{
+        double* row;
+        int n_stat;
+        int i,j;
+
+        ASSERT(tc != NULL, "No train control");
+
+        if(tc->reason == TC_STOP_NONE){
+                tc->reason = TC_STOP_MAX_ITER;
+        }
+        LOG_MSG("Training stopped after %d rounds (%0.1fs): %s.", tc->n, wall_clock() - tc->start, train_control_reason(tc->reason));
+        if(tc->n == 0){
+                return OK;
+        }
+        n_stat = tc->num_models * TC_NUM_STAT;
+        row = tc->stat + ((tc->n - 1) % tc->window) * n_stat;
+        for(i = 0; i < tc->num_models;i++){
+                j = i * TC_NUM_STAT;
+                LOG_MSG("Model %d: %d states, alpha = %f, gamma = %f, mean LL = %f", i, (int) row[j + TC_STAT_STATES], row[j + TC_STAT_ALPHA], row[j + TC_STAT_GAMMA], row[j + TC_STAT_LL]);
+                if(tc->tol > 0.0 && tc->n >= tc->window){
+                        LOG_MSG("Model %d: relative change over the last %d rounds: states %f, alpha %f, gamma %f, LL %f (tolerance %f)", i, tc->window, tc->change[j + TC_STAT_STATES], tc->change[j + TC_STAT_ALPHA], tc->change[j + TC_STAT_GAMMA], tc->change[j + TC_STAT_LL], tc->tol);
+                }
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+const char* train_control_reason(int reason)
+{
+        switch(reason){
+        case TC_STOP_MAX_ITER:
+                return "maximum number of iterations reached";
+        case TC_STOP_CONVERGED:
+                return "converged";
+        case TC_STOP_TIME:
+                return "time budget reached";
+        default:
+                break;
+        }
+        return "still running";
+}
+
+void free_train_control(struct train_control* tc)
+{
+        if(tc){
+                if(tc->stat){
+                        MFREE(tc->stat);
+                }
+                if(tc->change){
+                        MFREE(tc->change);
+                }
+                MFREE(tc);
+        }
+}
+
+#ifdef ITESTTRAINCONTROL
+int main(void)
+{
+        struct train_control* tc = NULL;
+        double stat[TC_NUM_STAT];
+        int stop;
+        int i;
+
+        /* a drifting statistic never converges; a stable one does once
+           the window is full */
+        RUN(alloc_train_control(&tc, 1, 10, 0.01, 0.0));
+        for(i = 0; i < 30;i++){
+                stat[TC_STAT_STATES] = 10.0 + (double) i;
+                stat[TC_STAT_ALPHA] = 1.0;
+                stat[TC_STAT_GAMMA] = 2.0;
+                stat[TC_STAT_LL] = -100.0;
+                RUN(train_control_update(tc, stat, &stop));
+                ASSERT(stop == 0, "Stopped with drifting states at %d", i);
+        }
+        for(i = 0; i < 30;i++){
+                stat[TC_STAT_STATES] = 40.0;
+                stat[TC_STAT_LL] = -100.0 + ((i & 1) ? 0.1 : -0.1);
+                RUN(train_control_update(tc, stat, &stop));
+                if(stop){
+                        break;
+                }
+        }
+        ASSERT(stop == 1, "Did not converge");
+        ASSERT(tc->reason == TC_STOP_CONVERGED, "Wrong reason: %s", train_control_reason(tc->reason));
+        /* at least half of the window has to be stable */
+        ASSERT(i >= 5, "Converged too early (%d)", i);
+        RUN(train_control_report(tc));
+        free_train_control(tc);
+        tc = NULL;
+
+        /* tiny time budget  */
+        RUN(alloc_train_control(&tc, 1, 10, 0.0, 1e-9));
+        RUN(train_control_update(tc, stat, &stop));
+        ASSERT(stop == 1, "Time budget ignored");
+        ASSERT(tc->reason == TC_STOP_TIME, "Wrong reason: %s", train_control_reason(tc->reason));
+        free_train_control(tc);
+        LOG_MSG("Train control test passed.");
+        return EXIT_SUCCESS;
+ERROR:
+        free_train_control(tc);
+        return EXIT_FAILURE;
+}
+#endif
@@ -0,0 +1,52 @@
+#ifndef TRAIN_CONTROL_H
+#define TRAIN_CONTROL_H
+
+#ifdef TRAIN_CONTROL_IMPORT
+#define EXTERN
+#else
+#define EXTERN extern
+#endif
+
+/* Decides when to stop training. After every outer iteration the caller
+ * passes TC_NUM_STAT statistics per model (number of states, alpha,
+ * gamma and mean log likelihood). Training has converged once, for
+ * every statistic, the means of the two halves of the last window
+ * iterations differ by less than tol (relative). Independently training
+ * stops before an iteration that is expected to overrun the time
+ * budget. */
+
+#define TC_STAT_STATES 0
+#define TC_STAT_ALPHA 1
+#define TC_STAT_GAMMA 2
+#define TC_STAT_LL 3
+#define TC_NUM_STAT 4
+
+#define TC_STOP_NONE 0
+#define TC_STOP_MAX_ITER 1
+#define TC_STOP_CONVERGED 2
+#define TC_STOP_TIME 3
+
+struct train_control{
+        double* stat;           /* window rows of num_models * TC_NUM_STAT */
+        double* change;         /* last relative change of each statistic */
+        double tol;             /* 0: no convergence test */
+        double budget;          /* seconds; 0: no limit */
+        double start;
+        double last;
+        double longest;         /* longest iteration so far (seconds) */
+        int window;
+        int num_models;
+        int n;
+        int reason;
+};
+
+EXTERN int alloc_train_control(struct train_control** tc, int num_models, int window, double tol, double budget);
+EXTERN int train_control_update(struct train_control* tc, const double* stat, int* stop);
+EXTERN int train_control_report(struct train_control* tc);
+EXTERN const char* train_control_reason(int reason);
+EXTERN void free_train_control(struct train_control* tc);
+
+#undef TRAIN_CONTROL_IMPORT
+#undef EXTERN
+
+#endif
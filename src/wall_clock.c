@@ -0,0 +1,11 @@
+#include <time.h>
+
+#define WALL_CLOCK_IMPORT
+#include "wall_clock.h"
+
+double wall_clock(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
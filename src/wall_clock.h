@@ -0,0 +1,16 @@
+#ifndef WALL_CLOCK_H
+#define WALL_CLOCK_H
+
+#ifdef WALL_CLOCK_IMPORT
+#define EXTERN
+#else
+#define EXTERN extern
+#endif
+
+/* Seconds on a monotonic clock; only differences are meaningful. */
+EXTERN double wall_clock(void);
+
+#undef WALL_CLOCK_IMPORT
+#undef EXTERN
+
+#endif